@@ -0,0 +1,328 @@
+// Loop-latency benchmarks for the host simulation (env:native).
+//
+//   pio run -e native
+//   .pio/build/native/program                          # all scenarios
+//   .pio/build/native/program rainbow --seconds 120 --frames rainbow.txt
+//
+// Each scenario boots the firmware with setup(), lets Wi‑Fi, MQTT and NTP come up
+// on the virtual clock, configures the watch over MQTT and then measures every
+// loop() pass: wall time (excluding the wait at its end, like /stats) and heap
+// allocations. Render frames are counted separately: "wakes" is how often the render
+// task ran, "render us" its wall time per wake-up, "frame us" the firmware's own
+// profiler figure for drawing and pushing one frame (/metrics). "duty %" (both tasks)
+// and "mA" are the firmware's power estimate for its last window (/stats). "cmd/s" and
+// "allocs/cmd" time the MQTT callback alone: commands handled per second of its wall
+// time, and heap allocations per command, the response included. With
+// --frames, every strip write is dumped (see sim.h) so two builds can be compared with diff.
+//
+// With --broker host:port the watch talks to a real MQTT broker and runs in real time,
+// so several of them (each with its own --device-id) can be driven together; the
+// "serve" scenario just keeps one running. tools/fleet_sim.py does this for a fleet.
+#include <Arduino.h>
+#include <algorithm>
+#include <chrono>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+void setup();
+void loop();
+extern const char* device_id;
+
+namespace {
+
+#define WARMUP_MS 5000 // Virtual time for Wi‑Fi, MQTT and NTP to come up
+#define SETTLE_MS 500  // Virtual time for the scenario's own commands to be handled
+
+std::string commandTopic;   // The watch's own, from device_id
+std::string responseTopic;
+
+struct Scenario {
+  const char* name;
+  const char* description;
+  void (*prepare)();
+  void (*tick)();  // Called before every measured loop()
+};
+
+void prepareClock() {
+  sim::mqttInject(commandTopic.c_str(), "{\"command\":\"batch\",\"ops\":["
+                  "{\"command\":\"setMode\",\"value\":1},"
+                  "{\"command\":\"setColor\",\"red\":0,\"green\":128,\"blue\":255},"
+                  "{\"command\":\"setAutoBrightness\",\"enabled\":false}]}");
+}
+
+void prepareRainbow() {
+  sim::mqttInject(commandTopic.c_str(), "{\"command\":\"batch\",\"ops\":["
+                  "{\"command\":\"setMode\",\"value\":0},"
+                  "{\"command\":\"setRainbowSpeed\",\"value\":5}]}");
+}
+
+void prepareServe() {}
+
+void prepareTimer() {
+  prepareClock();
+  sim::mqttInject(commandTopic.c_str(), "{\"command\":\"startTimer\",\"minutes\":0,\"seconds\":30}");
+}
+
+// Twenty commands every second: single settings, a batch, status requests and text
+void tickMqttBurst() {
+  static unsigned long nextBurst = 0;
+  if ((long)(millis() - nextBurst) < 0) return;
+  nextBurst = millis() + 1000;
+  uint32_t burst = millis() / 1000;
+
+  char message[160];
+  for (int i = 0; i < 20; i++) {
+    switch (i % 5) {
+      case 0:
+        snprintf(message, sizeof(message), "{\"command\":\"setBrightness\",\"value\":%d}", 10 + (burst + i) % 200);
+        break;
+      case 1:
+        snprintf(message, sizeof(message), "{\"command\":\"setColor\",\"red\":%d,\"green\":64,\"blue\":32}", i * 12);
+        break;
+      case 2:
+        snprintf(message, sizeof(message), "{\"command\":\"batch\",\"ops\":[{\"command\":\"setMode\",\"value\":%d},"
+                 "{\"command\":\"setRainbowSpeed\",\"value\":%d}]}", i % 2, 1 + i % 10);
+        break;
+      case 3:
+        snprintf(message, sizeof(message), "{\"command\":\"getStatus\"}");
+        break;
+      default:
+        snprintf(message, sizeof(message), "{\"command\":\"showText\",\"text\":\"burst %d\",\"speed\":200}", i);
+        break;
+    }
+    sim::mqttInject(commandTopic.c_str(), message);
+  }
+}
+
+// One command every loop() pass, a different one each time, for cmd/s and allocs/cmd.
+// All of them existed before the command table, so the figures compare with old builds
+void tickCommands() {
+  static const char* const messages[] = {
+    "{\"command\":\"setBrightness\",\"value\":120}",
+    "{\"command\":\"setColor\",\"red\":255,\"green\":96,\"blue\":0}",
+    "{\"command\":\"setMode\",\"value\":1}",
+    "{\"command\":\"setRainbowSpeed\",\"value\":4}",
+    "{\"command\":\"setAutoBrightness\",\"enabled\":false}",
+    "{\"command\":\"setDayBrightness\",\"value\":80}",
+    "{\"command\":\"showText\",\"text\":\"hello\",\"speed\":200}",
+    "{\"command\":\"noSuchCommand\"}",
+  };
+  static size_t next = 0;
+  sim::mqttInject(commandTopic.c_str(), messages[next++ % (sizeof(messages) / sizeof(messages[0]))]);
+}
+
+const Scenario scenarios[] = {
+  {"clock", "static colour clock", prepareClock, NULL},
+  {"rainbow", "rainbow clock, speed 5", prepareRainbow, NULL},
+  {"timer", "30 s countdown to completion", prepareTimer, NULL},
+  {"mqtt-burst", "20 MQTT commands per second", prepareClock, tickMqttBurst},
+  {"commands", "one MQTT command per loop() pass", prepareClock, tickCommands},
+  {"serve", "no commands; for --broker", prepareServe, NULL},
+};
+
+uint64_t wallNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+double percentile(std::vector<uint64_t>& samples, double p) {
+  if (samples.empty()) return 0;
+  size_t index = std::min(samples.size() - 1, (size_t)(samples.size() * p / 100));
+  std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+  return samples[index];
+}
+
+void printHeader() {
+  printf("%-11s %6s %8s %8s %8s %9s %9s %10s %7s %6s %9s %8s %9s %7s %9s %5s %6s %4s %8s %10s\n",
+         "scenario", "iters", "p50 us", "p99 us", "max us", "allocs/it", "max alloc",
+         "bytes/it", "frames", "wakes", "render us", "frame us", "r allocs", "mqtt tx", "tx bytes", "nvs",
+         "duty %", "mA", "cmd/s", "allocs/cmd");
+}
+
+// Total seconds and runs of a profiler stage, from /metrics; zero without the profiler
+struct StageTotal {
+  double seconds;
+  double count;
+};
+
+StageTotal readStage(const char* stage) {
+  StageTotal total = {0, 0};
+  std::string body;
+  if (sim::httpGet("/metrics", &body) != 200) return total;
+
+  std::string sum = std::string("watch_stage_seconds_sum{stage=\"") + stage + "\"} ";
+  std::string count = std::string("watch_stage_seconds_count{stage=\"") + stage + "\"} ";
+  size_t at = body.find(sum);
+  if (at != std::string::npos) total.seconds = atof(body.c_str() + at + sum.size());
+  at = body.find(count);
+  if (at != std::string::npos) total.count = atof(body.c_str() + at + count.size());
+  return total;
+}
+
+// A number field of /stats
+double readStat(const char* name) {
+  std::string body;
+  if (sim::httpGet("/stats", &body) != 200) return 0;
+
+  std::string key = std::string("\"") + name + "\":";
+  size_t at = body.find(key);
+  return at == std::string::npos ? 0 : atof(body.c_str() + at + key.size());
+}
+
+void runScenario(const Scenario& scenario, uint32_t seconds) {
+  setup();
+  while (millis() < WARMUP_MS) {
+    loop();
+  }
+  uint32_t handled = sim::mqttCallbacks().calls;
+  scenario.prepare();
+  unsigned long settled = millis() + SETTLE_MS;
+  while (millis() < settled) {
+    loop();
+  }
+  // A scenario whose commands were not applied would measure the default display instead
+  if (sim::mqttCallbacks().calls != handled) {
+    std::string response = sim::mqttLastPayload(responseTopic.c_str());
+    if (response.empty() || response.find("\"error\"") != std::string::npos ||
+        response.find("\"applied\":false") != std::string::npos) {
+      fprintf(stderr, "%s: setup commands not applied: %s\n", scenario.name,
+              response.empty() ? "no response" : response.c_str());
+      fflush(stdout);
+      _exit(3);
+    }
+  }
+
+  std::vector<uint64_t> loopNs;
+  uint64_t allocCount = 0, allocBytes = 0, allocMax = 0;
+  uint64_t renderStartNs = sim::taskWallNs();
+  uint32_t renderStartRuns = sim::taskRuns();
+  sim::AllocStats renderStartAllocs = sim::taskAllocs();
+  uint32_t publishedStart = sim::mqttPublished();
+  uint64_t publishedBytesStart = sim::mqttPublishedBytes();
+  uint32_t nvsStart = sim::nvsWrites();
+  uint32_t framesStart = sim::framesShown();
+  StageTotal frameStart = readStage("frame");
+  sim::CallbackStats callbacksStart = sim::mqttCallbacks();
+
+  unsigned long end = millis() + seconds * 1000UL;
+  while (millis() < end) {
+    if (scenario.tick) scenario.tick();
+
+    sim::AllocStats allocsBefore = sim::threadAllocs();
+    uint64_t idleBefore = sim::idleWallNs();
+    uint64_t start = wallNs();
+    loop();
+    uint64_t elapsed = wallNs() - start - (sim::idleWallNs() - idleBefore);
+    sim::AllocStats allocsAfter = sim::threadAllocs();
+
+    loopNs.push_back(elapsed);
+    uint64_t allocs = allocsAfter.allocs - allocsBefore.allocs;
+    allocCount += allocs;
+    allocBytes += allocsAfter.bytes - allocsBefore.bytes;
+    allocMax = std::max(allocMax, allocs);
+  }
+
+  size_t iterations = loopNs.size();
+  uint32_t renderRuns = sim::taskRuns() - renderStartRuns;
+  StageTotal frameEnd = readStage("frame");
+  double frames = frameEnd.count - frameStart.count;
+  sim::CallbackStats callbacks = sim::mqttCallbacks();
+  uint32_t commands = callbacks.calls - callbacksStart.calls;
+  uint64_t commandNs = callbacks.wallNs - callbacksStart.wallNs;
+  uint64_t maxNs = *std::max_element(loopNs.begin(), loopNs.end());
+  printf("%-11s %6zu %8.1f %8.1f %8.1f %9.2f %9llu %10.1f %7u %6u %9.1f %8.2f %9llu %7u %9llu %5u %6.3f %4.0f %8.0f %10.2f\n",
+         scenario.name, iterations,
+         percentile(loopNs, 50) / 1000.0, percentile(loopNs, 99) / 1000.0, maxNs / 1000.0,
+         (double)allocCount / iterations, (unsigned long long)allocMax, (double)allocBytes / iterations,
+         sim::framesShown() - framesStart, renderRuns,
+         renderRuns ? (sim::taskWallNs() - renderStartNs) / 1000.0 / renderRuns : 0.0,
+         frames > 0 ? (frameEnd.seconds - frameStart.seconds) * 1e6 / frames : 0.0,
+         (unsigned long long)(sim::taskAllocs().allocs - renderStartAllocs.allocs),
+         sim::mqttPublished() - publishedStart,
+         (unsigned long long)(sim::mqttPublishedBytes() - publishedBytesStart),
+         sim::nvsWrites() - nvsStart,
+         (readStat("loopDuty") + readStat("renderDuty")) * 100, readStat("currentMa"),
+         commandNs ? commands * 1e9 / commandNs : 0.0,
+         commands ? (double)(callbacks.allocs - callbacksStart.allocs) / commands : 0.0);
+  fflush(stdout);
+}
+
+void usage() {
+  fprintf(stderr, "usage: program [scenario|all] [--seconds N] [--frames FILE] [--verbose]\n"
+                  "               [--device-id ID] [--broker HOST:PORT]\nscenarios:\n");
+  for (const Scenario& scenario : scenarios) {
+    fprintf(stderr, "  %-11s %s\n", scenario.name, scenario.description);
+  }
+}
+
+}  // namespace
+
+// pio test links this file too (test_build_src); the test runner has its own main()
+#ifndef PIO_UNIT_TESTING
+int main(int argc, char** argv) {
+  const char* name = "all";
+  const char* framePath = NULL;
+  uint32_t seconds = 60;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+      seconds = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      framePath = argv[++i];
+    } else if (strcmp(argv[i], "--verbose") == 0) {
+      sim::verbose = true;
+    } else if (strcmp(argv[i], "--device-id") == 0 && i + 1 < argc) {
+      device_id = argv[++i];
+    } else if (strcmp(argv[i], "--broker") == 0 && i + 1 < argc) {
+      sim::brokerAddress = argv[++i];
+    } else if (argv[i][0] != '-') {
+      name = argv[i];
+    } else {
+      usage();
+      return 2;
+    }
+  }
+
+  commandTopic = std::string("esp32watch/") + device_id + "/command";
+  responseTopic = std::string("esp32watch/") + device_id + "/response";
+  bool all = strcmp(name, "all") == 0;
+  bool found = all;
+  for (const Scenario& scenario : scenarios) {
+    found |= strcmp(name, scenario.name) == 0;
+  }
+  if (!found) {
+    usage();
+    return 2;
+  }
+
+  // Firmware state is global and setup() runs once, so every scenario gets its own process
+  printHeader();
+  fflush(stdout);
+  int failed = 0;
+  for (const Scenario& scenario : scenarios) {
+    if (!all && strcmp(name, scenario.name) != 0) continue;
+
+    pid_t child = fork();
+    if (child == 0) {
+      if (sim::brokerAddress) sim::startRealTime();
+      if (framePath) {
+        std::string path = all ? std::string(scenario.name) + "-" + framePath : framePath;
+        sim::openFrameDump(path.c_str());
+      }
+      runScenario(scenario, seconds);
+      sim::closeFrameDump();
+      _exit(0);  // The render task is parked on the virtual clock; do not run destructors
+    }
+    int status;
+    waitpid(child, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "%s: failed (%s %d)\n", scenario.name,
+              WIFSIGNALED(status) ? "signal" : "exit status",
+              WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+      failed++;
+    }
+  }
+  return failed ? 1 : 0;
+}
+#endif
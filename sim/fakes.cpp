@@ -0,0 +1,1134 @@
+// Implementation of the host fakes declared in sim/fakes/
+#include <Arduino.h>
+#include <FastLED.h>
+#include <WiFi.h>
+#include <ezTime.h>
+#include <Preferences.h>
+#include <PubSubClient.h>
+#include <ESPAsyncWebServer.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// ===== Allocation counters =====
+// glibc's own entry points do the work; the wrappers only count per thread
+
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+extern "C" void __libc_free(void* ptr);
+
+static thread_local sim::AllocStats allocStats;
+
+extern "C" void* malloc(size_t size) {
+  allocStats.allocs++;
+  allocStats.bytes += size;
+  return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size) {
+  allocStats.allocs++;
+  allocStats.bytes += count * size;
+  return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size) {
+  allocStats.allocs++;
+  allocStats.bytes += size;
+  if (ptr) allocStats.frees++;
+  return __libc_realloc(ptr, size);
+}
+
+extern "C" void free(void* ptr) {
+  if (ptr) allocStats.frees++;
+  __libc_free(ptr);
+}
+
+sim::AllocStats sim::threadAllocs() {
+  return allocStats;
+}
+
+// ===== Virtual clock and tasks =====
+
+namespace {
+
+typedef std::chrono::steady_clock WallClock;
+
+struct Task {
+  void (*code)(void*);
+  void* param;
+  uint64_t wakeUs = 0;
+  bool blocked = false;
+  uint32_t notifications = 0;
+  bool takingNotification = false;  // Blocked in ulTaskNotifyTake(); a notification wakes it
+  sim::AllocStats allocs = {};  // Copied from the task thread each time it blocks
+};
+
+// Never destroyed: task threads are still parked on them when the process exits
+std::mutex& clockMutex = *new std::mutex;
+std::condition_variable& clockCv = *new std::condition_variable;
+std::atomic<uint64_t> clockUs(0);
+std::vector<Task*> tasks;
+thread_local Task* currentTask = NULL;
+uint64_t taskNs = 0;
+uint32_t taskWakeups = 0;
+uint64_t idleNs = 0;
+uint32_t loopNotifications = 0;  // Given to the loop() thread (handle NULL)
+WallClock::time_point realStart;  // Wall time at clock 0 (see sim::startRealTime())
+int64_t realStartEpochUs = 0;     // System time then
+
+uint64_t wallNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(WallClock::now().time_since_epoch()).count();
+}
+
+// In real time, hold the clock back until the wall clock reaches it
+void waitForWall(uint64_t us) {
+  if (sim::realTime) std::this_thread::sleep_until(realStart + std::chrono::microseconds(us));
+}
+
+// Park the calling task until the clock reaches wakeUs
+void blockTask(Task* task, uint64_t wakeUs) {
+  std::unique_lock<std::mutex> lock(clockMutex);
+  task->wakeUs = wakeUs;
+  task->allocs = allocStats;
+  task->blocked = true;
+  clockCv.notify_all();
+  clockCv.wait(lock, [task] { return !task->blocked; });
+}
+
+}  // namespace
+
+bool sim::realTime = false;
+
+uint64_t sim::nowUs() {
+  return clockUs;
+}
+
+void sim::startRealTime() {
+  realTime = true;
+  realStartEpochUs = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count() - clockUs;
+  realStart = WallClock::now() - std::chrono::microseconds(clockUs);
+}
+
+void sim::advance(uint64_t us) {
+  std::unique_lock<std::mutex> lock(clockMutex);
+  uint64_t target = clockUs + us;
+
+  for (;;) {
+    // Run the task that is due first, if any is due before the target
+    Task* next = NULL;
+    for (Task* task : tasks) {
+      if (task->blocked && task->wakeUs <= target && (!next || task->wakeUs < next->wakeUs)) {
+        next = task;
+      }
+    }
+    if (!next) break;
+
+    if (next->wakeUs > clockUs) clockUs = next->wakeUs;
+    waitForWall(clockUs);
+    uint64_t start = wallNs();
+    next->blocked = false;
+    clockCv.notify_all();
+    clockCv.wait(lock, [next] { return next->blocked; });
+    taskNs += wallNs() - start;
+    taskWakeups++;
+  }
+  waitForWall(target);
+  clockUs = target;
+}
+
+uint64_t sim::taskWallNs() {
+  return taskNs;
+}
+
+uint32_t sim::taskRuns() {
+  return taskWakeups;
+}
+
+uint64_t sim::idleWallNs() {
+  return idleNs;
+}
+
+sim::AllocStats sim::taskAllocs() {
+  std::lock_guard<std::mutex> lock(clockMutex);
+  sim::AllocStats total = {};
+  for (Task* task : tasks) {
+    total.allocs += task->allocs.allocs;
+    total.frees += task->allocs.frees;
+    total.bytes += task->allocs.bytes;
+  }
+  return total;
+}
+
+unsigned long millis() {
+  return clockUs / 1000;
+}
+
+unsigned long micros() {
+  return clockUs;
+}
+
+void delay(unsigned long ms) {
+  if (currentTask) {
+    vTaskDelay(pdMS_TO_TICKS(ms));
+    return;
+  }
+  uint64_t start = wallNs();
+  sim::advance((uint64_t)ms * 1000);
+  idleNs += wallNs() - start;
+}
+
+void yield() {}
+
+TickType_t xTaskGetTickCount() {
+  return clockUs / 1000;
+}
+
+void vTaskDelayUntil(TickType_t* previousWake, TickType_t period) {
+  *previousWake += period;
+  uint64_t wakeUs = (uint64_t)*previousWake * 1000;
+  if (currentTask && wakeUs > clockUs) {
+    blockTask(currentTask, wakeUs);
+  }
+}
+
+void vTaskDelay(TickType_t ticks) {
+  if (currentTask) {
+    blockTask(currentTask, clockUs + (uint64_t)ticks * 1000);
+  } else {
+    sim::advance((uint64_t)ticks * 1000);
+  }
+}
+
+// The task runs until it first blocks before this returns, as a higher-priority
+// task would on the device
+BaseType_t xTaskCreatePinnedToCore(void (*code)(void*), const char*, uint32_t,
+                                   void* param, unsigned, TaskHandle_t* handle, int) {
+  Task* task = new Task();
+  task->code = code;
+  task->param = param;
+  {
+    std::lock_guard<std::mutex> lock(clockMutex);
+    tasks.push_back(task);
+  }
+
+  std::thread([task] {
+    currentTask = task;
+    task->code(task->param);
+  }).detach();
+
+  std::unique_lock<std::mutex> lock(clockMutex);
+  clockCv.wait(lock, [task] { return task->blocked; });
+  if (handle) *handle = task;
+  return pdPASS;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle() {
+  return currentTask;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clearCountOnExit, TickType_t ticksToWait) {
+  if (!currentTask) {
+    if (loopNotifications == 0) delay(ticksToWait);
+    uint32_t count = loopNotifications;
+    loopNotifications = clearCountOnExit ? 0 : (count ? count - 1 : 0);
+    return count;
+  }
+
+  std::unique_lock<std::mutex> lock(clockMutex);
+  if (currentTask->notifications == 0 && ticksToWait > 0) {
+    currentTask->wakeUs = clockUs + (uint64_t)ticksToWait * 1000;
+    currentTask->allocs = allocStats;
+    currentTask->takingNotification = true;
+    currentTask->blocked = true;
+    clockCv.notify_all();
+    clockCv.wait(lock, [] { return !currentTask->blocked; });
+    currentTask->takingNotification = false;
+  }
+  uint32_t count = currentTask->notifications;
+  currentTask->notifications = clearCountOnExit ? 0 : (count ? count - 1 : 0);
+  return count;
+}
+
+// A waiting task runs at the current virtual time, the next time the clock is advanced
+BaseType_t xTaskNotifyGive(TaskHandle_t handle) {
+  std::lock_guard<std::mutex> lock(clockMutex);
+  Task* task = static_cast<Task*>(handle);
+  if (!task) {
+    loopNotifications++;
+    return pdPASS;
+  }
+  task->notifications++;
+  if (task->blocked && task->takingNotification && task->wakeUs > clockUs) {
+    task->wakeUs = clockUs;
+  }
+  return pdPASS;
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex() {
+  return new std::recursive_mutex;
+}
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t mutex, TickType_t) {
+  static_cast<std::recursive_mutex*>(mutex)->lock();
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t mutex) {
+  static_cast<std::recursive_mutex*>(mutex)->unlock();
+  return pdTRUE;
+}
+
+// ===== Core =====
+
+HardwareSerial Serial;
+EspClass ESP;
+
+// At 240 MHz, so profiler figures are host work scaled to the ESP32's clock rate
+uint32_t EspClass::getCycleCount() {
+  return wallNs() * 240 / 1000;
+}
+bool sim::verbose = false;
+
+// Fixed-seed generator so runs repeat exactly
+static uint32_t randomState = 1;
+
+uint32_t esp_random() {
+  randomState = randomState * 1664525u + 1013904223u;
+  return randomState;
+}
+
+long random(long max) {
+  return max > 0 ? esp_random() % max : 0;
+}
+
+long random(long min, long max) {
+  return max > min ? min + random(max - min) : min;
+}
+
+void randomSeed(unsigned long seed) {
+  randomState = seed;
+}
+
+int esp_register_shutdown_handler(shutdown_handler_t) {
+  return 0;
+}
+
+int sim::resetReason = ESP_RST_POWERON;
+
+esp_reset_reason_t esp_reset_reason() {
+  return (esp_reset_reason_t)sim::resetReason;
+}
+
+size_t Print::write(const uint8_t*, size_t size) {
+  return size;
+}
+
+size_t Print::printf(const char* format, ...) {
+  char buffer[256];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  if (length <= 0) return 0;
+  return write((const uint8_t*)buffer, min((size_t)length, sizeof(buffer) - 1));
+}
+
+size_t HardwareSerial::write(const uint8_t* buffer, size_t size) {
+  if (sim::verbose) fwrite(buffer, 1, size, stderr);
+  return size;
+}
+
+String IPAddress::toString() const {
+  char text[16];
+  snprintf(text, sizeof(text), "%u.%u.%u.%u", (*this)[0], (*this)[1], (*this)[2], (*this)[3]);
+  return String(text);
+}
+
+// ===== FastLED =====
+
+CFastLED FastLED;
+
+static FILE* frameFile = NULL;
+static uint32_t frameCount = 0;
+
+void sim::openFrameDump(const char* path) {
+  frameFile = fopen(path, "w");
+  if (!frameFile) {
+    perror(path);
+  } else if (sim::realTime) {
+    fprintf(frameFile, "# epoch %lld\n", (long long)(realStartEpochUs / 1000));
+  }
+}
+
+void sim::closeFrameDump() {
+  if (frameFile) fclose(frameFile);
+  frameFile = NULL;
+}
+
+uint32_t sim::framesShown() {
+  return frameCount;
+}
+
+static uint8_t scale8(uint8_t i, uint8_t scale) {
+  return ((uint16_t)i * (1 + (uint16_t)scale)) >> 8;
+}
+
+static uint8_t scale8_video(uint8_t i, uint8_t scale) {
+  return (((uint16_t)i * scale) >> 8) + ((i && scale) ? 1 : 0);
+}
+
+// FastLED's "rainbow" hue mapping (yellow boosted, no green scaling)
+void hsv2rgb_rainbow(const CHSV& hsv, CRGB& rgb) {
+  uint8_t hue = hsv.h;
+  uint8_t offset8 = (hue & 0x1F) << 3;
+  uint8_t third = scale8(offset8, 256 / 3);
+  uint8_t twoThirds = scale8(offset8, 256 * 2 / 3);
+  uint8_t r, g, b;
+
+  switch (hue >> 5) {
+    case 0:  r = 255 - third; g = third;           b = 0;                break; // Red to orange
+    case 1:  r = 171;         g = 85 + third;      b = 0;                break; // Orange to yellow
+    case 2:  r = 171 - twoThirds; g = 170 + third; b = 0;                break; // Yellow to green
+    case 3:  r = 0;           g = 255 - third;     b = third;            break; // Green to aqua
+    case 4:  r = 0;           g = 171 - twoThirds; b = 85 + twoThirds;   break; // Aqua to blue
+    case 5:  r = third;       g = 0;               b = 255 - third;      break; // Blue to purple
+    case 6:  r = 85 + third;  g = 0;               b = 171 - third;      break; // Purple to pink
+    default: r = 170 + third; g = 0;               b = 85 - third;       break; // Pink to red
+  }
+
+  if (hsv.s != 255) {
+    uint8_t desat = scale8_video(255 - hsv.s, 255 - hsv.s);
+    uint8_t satScale = 255 - desat;
+    r = scale8(r, satScale) + desat;
+    g = scale8(g, satScale) + desat;
+    b = scale8(b, satScale) + desat;
+  }
+  if (hsv.v != 255) {
+    uint8_t val = scale8_video(hsv.v, hsv.v);
+    r = scale8(r, val);
+    g = scale8(g, val);
+    b = scale8(b, val);
+  }
+  rgb = CRGB(r, g, b);
+}
+
+void CLEDController::init(int controllerIndex, CRGB* leds, int ledCount) {
+  index = controllerIndex;
+  data = leds;
+  count = ledCount;
+}
+
+void CLEDController::showLeds(uint8_t brightness) {
+  frameCount++;
+  if (!frameFile) return;
+
+  fprintf(frameFile, "%lu %d %u", millis(), index, brightness);
+  for (int i = 0; i < count; i++) {
+    fprintf(frameFile, " %02X%02X%02X", data[i].r, data[i].g, data[i].b);
+  }
+  fputc('\n', frameFile);
+}
+
+void CFastLED::clear(bool writeData) {
+  for (int i = 0; i < controllerCount; i++) {
+    CLEDController& controller = controllers[i];
+    for (int led = 0; led < controller.size(); led++) {
+      controller.leds()[led] = CRGB::Black;
+    }
+  }
+  if (writeData) show();
+}
+
+void CFastLED::show() {
+  for (int i = 0; i < controllerCount; i++) {
+    controllers[i].showLeds(brightness);
+  }
+}
+
+// ===== WiFi =====
+
+WiFiClass WiFi;
+uint32_t sim::wifiJoinMs = 800;
+uint32_t sim::wifiScanMs = 400;
+uint32_t sim::wifiDhcpMs = 250;
+int32_t sim::wifiChannel = 6;
+bool sim::wifiAvailable = true;
+static uint8_t apBssid[6] = {0x24, 0x0a, 0xc4, 0x5e, 0x11, 0x80};
+#define WIFI_PROBE_MS 100 // A targeted join gives up after one channel's probe
+
+wl_status_t WiFiClass::begin(const char*, const char*, int32_t channel,
+                             const uint8_t* bssid, bool) {
+  joining = true;
+  targeted = channel > 0 && bssid;
+  wrongAp = targeted && (channel != sim::wifiChannel || memcmp(bssid, apBssid, sizeof(apBssid)) != 0);
+  joinStartUs = clockUs;
+  return WL_DISCONNECTED;
+}
+
+bool WiFiClass::config(IPAddress localIp, IPAddress, IPAddress, IPAddress, IPAddress) {
+  staticIp = localIp; // 0 switches back to DHCP
+  return true;
+}
+
+wl_status_t WiFiClass::status() {
+  if (!joining) return WL_DISCONNECTED;
+  uint64_t elapsedUs = clockUs - joinStartUs;
+  if (wrongAp) return elapsedUs >= WIFI_PROBE_MS * 1000 ? WL_NO_SSID_AVAIL : WL_DISCONNECTED;
+
+  uint32_t joinMs = sim::wifiJoinMs - (targeted ? sim::wifiScanMs : 0) - ((uint32_t)staticIp ? sim::wifiDhcpMs : 0);
+  if (sim::wifiAvailable && elapsedUs >= (uint64_t)joinMs * 1000) {
+    return WL_CONNECTED;
+  }
+  return WL_DISCONNECTED;
+}
+
+bool WiFiClass::disconnect(bool, bool) {
+  joining = false;
+  return true;
+}
+
+IPAddress WiFiClass::localIP() {
+  if (status() != WL_CONNECTED) return IPAddress();
+  return (uint32_t)staticIp ? staticIp : IPAddress(192, 168, 1, 50);
+}
+
+IPAddress WiFiClass::gatewayIP() {
+  return status() == WL_CONNECTED ? IPAddress(192, 168, 1, 1) : IPAddress();
+}
+
+IPAddress WiFiClass::subnetMask() {
+  return status() == WL_CONNECTED ? IPAddress(255, 255, 255, 0) : IPAddress();
+}
+
+IPAddress WiFiClass::dnsIP(uint8_t dnsNo) {
+  return status() == WL_CONNECTED && dnsNo == 0 ? IPAddress(192, 168, 1, 1) : IPAddress();
+}
+
+uint8_t* WiFiClass::BSSID() {
+  return status() == WL_CONNECTED ? apBssid : NULL;
+}
+
+int32_t WiFiClass::channel() {
+  return status() == WL_CONNECTED ? sim::wifiChannel : 0;
+}
+
+// ===== ezTime =====
+
+int64_t sim::epochAtStart = 1750000000; // 2025-06-15 15:06:40 UTC
+int32_t sim::utcOffset = 2 * 3600;      // CEST
+int32_t sim::crystalPpm = 0;
+bool sim::ntpAvailable = true;
+static bool timeSynced = false;
+static int64_t syncEpochUs = 0;         // ezTime's time at the last NTP update...
+static uint64_t syncClockUs = 0;        // ...and the virtual clock then
+static uint16_t syncIntervalS = 0;
+
+static int64_t trueEpochUs() {
+  int64_t startUs = sim::realTime ? realStartEpochUs : sim::epochAtStart * 1000000;
+  return startUs + (int64_t)clockUs * 1000000 / (1000000 + sim::crystalPpm);
+}
+
+// Before the first update ezTime would count from 1970; the true time keeps the fake simple
+static int64_t epochUs() {
+  return timeSynced ? syncEpochUs + (int64_t)(clockUs - syncClockUs) : trueEpochUs();
+}
+
+static int64_t localSeconds(const Timezone* zone, int64_t utcSeconds) {
+  return utcSeconds + (zone == &UTC ? 0 : sim::utcOffset);
+}
+
+static int64_t localSeconds(const Timezone* zone) {
+  return localSeconds(zone, epochUs() / 1000000);
+}
+
+static int64_t localSeconds(const Timezone* zone, time_t t, ezLocalOrUTC_t localOrUtc) {
+  return localOrUtc == UTC_TIME ? localSeconds(zone, t) : t;
+}
+
+uint8_t Timezone::hour() {
+  return localSeconds(this) / 3600 % 24;
+}
+
+uint8_t Timezone::minute() {
+  return localSeconds(this) / 60 % 60;
+}
+
+uint8_t Timezone::second() {
+  return localSeconds(this) % 60;
+}
+
+uint8_t Timezone::weekday() {
+  return (localSeconds(this) / 86400 + 4) % 7 + 1; // 1970-01-01 was a Thursday; Sunday = 1
+}
+
+uint16_t Timezone::ms() {
+  return epochUs() / 1000 % 1000;
+}
+
+time_t Timezone::now() {
+  return epochUs() / 1000000;
+}
+
+uint8_t Timezone::hour(time_t t, ezLocalOrUTC_t localOrUtc) {
+  return localSeconds(this, t, localOrUtc) / 3600 % 24;
+}
+
+uint8_t Timezone::minute(time_t t, ezLocalOrUTC_t localOrUtc) {
+  return localSeconds(this, t, localOrUtc) / 60 % 60;
+}
+
+Timezone UTC;
+
+// Civil date and time of local seconds since 1970-01-01 (Howard Hinnant's algorithm)
+static String formatTime(int64_t seconds, const String& format) {
+  int64_t days = seconds / 86400 + 719468;
+  int64_t era = days / 146097;
+  unsigned dayOfEra = days - era * 146097;
+  unsigned yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+  unsigned dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+  unsigned mp = (5 * dayOfYear + 2) / 153;
+  unsigned day = dayOfYear - (153 * mp + 2) / 5 + 1;
+  unsigned month = mp < 10 ? mp + 3 : mp - 9;
+  int64_t year = yearOfEra + era * 400 + (month <= 2);
+
+  std::string out;
+  char field[8];
+  for (const char* c = format.c_str(); *c; c++) {
+    switch (*c) {
+      case 'Y': snprintf(field, sizeof(field), "%04d", (int)year); break;
+      case 'm': snprintf(field, sizeof(field), "%02u", month); break;
+      case 'd': snprintf(field, sizeof(field), "%02u", day); break;
+      case 'H': snprintf(field, sizeof(field), "%02u", (unsigned)(seconds / 3600 % 24)); break;
+      case 'i': snprintf(field, sizeof(field), "%02u", (unsigned)(seconds / 60 % 60)); break;
+      case 's': snprintf(field, sizeof(field), "%02u", (unsigned)(seconds % 60)); break;
+      default:  field[0] = *c; field[1] = 0; break;
+    }
+    out += field;
+  }
+  return String(out);
+}
+
+String Timezone::dateTime(const String& format) {
+  return formatTime(localSeconds(this), format);
+}
+
+String Timezone::dateTime(time_t t, ezLocalOrUTC_t localOrUtc, const String& format) {
+  return formatTime(localSeconds(this, t, localOrUtc), format);
+}
+
+timeStatus_t timeStatus() {
+  return timeSynced ? timeSet : timeNotSet;
+}
+
+bool updateNTP() {
+  if (!sim::ntpAvailable || WiFi.status() != WL_CONNECTED) return false;
+  timeSynced = true;
+  syncEpochUs = trueEpochUs();
+  syncClockUs = clockUs;
+  return true;
+}
+
+time_t lastNtpUpdateTime() {
+  return timeSynced ? syncEpochUs / 1000000 : 0;
+}
+
+void setInterval(uint16_t seconds) {
+  syncIntervalS = seconds;
+}
+
+void events() {
+  if (timeSynced && syncIntervalS && clockUs - syncClockUs >= syncIntervalS * 1000000ULL) {
+    updateNTP();
+  }
+}
+
+// ===== Preferences =====
+
+static std::map<std::string, std::map<std::string, std::string>> flash;
+static uint32_t flashWrites = 0;
+
+uint32_t sim::nvsWrites() {
+  return flashWrites;
+}
+
+bool Preferences::begin(const char* name, bool openReadOnly) {
+  space = name;
+  readOnly = openReadOnly;
+  return true;
+}
+
+void Preferences::end() {
+  space.clear();
+  readOnly = true;
+}
+
+bool Preferences::isKey(const char* key) {
+  return flash[space].count(key) > 0;
+}
+
+size_t Preferences::put(const char* key, const void* value, size_t size) {
+  if (readOnly || space.empty()) return 0;
+  flash[space][key] = std::string((const char*)value, size);
+  flashWrites++;
+  return size;
+}
+
+size_t Preferences::getBytes(const char* key, void* buffer, size_t maxLength) {
+  std::map<std::string, std::string>& entries = flash[space];
+  std::map<std::string, std::string>::iterator entry = entries.find(key);
+  if (entry == entries.end() || entry->second.size() > maxLength) return 0;
+  memcpy(buffer, entry->second.data(), entry->second.size());
+  return entry->second.size();
+}
+
+bool Preferences::remove(const char* key) {
+  if (readOnly || space.empty() || !flash[space].erase(key)) return false;
+  flashWrites++;
+  return true;
+}
+
+// Length-prefixed namespace, key and value of every entry
+static void writeString(FILE* file, const std::string& text) {
+  uint32_t length = text.size();
+  fwrite(&length, sizeof(length), 1, file);
+  fwrite(text.data(), 1, length, file);
+}
+
+static bool readString(FILE* file, std::string* text) {
+  uint32_t length;
+  if (fread(&length, sizeof(length), 1, file) != 1) return false;
+  text->resize(length);
+  return fread(&(*text)[0], 1, length, file) == length;
+}
+
+bool sim::saveFlash(const char* path) {
+  FILE* file = fopen(path, "wb");
+  if (!file) return false;
+  for (const auto& space : flash) {
+    for (const auto& entry : space.second) {
+      writeString(file, space.first);
+      writeString(file, entry.first);
+      writeString(file, entry.second);
+    }
+  }
+  return fclose(file) == 0;
+}
+
+bool sim::loadFlash(const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (!file) return false;
+  std::string space, key, value;
+  while (readString(file, &space) && readString(file, &key) && readString(file, &value)) {
+    flash[space][key] = value;
+  }
+  fclose(file);
+  return true;
+}
+
+void Preferences::get(const char* key, void* value, size_t size) {
+  std::map<std::string, std::string>& entries = flash[space];
+  std::map<std::string, std::string>::iterator entry = entries.find(key);
+  if (entry != entries.end() && entry->second.size() == size) {
+    memcpy(value, entry->second.data(), size);
+  }
+}
+
+// ===== MQTT =====
+
+bool sim::brokerAvailable = true;
+const char* sim::brokerAddress = NULL;
+static std::deque<std::pair<std::string, std::string>> inbox;
+static uint32_t publishCount = 0;
+static uint64_t publishBytes = 0;
+static uint32_t rejectCount = 0;
+// Last payload per topic; entries and their buffers are reused, so publishing stays
+// free of allocations once every topic has been seen
+static std::map<std::string, std::string, std::less<>> lastPayloads;
+static sim::CallbackStats callbackStats = {};
+
+#define BROKER_KEEPALIVE_S 60
+#define BROKER_PING_MS     15000
+
+void sim::mqttInject(const char* topic, const char* payload) {
+  inbox.push_back(std::make_pair(std::string(topic), std::string(payload)));
+}
+
+uint32_t sim::mqttPublished() {
+  return publishCount;
+}
+
+uint64_t sim::mqttPublishedBytes() {
+  return publishBytes;
+}
+
+uint32_t sim::mqttRejected() {
+  return rejectCount;
+}
+
+sim::CallbackStats sim::mqttCallbacks() {
+  return callbackStats;
+}
+
+std::string sim::mqttLastPayload(const char* topic) {
+  auto entry = lastPayloads.find(topic);
+  return entry == lastPayloads.end() ? std::string() : entry->second;
+}
+
+// A subscription filter against a topic, level by level
+static bool topicMatches(const std::string& filter, const std::string& topic) {
+  size_t f = 0, t = 0;
+  for (;;) {
+    size_t fEnd = filter.find('/', f);
+    size_t tEnd = topic.find('/', t);
+    std::string level = filter.substr(f, fEnd == std::string::npos ? std::string::npos : fEnd - f);
+    if (level == "#") return true;
+    if (level != "+" && level != topic.substr(t, tEnd == std::string::npos ? std::string::npos : tEnd - t)) {
+      return false;
+    }
+    if (fEnd == std::string::npos || tEnd == std::string::npos) return fEnd == tEnd;
+    f = fEnd + 1;
+    t = tEnd + 1;
+  }
+}
+
+// ----- MQTT 3.1.1 over TCP, just what the client below needs -----
+
+static void putString(std::string& out, const std::string& text) {
+  out += (char)(text.size() >> 8);
+  out += (char)(text.size() & 0xff);
+  out += text;
+}
+
+static bool sendPacket(int fd, uint8_t header, const std::string& body) {
+  std::string packet(1, (char)header);
+  size_t length = body.size();
+  do {
+    packet += (char)((length & 0x7f) | (length > 0x7f ? 0x80 : 0));
+    length >>= 7;
+  } while (length);
+  packet += body;
+
+  size_t sent = 0;
+  while (sent < packet.size()) {
+    ssize_t n = send(fd, packet.data() + sent, packet.size() - sent, MSG_NOSIGNAL);
+    if (n > 0) {
+      sent += n;
+    } else if (n < 0 && errno == EAGAIN) {
+      pollfd writable = {fd, POLLOUT, 0};
+      if (poll(&writable, 1, 1000) <= 0) return false;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Length of the first whole packet in data and where its body starts; 0 if incomplete
+static size_t packetLength(const std::string& data, size_t* bodyAt) {
+  size_t length = 0;
+  for (size_t i = 1; i < data.size() && i <= 4; i++) {
+    length |= (size_t)(data[i] & 0x7f) << (7 * (i - 1));
+    if (!(data[i] & 0x80)) {
+      *bodyAt = i + 1;
+      return data.size() >= i + 1 + length ? i + 1 + length : 0;
+    }
+  }
+  return 0;
+}
+
+static int openBroker(const char* address) {
+  std::string host = address;
+  std::string port = "1883";
+  size_t colon = host.rfind(':');
+  if (colon != std::string::npos) {
+    port = host.substr(colon + 1);
+    host = host.substr(0, colon);
+  }
+
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* found = NULL;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0) return -1;
+  int fd = -1;
+  for (addrinfo* at = found; at && fd < 0; at = at->ai_next) {
+    fd = socket(at->ai_family, at->ai_socktype, at->ai_protocol);
+    if (fd >= 0 && ::connect(fd, at->ai_addr, at->ai_addrlen) != 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(found);
+  return fd;
+}
+
+// ----- Client -----
+
+bool PubSubClient::connect(const char* id) {
+  session = sim::brokerAvailable && WiFi.status() == WL_CONNECTED;
+  subscriptions.clear();
+  if (!session || !sim::brokerAddress) return session;
+
+  if (socket >= 0) close(socket);
+  received.clear();
+  socket = openBroker(sim::brokerAddress);
+  std::string body;
+  putString(body, "MQTT");
+  body += (char)4;     // Protocol level 3.1.1
+  body += (char)0x02;  // Clean session
+  body += (char)(BROKER_KEEPALIVE_S >> 8);
+  body += (char)(BROKER_KEEPALIVE_S & 0xff);
+  putString(body, id);
+
+  // Wait for the CONNACK, as the real client does, bounded like its socket timeout
+  timeval timeout = {2, 0};
+  uint8_t ack[4] = {};
+  session = socket >= 0 && setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == 0 &&
+            sendPacket(socket, 0x10, body) && recv(socket, ack, sizeof(ack), MSG_WAITALL) == sizeof(ack) &&
+            ack[0] == 0x20 && ack[3] == 0;
+  if (!session) {
+    if (socket >= 0) close(socket);
+    socket = -1;
+    return false;
+  }
+  fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK);
+  lastSent = millis();
+  return true;
+}
+
+bool PubSubClient::connected() {
+  if (session && WiFi.status() != WL_CONNECTED) session = false;
+  if (!session && socket >= 0) {
+    close(socket);
+    socket = -1;
+  }
+  return session;
+}
+
+bool PubSubClient::subscribed(const std::string& topic) const {
+  for (const std::string& filter : subscriptions) {
+    if (topicMatches(filter, topic)) return true;
+  }
+  return false;
+}
+
+// Queue what the broker sent; acknowledgements and ping responses are dropped
+void PubSubClient::readBroker() {
+  char chunk[1024];
+  ssize_t n;
+  while ((n = recv(socket, chunk, sizeof(chunk), 0)) > 0) {
+    received.append(chunk, n);
+  }
+  if (n == 0 || (n < 0 && errno != EAGAIN)) {
+    session = false;
+    return;
+  }
+
+  size_t bodyAt, length;
+  while ((length = packetLength(received, &bodyAt)) > 0) {
+    uint8_t header = received[0];
+    if ((header & 0xf0) == 0x30 && length >= bodyAt + 2) {
+      size_t topicLength = (uint8_t)received[bodyAt] << 8 | (uint8_t)received[bodyAt + 1];
+      size_t payloadAt = bodyAt + 2 + topicLength + ((header & 0x06) ? 2 : 0);  // QoS 1/2 carry an ID
+      if (payloadAt <= length) {
+        inbox.push_back(std::make_pair(received.substr(bodyAt + 2, topicLength),
+                                       received.substr(payloadAt, length - payloadAt)));
+      }
+    }
+    received.erase(0, length);
+  }
+}
+
+// Like the real client, at most one incoming message is handled per call
+bool PubSubClient::loop() {
+  if (!connected()) return false;
+  if (socket >= 0) {
+    readBroker();
+    if (session && millis() - lastSent >= BROKER_PING_MS) {
+      session = sendPacket(socket, 0xc0, "");
+      lastSent = millis();
+    }
+    if (!connected()) return false;
+  }
+  if (inbox.empty()) return true;
+
+  std::pair<std::string, std::string> message = inbox.front();
+  inbox.pop_front();
+  if (callback && subscribed(message.first)) {
+    std::vector<char> topic(message.first.begin(), message.first.end());
+    topic.push_back(0);
+    sim::AllocStats allocsBefore = allocStats;
+    uint64_t start = wallNs();
+    callback(topic.data(), (uint8_t*)&message.second[0], message.second.size());
+    callbackStats.wallNs += wallNs() - start;
+    callbackStats.allocs += allocStats.allocs - allocsBefore.allocs;
+    callbackStats.bytes += allocStats.bytes - allocsBefore.bytes;
+    callbackStats.calls++;
+  }
+  return true;
+}
+
+bool PubSubClient::subscribe(const char* topic) {
+  if (!connected()) return false;
+  if (socket >= 0) {
+    std::string body("\0\1", 2);  // Packet ID, never checked
+    putString(body, topic);
+    body += (char)0;                // QoS 0
+    if (!sendPacket(socket, 0x82, body)) return false;
+    lastSent = millis();
+  }
+  subscriptions.push_back(topic);
+  return true;
+}
+
+bool PubSubClient::unsubscribe(const char* topic) {
+  if (!connected()) return false;
+  if (socket >= 0) {
+    std::string body("\0\2", 2);
+    putString(body, topic);
+    if (!sendPacket(socket, 0xa2, body)) return false;
+    lastSent = millis();
+  }
+  subscriptions.erase(std::remove(subscriptions.begin(), subscriptions.end(), std::string(topic)),
+                      subscriptions.end());
+  return true;
+}
+
+bool PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int length, bool retained) {
+  if (!connected()) return false;
+  // The real client sends from its fixed buffer; what this one allocates is not counted
+  sim::AllocStats callerAllocs = allocStats;
+  struct Restore {
+    sim::AllocStats& stats;
+    sim::AllocStats saved;
+    ~Restore() { stats = saved; }
+  } restore = {allocStats, callerAllocs};
+  // Fixed header, topic length and topic share the client buffer with the payload
+  if (5 + 2 + strlen(topic) + length > bufferSize) {
+    rejectCount++;
+    return false;
+  }
+  if (socket >= 0) {
+    std::string body;
+    putString(body, topic);
+    body.append((const char*)payload, length);
+    if (!sendPacket(socket, retained ? 0x31 : 0x30, body)) {
+      session = false;
+      return false;
+    }
+    lastSent = millis();
+  }
+  auto entry = lastPayloads.find(topic);
+  if (entry == lastPayloads.end()) {
+    entry = lastPayloads.emplace(topic, std::string()).first;
+    entry->second.reserve(bufferSize);
+  }
+  entry->second.assign((const char*)payload, length);
+  publishCount++;
+  publishBytes += length;
+  return true;
+}
+
+// ===== Web server =====
+
+static std::map<std::string, ArRequestHandlerFunction> routes;
+static ArRequestHandlerFunction notFound;
+
+static std::string urlDecode(const std::string& text) {
+  std::string out;
+  for (size_t i = 0; i < text.size(); i++) {
+    if (text[i] == '+') {
+      out += ' ';
+    } else if (text[i] == '%' && i + 2 < text.size()) {
+      out += (char)strtol(text.substr(i + 1, 2).c_str(), NULL, 16);
+      i += 2;
+    } else {
+      out += text[i];
+    }
+  }
+  return out;
+}
+
+AsyncWebServerRequest::AsyncWebServerRequest(const char* url) {
+  std::string text(url);
+  size_t query = text.find('?');
+  path = String(text.substr(0, query));
+  if (query == std::string::npos) return;
+
+  size_t start = query + 1;
+  while (start <= text.size()) {
+    size_t end = text.find('&', start);
+    if (end == std::string::npos) end = text.size();
+    std::string pair = text.substr(start, end - start);
+    size_t equals = pair.find('=');
+    if (!pair.empty()) {
+      args[urlDecode(pair.substr(0, equals))] =
+          String(equals == std::string::npos ? std::string() : urlDecode(pair.substr(equals + 1)));
+    }
+    start = end + 1;
+  }
+}
+
+const String& AsyncWebServerRequest::arg(const char* name) const {
+  static const String empty;
+  std::map<std::string, String>::const_iterator it = args.find(name);
+  return it == args.end() ? empty : it->second;
+}
+
+const AsyncWebHeader* AsyncWebServerRequest::getHeader(const char* name) const {
+  std::map<std::string, AsyncWebHeader>::const_iterator it = headers.find(name);
+  return it == headers.end() ? NULL : &it->second;
+}
+
+AsyncWebServerResponse* AsyncWebServerRequest::beginResponse(int code, const char* type, const char* content) {
+  return new AsyncWebServerResponse(code, type, (const uint8_t*)content, content ? strlen(content) : 0);
+}
+
+AsyncResponseStream* AsyncWebServerRequest::beginResponseStream(const char* type) {
+  return new AsyncResponseStream(type);
+}
+
+AsyncWebServerResponse* AsyncWebServerRequest::beginResponse_P(int code, const char* type, const uint8_t* content, size_t length) {
+  return new AsyncWebServerResponse(code, type, content, length);
+}
+
+void AsyncWebServerRequest::send(AsyncWebServerResponse* r) {
+  delete response;
+  response = r;
+}
+
+void AsyncWebServer::on(const char* uri, WebRequestMethod, ArRequestHandlerFunction handler) {
+  routes[uri] = handler;
+}
+
+void AsyncWebServer::onNotFound(ArRequestHandlerFunction handler) {
+  notFound = handler;
+}
+
+int sim::httpGet(const char* url, std::string* body) {
+  AsyncWebServerRequest request(url);
+  std::map<std::string, ArRequestHandlerFunction>::iterator route = routes.find(request.url().c_str());
+  if (route != routes.end()) {
+    route->second(&request);
+  } else if (notFound) {
+    notFound(&request);
+  }
+
+  if (!request.response) return 500;
+  if (body) *body = request.response->body;
+  return request.response->status;
+}
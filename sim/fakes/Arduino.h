@@ -0,0 +1,197 @@
+// Host stand-in for the parts of the ESP32 Arduino core the firmware uses
+#pragma once
+#include <stdint.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include "sim.h"
+
+typedef uint8_t byte;
+
+#define PROGMEM
+#define IRAM_ATTR
+#define RTC_NOINIT_ATTR
+#define F(x) x
+#define pgm_read_byte(p) (*(const uint8_t*)(p))
+
+template <class T, class L, class H>
+T constrain(T value, L low, H high) {
+  return value < low ? low : (value > high ? high : value);
+}
+template <class A, class B>
+auto min(A a, B b) -> decltype(a + b) { return a < b ? a : b; }
+template <class A, class B>
+auto max(A a, B b) -> decltype(a + b) { return a > b ? a : b; }
+
+// Part of newlib on the ESP32 but not of every host C library
+inline size_t sim_strlcpy(char* dst, const char* src, size_t size) {
+  size_t length = strlen(src);
+  if (size) {
+    size_t n = length < size - 1 ? length : size - 1;
+    memcpy(dst, src, n);
+    dst[n] = 0;
+  }
+  return length;
+}
+#define strlcpy sim_strlcpy
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+
+// ----- String -----
+
+class String {
+ public:
+  String() {}
+  String(const char* s) : str(s ? s : "") {}
+  String(const std::string& s) : str(s) {}
+  String(char c) : str(1, c) {}
+  String(int v) : str(std::to_string(v)) {}
+  String(unsigned v) : str(std::to_string(v)) {}
+  String(long v) : str(std::to_string(v)) {}
+  String(unsigned long v) : str(std::to_string(v)) {}
+
+  const char* c_str() const { return str.c_str(); }
+  unsigned length() const { return str.size(); }
+  bool isEmpty() const { return str.empty(); }
+  char charAt(unsigned i) const { return i < str.size() ? str[i] : 0; }
+  char operator[](unsigned i) const { return charAt(i); }
+  String substring(unsigned from) const { return from < str.size() ? str.substr(from) : ""; }
+  String substring(unsigned from, unsigned to) const { return from < to && from < str.size() ? str.substr(from, to - from) : ""; }
+  long toInt() const { return atol(str.c_str()); }
+  int indexOf(char c) const { size_t p = str.find(c); return p == std::string::npos ? -1 : (int)p; }
+  bool concat(const char* s) { str += s; return true; }
+  bool concat(char c) { str += c; return true; }
+  bool reserve(unsigned n) { str.reserve(n); return true; }
+
+  bool operator==(const String& o) const { return str == o.str; }
+  bool operator==(const char* o) const { return str == o; }
+  bool operator!=(const String& o) const { return str != o.str; }
+  bool operator!=(const char* o) const { return str != o; }
+  String& operator+=(const String& o) { str += o.str; return *this; }
+  String& operator+=(const char* o) { str += o; return *this; }
+  String& operator+=(char c) { str += c; return *this; }
+
+  std::string str;
+};
+
+// ArduinoJson's String adapter also accepts the result of a concatenation
+class StringSumHelper : public String {
+ public:
+  StringSumHelper(const String& s) : String(s) {}
+};
+
+inline StringSumHelper operator+(const String& a, const String& b) { return String(a.str + b.str); }
+inline StringSumHelper operator+(const String& a, const char* b) { return String(a.str + b); }
+inline StringSumHelper operator+(const char* a, const String& b) { return String(a + b.str); }
+
+// ----- Serial -----
+
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) { return write(&c, 1); }
+  virtual size_t write(const uint8_t* buffer, size_t size);
+
+  size_t print(const char* s) { return write((const uint8_t*)s, strlen(s)); }
+  size_t print(const String& s) { return print(s.c_str()); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(int v) { return printf("%d", v); }
+  size_t print(unsigned v) { return printf("%u", v); }
+  size_t print(long v) { return printf("%ld", v); }
+  size_t print(unsigned long v) { return printf("%lu", v); }
+  size_t print(double v, int digits = 2) { return printf("%.*f", digits, v); }
+  template <class T>
+  size_t println(const T& v) { return print(v) + println(); }
+  size_t println() { return print("\r\n"); }
+  size_t printf(const char* format, ...);
+};
+
+class Stream : public Print {};
+
+class HardwareSerial : public Stream {
+ public:
+  void begin(unsigned long) {}
+  size_t write(const uint8_t* buffer, size_t size) override;
+  using Print::write;
+};
+
+extern HardwareSerial Serial;
+
+// ----- IPAddress -----
+
+class IPAddress {
+ public:
+  IPAddress() : address(0) {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : address(a | b << 8 | c << 16 | (uint32_t)d << 24) {}
+  IPAddress(uint32_t raw) : address(raw) {}
+  operator uint32_t() const { return address; }
+  uint8_t operator[](int i) const { return address >> (8 * i); }
+  String toString() const;
+
+ private:
+  uint32_t address;  // First octet in the low byte, as on the ESP32
+};
+
+// ----- ESP -----
+
+class EspClass {
+ public:
+  uint32_t getFreeHeap() { return 320 * 1024; }
+  uint32_t getMaxAllocHeap() { return 110 * 1024; }
+  uint32_t getMinFreeHeap() { return 300 * 1024; }
+  uint32_t getCpuFreqMHz() { return 240; }
+  uint32_t getCycleCount();  // Counts wall time on the host, not virtual time
+  void restart() { exit(0); }
+};
+
+extern EspClass ESP;
+
+typedef enum {
+  ESP_RST_UNKNOWN, ESP_RST_POWERON, ESP_RST_EXT, ESP_RST_SW, ESP_RST_PANIC, ESP_RST_INT_WDT,
+  ESP_RST_TASK_WDT, ESP_RST_WDT, ESP_RST_DEEPSLEEP, ESP_RST_BROWNOUT, ESP_RST_SDIO
+} esp_reset_reason_t;
+
+esp_reset_reason_t esp_reset_reason();
+
+typedef void (*shutdown_handler_t)(void);
+int esp_register_shutdown_handler(shutdown_handler_t handler);
+uint32_t esp_random();
+
+// ----- FreeRTOS -----
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef void* TaskHandle_t;
+typedef void* SemaphoreHandle_t;
+
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))  // 1 kHz tick, as configured for the ESP32 core
+#define portMAX_DELAY     0xffffffffUL
+#define pdTRUE            1
+#define pdFALSE           0
+#define pdPASS            1
+
+TickType_t xTaskGetTickCount();
+void vTaskDelayUntil(TickType_t* previousWake, TickType_t period);
+void vTaskDelay(TickType_t ticks);
+BaseType_t xTaskCreatePinnedToCore(void (*task)(void*), const char* name, uint32_t stackDepth,
+                                   void* param, unsigned priority, TaskHandle_t* handle, int core);
+
+// Task notifications as a counting semaphore. The loop() thread is not a task; its
+// handle is NULL, and while it waits the clock moves like in delay()
+TaskHandle_t xTaskGetCurrentTaskHandle();
+uint32_t ulTaskNotifyTake(BaseType_t clearCountOnExit, TickType_t ticksToWait);
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex();
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t mutex, TickType_t timeout);
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t mutex);
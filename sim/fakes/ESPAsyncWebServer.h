@@ -0,0 +1,94 @@
+// Host stand-in for ESPAsyncWebServer: routes are called directly by sim::httpGet()
+// on the calling thread; event sources have no clients
+#pragma once
+#include <WiFi.h>
+#include <functional>
+#include <map>
+
+enum WebRequestMethod { HTTP_GET = 1, HTTP_POST = 2, HTTP_ANY = 127 };
+
+class AsyncWebHeader {
+ public:
+  AsyncWebHeader(const String& v) : text(v) {}
+  const String& value() const { return text; }
+
+ private:
+  String text;
+};
+
+class AsyncWebServerResponse {
+ public:
+  AsyncWebServerResponse(int code, const char* type, const uint8_t* data, size_t length)
+      : status(code), contentType(type ? type : ""), body((const char*)data, length) {}
+  virtual ~AsyncWebServerResponse() {}
+  void addHeader(const char* name, const char* value) { headers[name] = value; }
+
+  int status;
+  std::string contentType;
+  std::string body;
+  std::map<std::string, std::string> headers;
+};
+
+class AsyncResponseStream : public AsyncWebServerResponse, public Print {
+ public:
+  AsyncResponseStream(const char* type) : AsyncWebServerResponse(200, type, (const uint8_t*)"", 0) {}
+  size_t write(const uint8_t* buffer, size_t size) override {
+    body.append((const char*)buffer, size);
+    return size;
+  }
+  using Print::write;
+};
+
+class AsyncWebServerRequest {
+ public:
+  explicit AsyncWebServerRequest(const char* url);
+  ~AsyncWebServerRequest() { delete response; }
+
+  const String& url() const { return path; }
+  bool hasArg(const char* name) const { return args.count(name) > 0; }
+  const String& arg(const char* name) const;
+  bool hasHeader(const char* name) const { return headers.count(name) > 0; }
+  const AsyncWebHeader* getHeader(const char* name) const;
+
+  AsyncWebServerResponse* beginResponse(int code, const char* type, const char* content = "");
+  AsyncResponseStream* beginResponseStream(const char* type);
+  AsyncWebServerResponse* beginResponse_P(int code, const char* type, const uint8_t* content, size_t length);
+  void send(AsyncWebServerResponse* r);
+  void send(int code, const char* type = "", const char* content = "") { send(beginResponse(code, type, content)); }
+
+  AsyncWebServerResponse* response = NULL;  // What the handler sent
+
+ private:
+  String path;
+  std::map<std::string, String> args;
+  std::map<std::string, AsyncWebHeader> headers;
+};
+
+typedef std::function<void(AsyncWebServerRequest*)> ArRequestHandlerFunction;
+
+class AsyncWebHandler {
+ public:
+  virtual ~AsyncWebHandler() {}
+};
+
+class AsyncEventSourceClient {
+ public:
+  void send(const char*, const char* = NULL, uint32_t = 0, uint32_t = 0) {}
+};
+
+class AsyncEventSource : public AsyncWebHandler {
+ public:
+  AsyncEventSource(const char*) {}
+  void onConnect(std::function<void(AsyncEventSourceClient*)>) {}
+  void send(const char*, const char* = NULL, uint32_t = 0, uint32_t = 0) {}
+  size_t count() const { return 0; }
+};
+
+class AsyncWebServer {
+ public:
+  AsyncWebServer(uint16_t) {}
+  void on(const char* uri, WebRequestMethod method, ArRequestHandlerFunction handler);
+  void onNotFound(ArRequestHandlerFunction handler);
+  AsyncWebHandler& addHandler(AsyncWebHandler* handler) { return *handler; }
+  void begin() {}
+};
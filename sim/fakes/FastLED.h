@@ -0,0 +1,86 @@
+// Host stand-in for FastLED: keeps the LED arrays and records what would be sent
+#pragma once
+#include <Arduino.h>
+
+struct CHSV {
+  CHSV() : h(0), s(0), v(0) {}
+  CHSV(uint8_t hue, uint8_t sat, uint8_t val) : h(hue), s(sat), v(val) {}
+  uint8_t h, s, v;
+};
+
+struct CRGB {
+  union {
+    struct { uint8_t r, g, b; };
+    struct { uint8_t red, green, blue; };
+    uint8_t raw[3];
+  };
+
+  enum HTMLColorCode {
+    Black = 0x000000,
+    Red   = 0xFF0000,
+    Green = 0x008000,
+    Blue  = 0x0000FF,
+    White = 0xFFFFFF,
+  };
+
+  CRGB() : r(0), g(0), b(0) {}
+  CRGB(uint8_t ir, uint8_t ig, uint8_t ib) : r(ir), g(ig), b(ib) {}
+  CRGB(uint32_t code) : r(code >> 16), g(code >> 8), b(code) {}
+  CRGB(HTMLColorCode code) : CRGB((uint32_t)code) {}
+  CRGB(const CHSV& hsv);
+
+  uint8_t& operator[](int i) { return raw[i]; }
+  const uint8_t& operator[](int i) const { return raw[i]; }
+};
+
+inline bool operator==(const CRGB& a, const CRGB& b) { return a.r == b.r && a.g == b.g && a.b == b.b; }
+inline bool operator!=(const CRGB& a, const CRGB& b) { return !(a == b); }
+
+void hsv2rgb_rainbow(const CHSV& hsv, CRGB& rgb);
+inline CRGB::CRGB(const CHSV& hsv) { hsv2rgb_rainbow(hsv, *this); }
+
+enum ESPIChipsets { WS2812B };
+enum EOrder { RGB, RBG, GRB, GBR, BRG, BGR };
+
+#define DISABLE_DITHER 0
+#define BINARY_DITHER  1
+
+class CLEDController {
+ public:
+  void init(int index, CRGB* leds, int count);
+  void showLeds(uint8_t brightness = 255);
+  CRGB* leds() { return data; }
+  int size() { return count; }
+
+ private:
+  int index = 0;
+  CRGB* data = NULL;
+  int count = 0;
+};
+
+class CFastLED {
+ public:
+  template <ESPIChipsets CHIPSET, uint8_t DATA_PIN, EOrder RGB_ORDER>
+  CLEDController& addLeds(CRGB* leds, int count, int offset = 0) {
+    CLEDController& controller = controllers[controllerCount];
+    controller.init(controllerCount++, leds + offset, count);
+    return controller;
+  }
+
+  void setBrightness(uint8_t scale) { brightness = scale; }
+  uint8_t getBrightness() { return brightness; }
+  void setDither(uint8_t mode) { dither = mode; }
+  void clear(bool writeData = false);
+  void show();
+  int count() { return controllerCount; }
+  CLEDController& operator[](int index) { return controllers[index]; }
+
+ private:
+  static const int MAX_CONTROLLERS = 8;
+  CLEDController controllers[MAX_CONTROLLERS];
+  int controllerCount = 0;
+  uint8_t brightness = 255;
+  uint8_t dither = BINARY_DITHER;
+};
+
+extern CFastLED FastLED;
@@ -0,0 +1,28 @@
+// Host stand-in for the ESP32 Preferences library, backed by memory; counts writes
+#pragma once
+#include <Arduino.h>
+
+class Preferences {
+ public:
+  bool begin(const char* name, bool readOnly = false);
+  void end();
+  bool isKey(const char* key);
+
+  size_t putUChar(const char* key, uint8_t value) { return put(key, &value, sizeof(value)); }
+  size_t putBool(const char* key, bool value) { return putUChar(key, value); }
+  size_t putULong(const char* key, uint32_t value) { return put(key, &value, sizeof(value)); }
+  size_t putBytes(const char* key, const void* value, size_t length) { return put(key, value, length); }
+
+  uint8_t getUChar(const char* key, uint8_t defaultValue = 0) { get(key, &defaultValue, sizeof(defaultValue)); return defaultValue; }
+  bool getBool(const char* key, bool defaultValue = false) { return getUChar(key, defaultValue); }
+  uint32_t getULong(const char* key, uint32_t defaultValue = 0) { get(key, &defaultValue, sizeof(defaultValue)); return defaultValue; }
+  size_t getBytes(const char* key, void* buffer, size_t maxLength);
+  bool remove(const char* key);
+
+ private:
+  size_t put(const char* key, const void* value, size_t size);
+  void get(const char* key, void* value, size_t size);
+
+  std::string space;
+  bool readOnly = true;
+};
@@ -0,0 +1,39 @@
+// Host stand-in for PubSubClient: talks to an in-process broker (see sim::mqttInject),
+// or to a real one over TCP when sim::brokerAddress is set
+#pragma once
+#include <WiFi.h>
+#include <vector>
+
+#define MQTT_MAX_PACKET_SIZE 256
+
+class PubSubClient {
+ public:
+  typedef void (*Callback)(char* topic, uint8_t* payload, unsigned int length);
+
+  PubSubClient(WiFiClient&) {}
+  PubSubClient& setServer(const char*, uint16_t) { return *this; }
+  PubSubClient& setCallback(Callback cb) { callback = cb; return *this; }
+  PubSubClient& setSocketTimeout(uint16_t) { return *this; }
+  bool setBufferSize(uint16_t size) { bufferSize = size; return true; }
+
+  bool connect(const char* id);
+  bool connected();
+  int state() { return connected() ? 0 : -2; }
+  bool loop();
+  bool subscribe(const char* topic);
+  bool unsubscribe(const char* topic);
+  bool publish(const char* topic, const char* payload) { return publish(topic, (const uint8_t*)payload, strlen(payload), false); }
+  bool publish(const char* topic, const uint8_t* payload, unsigned int length, bool retained);
+
+ private:
+  bool subscribed(const std::string& topic) const;
+  void readBroker();
+
+  Callback callback = NULL;
+  uint16_t bufferSize = MQTT_MAX_PACKET_SIZE;
+  bool session = false;
+  std::vector<std::string> subscriptions;
+  int socket = -1;            // Connection to sim::brokerAddress
+  std::string received;       // Bytes read from it, not yet a whole packet
+  unsigned long lastSent = 0; // millis() of the last packet sent, for keepalive pings
+};
@@ -0,0 +1,50 @@
+// Host stand-in for the ESP32 WiFi library; joins complete after sim::wifiJoinMs, less
+// the scan when given the access point's channel and BSSID and less DHCP with a static
+// address. A join aimed at another channel or BSSID fails
+#pragma once
+#include <Arduino.h>
+
+typedef enum {
+  WL_IDLE_STATUS = 0,
+  WL_NO_SSID_AVAIL = 1,
+  WL_CONNECTED = 3,
+  WL_CONNECT_FAILED = 4,
+  WL_CONNECTION_LOST = 5,
+  WL_DISCONNECTED = 6,
+} wl_status_t;
+
+typedef enum { WIFI_OFF, WIFI_STA, WIFI_AP, WIFI_AP_STA } wifi_mode_t;
+
+class WiFiClass {
+ public:
+  wl_status_t begin(const char* ssid, const char* passphrase = NULL, int32_t channel = 0,
+                    const uint8_t* bssid = NULL, bool connect = true);
+  bool config(IPAddress localIp, IPAddress gateway, IPAddress subnet, IPAddress dns1 = IPAddress(),
+              IPAddress dns2 = IPAddress());
+  wl_status_t status();
+  bool disconnect(bool wifiOff = false, bool eraseAp = false);
+  bool mode(wifi_mode_t) { return true; }
+  bool setAutoReconnect(bool) { return true; }
+  void persistent(bool) {}
+  IPAddress localIP();
+  IPAddress gatewayIP();
+  IPAddress subnetMask();
+  IPAddress dnsIP(uint8_t dnsNo = 0);
+  uint8_t* BSSID();
+  int32_t channel();
+
+ private:
+  bool joining = false;
+  bool targeted = false;   // Channel and BSSID given
+  bool wrongAp = false;    // ...and they are not the access point's
+  uint64_t joinStartUs = 0;
+  IPAddress staticIp;
+};
+
+extern WiFiClass WiFi;
+
+class WiFiClient : public Stream {
+ public:
+  bool connected() { return WiFi.status() == WL_CONNECTED; }
+  void stop() {}
+};
@@ -0,0 +1,38 @@
+// Host stand-in for ezTime: true time is sim::epochAtStart plus the virtual clock, slowed
+// or sped up by sim::crystalPpm. An NTP update sets ezTime's time to it; in between
+// ezTime runs on millis(), as the real library does. Local time is UTC plus sim::utcOffset
+#pragma once
+#include <Arduino.h>
+#include <time.h>
+
+typedef enum { timeNotSet, timeNeedsSync, timeSet } timeStatus_t;
+typedef enum { LOCAL_TIME, UTC_TIME } ezLocalOrUTC_t;
+
+class Timezone {
+ public:
+  bool setPosix(const String& posix) { rules = posix; return true; }
+  uint8_t hour();
+  uint8_t minute();
+  uint8_t second();
+  uint8_t weekday();
+  uint16_t ms();
+  time_t now();
+  // Supports the format characters Y m d H i s; anything else is copied
+  String dateTime(const String& format = "Y-m-d H:i:s");
+
+  // The same for a given time, UTC or already local
+  uint8_t hour(time_t t, ezLocalOrUTC_t localOrUtc);
+  uint8_t minute(time_t t, ezLocalOrUTC_t localOrUtc);
+  String dateTime(time_t t, ezLocalOrUTC_t localOrUtc, const String& format = "Y-m-d H:i:s");
+
+ private:
+  String rules;
+};
+
+extern Timezone UTC;
+
+timeStatus_t timeStatus();
+bool updateNTP();
+time_t lastNtpUpdateTime();
+void setInterval(uint16_t seconds = 0);
+void events();  // Updates from NTP once the interval set with setInterval() has passed
@@ -0,0 +1,92 @@
+// Control interface of the host simulation (env:native).
+// The fakes in this directory stand in for the ESP32 core and libraries; sim/bench.cpp
+// drives setup()/loop() through them on a virtual clock.
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string>
+
+namespace sim {
+
+// ----- Virtual clock -----
+// millis()/micros() read it and delay() advances it. Tasks started with
+// xTaskCreatePinnedToCore run in lockstep: while the clock moves forward each task
+// runs up to its next vTaskDelayUntil() deadline, one at a time, so a run is
+// repeatable. Time does not move while code runs.
+uint64_t nowUs();
+void advance(uint64_t us);
+// Pace the clock to the wall clock from now on, and take the true time (what NTP
+// reports) from the system clock, so separate processes agree on it. Call before setup()
+void startRealTime();
+extern bool realTime;
+uint64_t taskWallNs();       // Wall time spent inside tasks since start
+uint32_t taskRuns();         // Task wake-ups since start
+uint64_t idleWallNs();       // Wall time spent in delay() on the loop() thread, tasks included
+
+// ----- Allocation counters -----
+// malloc/free are counted per thread; loop() and the render task are measured apart
+struct AllocStats {
+  uint64_t allocs;
+  uint64_t frees;
+  uint64_t bytes;
+};
+AllocStats threadAllocs();   // Calling thread
+AllocStats taskAllocs();     // All tasks, as of their last block
+
+// ----- Network -----
+extern uint32_t wifiJoinMs;  // Time from WiFi.begin() to connected: scan, association, DHCP
+extern uint32_t wifiScanMs;  // Part of it skipped by a join given the channel and BSSID
+extern uint32_t wifiDhcpMs;  // Part of it skipped with a static address (WiFi.config())
+extern int32_t wifiChannel;  // The access point's; a join aimed elsewhere fails
+extern bool wifiAvailable;   // false: joins never complete
+extern bool brokerAvailable; // false: MQTT connects fail
+extern bool ntpAvailable;    // false: NTP updates fail
+extern int64_t epochAtStart; // UTC seconds at virtual time 0
+extern int32_t utcOffset;    // Seconds added for local time (fixed; no DST rules)
+extern int32_t crystalPpm;   // millis() runs fast by this much against true time
+
+// Queue a message for the device; PubSubClient::loop() delivers one per call to
+// a subscribed topic ('+' and '#' wildcards match as on a broker)
+void mqttInject(const char* topic, const char* payload);
+// "host:port" of a real MQTT 3.1.1 broker to use instead; needs startRealTime()
+extern const char* brokerAddress;
+uint32_t mqttPublished();
+uint64_t mqttPublishedBytes();
+uint32_t mqttRejected();     // Larger than the client buffer
+std::string mqttLastPayload(const char* topic);  // Empty if nothing was published there
+// Messages handed to the MQTT callback, and the wall time and heap allocations inside it
+struct CallbackStats {
+  uint32_t calls;
+  uint64_t wallNs;
+  uint64_t allocs;
+  uint64_t bytes;
+};
+CallbackStats mqttCallbacks();
+
+// Run a GET request against the routes registered on AsyncWebServer
+int httpGet(const char* url, std::string* body = NULL);
+
+// ----- Flash -----
+uint32_t nvsWrites();
+// Preferences contents to and from a file, to carry them from one run to the next
+bool saveFlash(const char* path);
+bool loadFlash(const char* path);
+
+// ----- Reset -----
+// What esp_reset_reason() reports (an esp_reset_reason_t; ESP_RST_POWERON by default).
+// RTC_NOINIT_ATTR variables are ordinary globals, so a driver can fill them before setup()
+extern int resetReason;
+
+// ----- Frames -----
+// Every CLEDController::showLeds() is written to the frame file, if one is open:
+// "<ms> <strip> <brightness> RRGGBB RRGGBB ...", strips in addLeds() order. In real
+// time the file starts with "# epoch <ms>", the true time at millis() 0
+void openFrameDump(const char* path);
+void closeFrameDump();
+uint32_t framesShown();
+
+// ----- Serial -----
+extern bool verbose;         // Echo Serial output to stderr
+
+}  // namespace sim
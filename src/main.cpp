@@ -1,10 +1,19 @@
 #include <WiFi.h>
 #include <FastLED.h>
-#include <WebServer.h>
+#include <ESPAsyncWebServer.h> // Event-driven HTTP server, runs in the AsyncTCP task
 #include <ezTime.h>
 #include <Preferences.h> // Add Preferences library for settings persistence
 #include <PubSubClient.h> // MQTT library
 #include <ArduinoJson.h>  // JSON library for MQTT messages
+#include <atomic>         // Lock-free snapshot between loop() and the render task
+
+// The host simulation (env:native) builds with WEB_ASSETS=0 and serves no pages
+#ifndef WEB_ASSETS
+#define WEB_ASSETS 1
+#endif
+#if WEB_ASSETS
+#include "web_assets.h"   // Gzipped web pages, generated from web/ by tools/embed_assets.py
+#endif
 
 // ===== LED Settings =====
 #define NUM_LEDS    7       // Number of segments per digit
@@ -19,27 +28,106 @@
 #define DIGIT4_PIN 5   // Fourth digit (ones of minutes)
 #define COLON_COUNT 2  // Colon consists of 2 LEDs
 
-// LED arrays for each digit and colon
-CRGB leds1[NUM_LEDS], leds2[NUM_LEDS], leds3[NUM_LEDS], leds4[NUM_LEDS];
-CRGB colon[COLON_COUNT];
+// Rendering runs in its own task, only as often as the display changes (override with build flags)
+#ifndef RENDER_FPS
+#define RENDER_FPS  20     // Highest frame rate of the render task, reached by animated effects
+#endif
+// Wi‑Fi and LwIP run on core 0, so the render task gets core 1 to itself; platformio.ini
+// moves loop(), the AsyncTCP task and Arduino events over to core 0 with the network
+#ifndef RENDER_CORE
+#define RENDER_CORE 1      // Core for the render task; loop() runs on the other one
+#endif
+#if defined(ARDUINO_RUNNING_CORE) && ARDUINO_RUNNING_CORE == RENDER_CORE
+#error "loop() and the render task share a core; set ARDUINO_RUNNING_CORE to the other one"
+#endif
+
+// All LEDs live in one frame buffer: the four digits left to right, then the colon.
+// Each strip is a slice of it on its own data pin, registered with FastLED in this order.
+#define DIGIT_COUNT 4
+#define STRIP_COUNT (DIGIT_COUNT + 1)
+#define COLON_STRIP DIGIT_COUNT
+#define FRAME_LEDS  (DIGIT_COUNT * NUM_LEDS + COLON_COUNT)
+
+struct StripMap {
+  uint8_t pin;
+  uint8_t offset; // Index of the strip's first LED in the frame buffer
+  uint8_t count;
+};
+
+constexpr StripMap stripMap[STRIP_COUNT] = {
+  {DIGIT1_PIN, 0 * NUM_LEDS, NUM_LEDS},
+  {DIGIT2_PIN, 1 * NUM_LEDS, NUM_LEDS},
+  {DIGIT3_PIN, 2 * NUM_LEDS, NUM_LEDS},
+  {DIGIT4_PIN, 3 * NUM_LEDS, NUM_LEDS},
+  {COLON_PIN, DIGIT_COUNT * NUM_LEDS, COLON_COUNT},
+};
+
+static_assert(stripMap[COLON_STRIP].offset + stripMap[COLON_STRIP].count == FRAME_LEDS,
+              "strips do not cover the frame buffer");
+
+// Frame buffer index of a segment (its bit in a glyph mask, see Segment Font) of a digit (0-3)
+constexpr uint8_t segmentLed(uint8_t digit, uint8_t segment) {
+  return stripMap[digit].offset + segment;
+}
+
+// Frame buffer index of a colon dot
+constexpr uint8_t colonLed(uint8_t dot) {
+  return stripMap[COLON_STRIP].offset + dot;
+}
+
+// What the display functions draw into
+CRGB frameBuffer[FRAME_LEDS];
+
+// ===== Segment Font =====
+// Segments are wired in the order g, d, c, b, a, f, e along each digit strip,
+// so bit i of a glyph mask lights LED i of the digit.
+constexpr uint8_t segmentBit(char seg) {
+  return seg == 'g' ? 0x01 : seg == 'd' ? 0x02 : seg == 'c' ? 0x04 : seg == 'b' ? 0x08 :
+         seg == 'a' ? 0x10 : seg == 'f' ? 0x20 : seg == 'e' ? 0x40 : 0;
+}
+
+// Build a glyph mask from the names of its lit segments, e.g. glyph("abc") for '7'
+constexpr uint8_t glyph(const char* segs) {
+  return *segs ? segmentBit(*segs) | glyph(segs + 1) : 0;
+}
 
-// Digit mapping for 7-segment display (0-9)
-const PROGMEM bool digits[10][NUM_LEDS] = {
-  {0, 1, 1, 1, 1, 1, 1}, // 0
-  {0, 0, 1, 1, 0, 0, 0}, // 1
-  {1, 1, 0, 1, 1, 0, 1}, // 2
-  {1, 1, 1, 1, 1, 0, 0}, // 3
-  {1, 0, 1, 1, 0, 1, 0}, // 4
-  {1, 1, 1, 0, 1, 1, 0}, // 5
-  {1, 1, 1, 0, 1, 1, 1}, // 6
-  {0, 0, 1, 1, 1, 0, 0}, // 7
-  {1, 1, 1, 1, 1, 1, 1}, // 8
-  {1, 1, 1, 1, 1, 1, 0}  // 9
+// Printable ASCII (0x20-0x7F); characters without a readable 7-segment form are blank
+#define FONT_FIRST ' '
+#define FONT_SIZE  96
+constexpr uint8_t font[FONT_SIZE] PROGMEM = {
+  // ' '        !            "            #            $             %            &            '
+  glyph(""),    glyph("bc"), glyph("bf"), glyph(""),   glyph("acdfg"), glyph(""),   glyph(""),   glyph("b"),
+  // (          )            *            +            ,             -            .            /
+  glyph("adef"), glyph("abcd"), glyph(""), glyph(""),  glyph("c"),   glyph("g"),  glyph("d"),  glyph("beg"),
+  // 0              1            2              3              4             5              6               7
+  glyph("abcdef"), glyph("bc"), glyph("abdeg"), glyph("abcdg"), glyph("bcfg"), glyph("acdfg"), glyph("acdefg"), glyph("abc"),
+  // 8               9               :            ;            <            =             >            ?
+  glyph("abcdefg"), glyph("abcdfg"), glyph(""),  glyph(""),   glyph(""),   glyph("dg"),  glyph(""),   glyph("abeg"),
+  // @            A              B              C             D              E              F             G
+  glyph(""),    glyph("abcefg"), glyph("cdefg"), glyph("adef"), glyph("bcdeg"), glyph("adefg"), glyph("aefg"), glyph("acdef"),
+  // H              I            J              K            L             M            N              O
+  glyph("bcefg"), glyph("ef"), glyph("bcde"), glyph(""),   glyph("def"), glyph(""),   glyph("abcef"), glyph("abcdef"),
+  // P              Q              R            S              T              U              V            W
+  glyph("abefg"), glyph("abcfg"), glyph("eg"), glyph("acdfg"), glyph("defg"), glyph("bcdef"), glyph(""),   glyph(""),
+  // X            Y              Z              [              \             ]              ^              _
+  glyph(""),    glyph("bcdfg"), glyph("abdeg"), glyph("adef"), glyph("cfg"), glyph("abcd"), glyph("abf"), glyph("d"),
+  // `            a               b              c             d              e               f             g
+  glyph("f"),   glyph("abcdeg"), glyph("cdefg"), glyph("deg"), glyph("bcdeg"), glyph("abdefg"), glyph("aefg"), glyph("abcdfg"),
+  // h             i           j             k            l            m            n            o
+  glyph("cefg"), glyph("c"), glyph("bcd"), glyph(""),   glyph("ef"), glyph(""),   glyph("ceg"), glyph("cdeg"),
+  // p              q              r            s              t              u            v            w
+  glyph("abefg"), glyph("abcfg"), glyph("eg"), glyph("acdfg"), glyph("defg"), glyph("cde"), glyph(""),   glyph(""),
+  // x            y              z              {              |            }              ~            DEL
+  glyph(""),    glyph("bcdfg"), glyph("abdeg"), glyph("adef"), glyph("ef"), glyph("abcd"), glyph("a"),  glyph("")
 };
 
-// Character mapping for IP display
-const PROGMEM bool letter_period[NUM_LEDS] = {0, 0, 0, 1, 0, 0, 0}; // Just the bottom segment
-const PROGMEM bool letter_space[NUM_LEDS] = {0, 0, 0, 0, 0, 0, 0};  // Blank display
+// The digits must keep the segment order of the original per-segment digit table
+static_assert(font['0' - FONT_FIRST] == 0x7E && font['1' - FONT_FIRST] == 0x0C &&
+              font['2' - FONT_FIRST] == 0x5B && font['3' - FONT_FIRST] == 0x1F &&
+              font['4' - FONT_FIRST] == 0x2D && font['5' - FONT_FIRST] == 0x37 &&
+              font['6' - FONT_FIRST] == 0x77 && font['7' - FONT_FIRST] == 0x1C &&
+              font['8' - FONT_FIRST] == 0x7F && font['9' - FONT_FIRST] == 0x3F,
+              "digit glyphs do not match the strip segment order");
 
 // ===== Wi‑Fi & Time Settings =====
 const char* ssid     = "SANDS_WiFi";
@@ -49,931 +137,4489 @@ const char* password = "Ytp@29!144";
 const char* mqtt_server = "broker.hivemq.com"; // Free public MQTT broker
 const int mqtt_port = 1883;
 const char* device_id = "esp32_watch_001"; // Unique device ID - change this!
-String mqtt_topic_command = "esp32watch/" + String(device_id) + "/command";
-String mqtt_topic_status = "esp32watch/" + String(device_id) + "/status";
-String mqtt_topic_response = "esp32watch/" + String(device_id) + "/response";
+// Built from device_id by setupTopics()
+String mqtt_topic_command;       // esp32watch/<device_id>/command
+String mqtt_topic_status;        // .../status: retained full snapshot
+String mqtt_topic_status_delta;  // .../status/delta: changed fields only
+String mqtt_topic_response;      // .../response
+String mqtt_topic_metrics;       // .../metrics: loop profiler, see PROFILING
+// Fleet commands: every watch takes the broadcast topic, and group topics for its groups
+const char* mqtt_topic_broadcast = "esp32watch/all/command";
+const char* mqtt_topic_groups = "esp32watch/group/+/command"; // Membership is checked on arrival
 
 WiFiClient espClient;
 PubSubClient mqttClient(espClient);
 
+// Status payloads are JSON; build with -D STATUS_MSGPACK=1 for MessagePack instead
+#ifndef STATUS_MSGPACK
+#define STATUS_MSGPACK 0
+#endif
+
 // Time zone for Poland (auto-adjusts for DST)
 Timezone Poland;
 
 // ===== Global variables =====
 uint8_t userBrightness = 25;     // Brightness (0-255). Default ~10%
-uint8_t mode = 0;                // 0 - Rainbow (color transition), 1 - Static (fixed color)
+uint8_t mode = 0;                // Effect ID (see effects[]): 0 - Rainbow, 1 - Static color, ...
 CRGB staticColor = CRGB::Red;    // Default static color (red)
-uint8_t globalHue = 0;           // For rainbow mode
+CRGB whiteBalance = CRGB(255, 255, 255); // Per-channel LED calibration; 255 leaves a channel as is
 uint8_t rainbowSpeed = 1;        // Speed of rainbow color change (1-10)
-WebServer server(80);            // Web server on port 80
+AsyncWebServer server(80);       // Web server on port 80
+AsyncEventSource liveEvents("/events"); // Live state pushed to the web page
 bool autoBrightnessEnabled = true; // Enable/disable automatic brightness adjustment
 Preferences preferences;         // For saving settings to flash
 
-// Timer/Countdown variables
-bool timerActive = false;        // Timer is currently running
-unsigned long timerDuration = 0; // Timer duration in seconds
-unsigned long timerStartTime = 0; // When the timer was started (millis())
-bool timerCompleted = false;     // Timer has reached zero
-unsigned long timerLastFlash = 0; // For flashing display when timer completes
-bool timerFlashState = false;    // Current flash state
+// Countdowns, alarms and stopwatches (see Timer Functions)
+#define MAX_TIMERS        8
+#define TIMER_NAME_LEN    15
+#define TIMER_DEFAULT_ID  1       // Timer used by requests without an "id", like the single timer before
+#define TIMER_MAX_MINUTES 5999    // Longest countdown: 99:59:59
+#define TIMER_FLASH_MS    500     // Half period of the flashing when a timer goes off
+#define TIMER_RING_MS     300000  // An alarm nobody stops re-arms for the next day after this long
+
+enum TimerKind : uint8_t { TIMER_COUNTDOWN, TIMER_ALARM, TIMER_STOPWATCH };
+enum TimerState : uint8_t { TIMER_STOPPED, TIMER_RUNNING, TIMER_PAUSED, TIMER_RINGING };
+
+struct Timer {
+  uint8_t id;                    // 1-255; 0 marks a free slot
+  TimerKind kind;
+  TimerState state;
+  uint8_t heapPos;               // Position in timerHeap while a countdown or alarm runs
+  char name[TIMER_NAME_LEN + 1];
+  uint32_t length;               // Countdown: duration in ms; alarm: minute of the day (local time)
+  uint32_t mark;                 // millis() of the deadline (countdown, alarm, also while ringing) or start (stopwatch)
+  uint32_t held;                 // Stopped or paused: remaining (countdown) or elapsed (stopwatch) ms
+};
+Timer timers[MAX_TIMERS] = {};
 
-// Auto brightness settings (percentages)
+// Auto brightness settings (percentages); the default schedule uses them for its windows
 uint8_t dayBrightness = 100;     // Brightness percentage for day (9:00-18:00)
 uint8_t nightBrightness = 10;    // Brightness percentage for night (22:00-6:00)
 uint8_t transitionBrightness = 50; // Brightness percentage for transition periods
 
-// Timing variables for non-blocking operation
-unsigned long lastColonUpdate = 0;
-bool colonState = false;
+// Schedule rules (see Schedule)
+#define MAX_SCHEDULE_RULES 12
+#define SCHEDULE_KEEP      0xFF  // The rule leaves this field alone
+#define LEVEL_DAY          101   // Rule brightness taken from the day, night or transition setting
+#define LEVEL_NIGHT        102
+#define LEVEL_TRANSITION   103
+#define ALL_DAYS           0x7F
+
+struct ScheduleRule {
+  uint16_t minute;       // Minute of the day, local time
+  uint8_t days;          // Weekdays it applies on: bit 0 Monday ... bit 6 Sunday
+  uint8_t brightness;    // Percent of the maximum brightness, LEVEL_* or SCHEDULE_KEEP
+  uint8_t mode;          // Effect ID or SCHEDULE_KEEP
+  bool setsColor;
+  CRGB color;
+  uint16_t rampMinutes;  // Brightness fades in from the previous rule's over this long
+};
+ScheduleRule scheduleRules[MAX_SCHEDULE_RULES];
+uint8_t scheduleRuleCount = 0;
+bool scheduleDirty = false;      // Rules differ from flash
+
+// Fleet groups whose commands the watch takes (see Fleet groups)
+#define MAX_GROUPS     4
+#define GROUP_NAME_LEN 15
+char groups[MAX_GROUPS][GROUP_NAME_LEN + 1] = {};
+uint8_t groupCount = 0;
+bool groupsDirty = false;        // Groups differ from flash
+
+// Current auto brightness fade, worked out by loop() when a rule is due
+uint8_t scheduleFrom = 100;      // Level (percent or LEVEL_*) faded from and to
+uint8_t scheduleTo = 100;
+uint32_t scheduleRampStart = 0;  // millis() when the fade started
+uint32_t scheduleRampMs = 0;     // Length of the fade; 0 holds scheduleTo
+
+// Connection state for Wi‑Fi, MQTT and NTP (see updateConnections())
+enum LinkState : uint8_t { LINK_DOWN, LINK_CONNECTING, LINK_UP };
+struct Link {
+  LinkState state;
+  uint8_t failures;          // Consecutive failed attempts, drives the backoff
+  unsigned long retries;     // Connection attempts since boot
+  unsigned long nextAttempt; // millis() before which no new attempt is made
+};
+Link wifiLink = {};
+Link mqttLink = {};
+Link ntpLink = {};
+uint32_t wifiJoinMs = 0;     // Length of the last successful Wi‑Fi join
+uint32_t wifiBootMs = 0;     // Start-up to the first connection
+uint32_t wifiFastJoins = 0;  // Joins that skipped the scan (see startWifiJoin())
+
+// Render statistics (see renderFrame())
+unsigned long framesRendered = 0; // Frames where at least one strip was pushed
+unsigned long framesSkipped = 0;  // Frames identical to the last pushed one
+unsigned long bytesPushed = 0;    // Pixel bytes clocked out to the LEDs
+
+// Requested text for the marquee; picked up by the render task when the serial changes
+#define MARQUEE_MAX_LEN 64         // Longest text that can be scrolled
+char marqueeRequestText[MARQUEE_MAX_LEN + 1] = "";
+uint16_t marqueeRequestStep = 0;
+uint8_t marqueeRequestRepeats = 0;
+uint8_t marqueeRequestSerial = 0;
+
+// Frame timing of the render task (written by the render task only)
+volatile uint32_t frameJitterMaxUs = 0; // Largest deviation from the frame period since boot
+volatile uint32_t frameJitterAvgUs = 0; // Moving average of the deviation
+
+// Settings and timer globals are written from loop() (MQTT) and from the web server's
+// AsyncTCP task; both hold this lock while touching them. loop() holds it only to
+// change or copy state and does MQTT, NTP and flash I/O outside it, on the copies,
+// so a web request never waits for the network or flash.
+SemaphoreHandle_t stateMutex;
+
+// Holds the state lock for the lifetime of the object
+struct StateLock {
+  StateLock() { xSemaphoreTakeRecursive(stateMutex, portMAX_DELAY); }
+  ~StateLock() { xSemaphoreGiveRecursive(stateMutex); }
+};
+
+// loop() and the render task block until their next deadline (see Idle Scheduling); a
+// task notification wakes them early
+TaskHandle_t loopTaskHandle = NULL;
+TaskHandle_t renderTaskHandle = NULL;
+
+// Have loop() run now and pass on a change made by a web request (AsyncTCP task)
+void wakeLoop() {
+  xTaskNotifyGive(loopTaskHandle);
+}
+
+// Time spent per loop() pass, excluding its wait (see /stats)
+unsigned long loopMaxUs = 0;
+unsigned long loopAvgUs = 0;
+
+// ===== Display Snapshot =====
+
+// Everything the render task needs, copied from the globals owned by loop()
+struct DisplaySnapshot {
+  uint8_t brightness;
+  uint8_t mode;
+  CRGB staticColor;
+  CRGB whiteBalance;
+  uint8_t rainbowSpeed;
+  bool autoBrightness;
+  uint8_t dayBrightness;
+  uint8_t nightBrightness;
+  uint8_t transitionBrightness;
+  uint8_t scheduleFrom;       // Auto brightness fade (see Schedule)
+  uint8_t scheduleTo;
+  uint32_t scheduleRampStart;
+  uint32_t scheduleRampMs;
+  bool timerShown;            // A timer takes over the clock (see displayedTimer())
+  bool timerRinging;
+  bool timerCountsUp;         // Stopwatch: timerMark is its start, otherwise its deadline
+  uint32_t timerMark;
+  bool timeSet;               // Clock has been set at least once
+  bool timeNeedsSync;
+  bool wifiConnected;
+  uint8_t hour;               // Local time in Poland
+  uint8_t minute;
+  int64_t clockOffsetMs;      // Wall clock minus millis(), 0 while the time is unknown (see animationMs())
+  char marqueeText[MARQUEE_MAX_LEN + 1];
+  uint16_t marqueeStep;
+  uint8_t marqueeRepeats;
+  uint8_t marqueeSerial;
+};
+
+// Two buffers and a sequence counter: loop() fills the buffer the render task is not
+// reading and then bumps the counter; the reader retries if the counter moved under it.
+DisplaySnapshot snapshots[2];
+std::atomic<uint32_t> snapshotSeq(0);
+
+#define PHASE_SLACK_MS 2 // Animation phase error accepted before the clock offset is republished
+
+const Timer* displayedTimer();
+int64_t wallClockMs();
+
+// Publish the current settings and timer state to the render task (loop() only); the
+// render task is woken if anything it draws from changed
+void publishSnapshot() {
+  uint32_t seq = snapshotSeq.load(std::memory_order_relaxed);
+  DisplaySnapshot& next = snapshots[(seq + 1) & 1];
+  
+  next.brightness = userBrightness;
+  next.mode = mode;
+  next.staticColor = staticColor;
+  next.whiteBalance = whiteBalance;
+  next.rainbowSpeed = rainbowSpeed;
+  next.autoBrightness = autoBrightnessEnabled;
+  next.dayBrightness = dayBrightness;
+  next.nightBrightness = nightBrightness;
+  next.transitionBrightness = transitionBrightness;
+  next.scheduleFrom = scheduleFrom;
+  next.scheduleTo = scheduleTo;
+  next.scheduleRampStart = scheduleRampStart;
+  next.scheduleRampMs = scheduleRampMs;
+  const Timer* timer = displayedTimer();
+  next.timerShown = timer != NULL;
+  next.timerRinging = timer && timer->state == TIMER_RINGING;
+  next.timerCountsUp = timer && timer->kind == TIMER_STOPWATCH;
+  next.timerMark = timer ? timer->mark : 0;
+  int64_t clockMs = wallClockMs();
+  time_t clockSeconds = clockMs / 1000;
+  next.timeSet = (clockMs != 0);
+  next.timeNeedsSync = (timeStatus() == timeNeedsSync);
+  next.wifiConnected = (WiFi.status() == WL_CONNECTED);
+  next.hour = Poland.hour(clockSeconds, UTC_TIME);
+  next.minute = Poland.minute(clockSeconds, UTC_TIME);
+  // The offset creeps by a few ms as drift is corrected, not worth waking the render task for
+  int64_t clockOffset = clockMs ? clockMs - (int64_t)millis() : 0;
+  int64_t shownOffset = snapshots[seq & 1].clockOffsetMs;
+  bool creeping = clockMs && shownOffset && llabs(clockOffset - shownOffset) <= PHASE_SLACK_MS;
+  next.clockOffsetMs = creeping ? shownOffset : clockOffset;
+  memcpy(next.marqueeText, marqueeRequestText, sizeof(next.marqueeText));
+  next.marqueeStep = marqueeRequestStep;
+  next.marqueeRepeats = marqueeRequestRepeats;
+  next.marqueeSerial = marqueeRequestSerial;
+  
+  // Padding is never written, so the copies compare equal when every field does
+  if (memcmp(&next, &snapshots[seq & 1], sizeof(next)) == 0) return;
+  snapshotSeq.store(seq + 1, std::memory_order_release);
+  if (renderTaskHandle) xTaskNotifyGive(renderTaskHandle);
+}
+
+// Copy the latest published snapshot (render task only)
+void readSnapshot(DisplaySnapshot& out) {
+  uint32_t before, after;
+  do {
+    before = snapshotSeq.load(std::memory_order_acquire);
+    out = snapshots[before & 1];
+    std::atomic_thread_fence(std::memory_order_acquire);
+    after = snapshotSeq.load(std::memory_order_relaxed);
+  } while (before != after);
+}
 
 // ===== Function Forward Declarations =====
-void sendMQTTResponse(String key, String value);
-void sendStatusUpdate();
+void sendMQTTResponse(const JsonDocument& response);
+void saveSettings();
+void requestFullStatus();
+const char* linkStateName(LinkState state);
+
+// ===== Profiler =====
+
+// Per-stage timing of loop() and the render task from the CPU cycle counter. Every
+// stage keeps a histogram since boot and min/mean/max over a rolling window; both are
+// served on /metrics and the window also goes to the metrics MQTT topic.
+// Build with -D PROFILING=0 to compile it out.
+#ifndef PROFILING
+#define PROFILING 1
+#endif
+
+#if PROFILING
+
+#define PROFILE_WINDOW_MS 60000 // Length of the min/mean/max window
+
+// Each stage is timed by one task only, so its counters need no lock
+enum ProfileStage : uint8_t {
+  STAGE_CONNECTIONS,  // updateConnections()
+  STAGE_MQTT,         // mqttClient.loop(), including command handling
+  STAGE_TIME_EVENTS,  // ezTime events()
+  STAGE_LIVE_EVENTS,  // Server-Sent Events
+  STAGE_SETTINGS,     // Deferred flash writes
+  STAGE_TIMER,        // Timer completion check
+  STAGE_STATUS,       // MQTT status and metrics publishing
+  STAGE_SNAPSHOT,     // Hand-over to the render task
+  STAGE_LOOP,         // Whole loop() pass without the final wait
+  STAGE_IDLE,         // Wait for the next deadline at the end of loop()
+  STAGE_FRAME,        // Whole render frame (render task)
+  STAGE_SHOW,         // Pushing changed strips to the LEDs, part of the frame
+  STAGE_COUNT
+};
+
+const char* const stageNames[STAGE_COUNT] = {
+  "connections", "mqtt", "time_events", "live_events", "settings", "timer",
+  "status", "snapshot", "loop", "idle", "frame", "show"
+};
+
+// Histogram bucket upper bounds; one more bucket holds everything slower
+const uint32_t profileBucketUs[] = {10, 50, 100, 500, 1000, 5000, 10000, 50000};
+#define PROFILE_BUCKETS (sizeof(profileBucketUs) / sizeof(profileBucketUs[0]) + 1)
+
+struct ProfileWindow {
+  uint32_t count;
+  uint32_t minCycles;
+  uint32_t maxCycles;
+  uint64_t totalCycles;
+};
+
+struct StageProfile {
+  ProfileWindow current;
+  ProfileWindow last;              // Last complete window
+  unsigned long windowStart;       // millis() when current began
+  uint32_t buckets[PROFILE_BUCKETS]; // Runs per bucket since boot
+  uint32_t count;                  // Runs since boot
+  uint64_t totalCycles;            // Cycles since boot
+};
+
+StageProfile stageProfiles[STAGE_COUNT];
+uint32_t profileBucketCycles[PROFILE_BUCKETS - 1];
+uint32_t cyclesPerUs = 240;
+
+// Convert the bucket bounds to cycles once, so recording a run does no division
+void setupProfiler() {
+  cyclesPerUs = ESP.getCpuFreqMHz();
+  for (uint8_t b = 0; b < PROFILE_BUCKETS - 1; b++) {
+    profileBucketCycles[b] = profileBucketUs[b] * cyclesPerUs;
+  }
+}
+
+// Record one run of stage that started at mark, and start the next stage at its end.
+// The cycle counter is per core and wraps every ~17 s at 240 MHz; both tasks are
+// pinned and no stage runs that long.
+void profileLap(ProfileStage stage, uint32_t& mark) {
+  uint32_t now = ESP.getCycleCount();
+  uint32_t cycles = now - mark;
+  mark = now;
+  
+  StageProfile& p = stageProfiles[stage];
+  unsigned long currentMillis = millis();
+  if (currentMillis - p.windowStart >= PROFILE_WINDOW_MS) {
+    p.last = p.current;
+    p.current = ProfileWindow();
+    p.windowStart = currentMillis;
+  }
+  
+  if (p.current.count == 0 || cycles < p.current.minCycles) p.current.minCycles = cycles;
+  if (cycles > p.current.maxCycles) p.current.maxCycles = cycles;
+  p.current.count++;
+  p.current.totalCycles += cycles;
+  
+  uint8_t bucket = 0;
+  while (bucket < PROFILE_BUCKETS - 1 && cycles > profileBucketCycles[bucket]) bucket++;
+  p.buckets[bucket]++;
+  p.count++;
+  p.totalCycles += cycles;
+}
+
+// The window to report: the last complete one, or the running one until the first completes
+const ProfileWindow& profileWindow(const StageProfile& p) {
+  return p.last.count ? p.last : p.current;
+}
+
+#define PROFILE_START(mark)      uint32_t mark = ESP.getCycleCount()
+#define PROFILE_LAP(stage, mark) profileLap(stage, mark)
+
+#else
+
+#define PROFILE_START(mark)
+#define PROFILE_LAP(stage, mark)
+
+#endif
+
+// ===== Heap Profiler =====
+
+// Free heap, largest free block and fragmentation are sampled once a minute. With
+// ALLOC_TRACKING=1 (the esp32-s3-devkitm-1-alloc env in platformio.ini, which adds
+// the --wrap linker flags it needs) every malloc/free is also attributed to the
+// innermost ALLOC_SCOPE of the calling task. All of it is served on /heap.
+#ifndef ALLOC_TRACKING
+#define ALLOC_TRACKING 0
+#endif
+
+#define HEAP_SAMPLE_MS   60000 // Time between two heap samples
+#define HEAP_HISTORY     60    // Samples kept; one hour at the default interval
+
+struct HeapSample {
+  uint32_t uptime;       // Seconds since boot
+  uint32_t freeHeap;
+  uint32_t largestBlock; // Largest single allocation possible
+  uint32_t minFreeHeap;  // Lowest free heap since boot
+};
+
+HeapSample heapHistory[HEAP_HISTORY];
+uint8_t heapHistoryNext = 0;  // Slot written next
+uint8_t heapHistoryCount = 0;
+unsigned long lastHeapSample = 0;
+
+// Percentage of free heap not usable for one allocation: 0 is one contiguous block
+uint8_t heapFragmentation(uint32_t freeHeap, uint32_t largestBlock) {
+  if (freeHeap == 0 || largestBlock >= freeHeap) return 0;
+  return 100 - (uint8_t)((uint64_t)largestBlock * 100 / freeHeap);
+}
+
+// Called from loop()
+void updateHeapHistory() {
+  unsigned long currentMillis = millis();
+  if (heapHistoryCount > 0 && currentMillis - lastHeapSample < HEAP_SAMPLE_MS) return;
+  lastHeapSample = currentMillis;
+  
+  HeapSample& sample = heapHistory[heapHistoryNext];
+  sample.uptime = currentMillis / 1000;
+  sample.freeHeap = ESP.getFreeHeap();
+  sample.largestBlock = ESP.getMaxAllocHeap();
+  sample.minFreeHeap = ESP.getMinFreeHeap();
+  heapHistoryNext = (heapHistoryNext + 1) % HEAP_HISTORY;
+  if (heapHistoryCount < HEAP_HISTORY) heapHistoryCount++;
+}
+
+#if ALLOC_TRACKING
+
+#include <esp_heap_caps.h> // heap_caps_get_allocated_size()
+
+// Code paths allocations are attributed to
+enum AllocSite : uint8_t {
+  ALLOC_HTTP_PAGE,     // handleRoot(), handleAsset()
+  ALLOC_HTTP_SET,      // handleSet()
+  ALLOC_HTTP_TIMER,    // handleTimer()
+  ALLOC_HTTP_SCHEDULE, // handleSchedule()
+  ALLOC_HTTP_STATE,    // handleState(), /events connects
+  ALLOC_HTTP_DIAG,     // /stats, /metrics, /heap
+  ALLOC_MQTT_COMMAND,  // mqttCallback()
+  ALLOC_MQTT_RESPONSE, // sendMQTTResponse()
+  ALLOC_MQTT_STATUS,   // updateStatus(), metrics topic
+  ALLOC_LIVE_EVENTS,   // updateLiveEvents()
+  ALLOC_SETTINGS,      // updateSettings()
+  ALLOC_CONNECTIONS,   // updateConnections()
+  ALLOC_TIME_EVENTS,   // ezTime events()
+  ALLOC_RENDER,        // One render frame
+  ALLOC_SITE_COUNT
+};
+
+const char* const allocSiteNames[ALLOC_SITE_COUNT] = {
+  "http_page", "http_set", "http_timer", "http_schedule", "http_state", "http_diag",
+  "mqtt_command", "mqtt_response", "mqtt_status", "live_events", "settings", "connections",
+  "time_events", "render"
+};
+
+struct AllocSiteStats {
+  uint32_t calls;     // Scopes completed
+  uint32_t allocs;
+  uint32_t frees;
+  uint32_t bytes;     // Requested by malloc/calloc/realloc
+  uint32_t peak;      // Most heap the calling task held at once during one call
+  int32_t retained;   // Net heap kept after all calls; should stay near zero
+  uint16_t maxAllocs; // Most allocations in one call
+};
+
+AllocSiteStats allocSiteStats[ALLOC_SITE_COUNT];
+
+// Attributes the calling task's allocations to site until it goes out of scope.
+// Only the innermost scope of a task counts an allocation; held bytes are those the
+// task allocated minus those it freed, so other tasks' heap use does not show up.
+struct AllocScope {
+  explicit AllocScope(AllocSite site);
+  ~AllocScope();
+  
+  AllocSite site;
+  AllocScope* outer;
+  uint8_t slot;
+  int32_t held;     // Bytes allocated minus bytes freed by the task so far
+  int32_t peakHeld; // Most bytes held at once
+  uint16_t allocs;
+  uint16_t frees;
+  uint32_t bytes;
+};
+
+// One slot per task with an open scope; the owning task is the only one to change
+// the scope pointer, so the allocation hooks need no lock
+#define ALLOC_SLOTS 4
+struct AllocSlot {
+  std::atomic<TaskHandle_t> task;
+  AllocScope* scope;
+};
+AllocSlot allocSlots[ALLOC_SLOTS];
+std::atomic<uint8_t> openAllocScopes(0); // Lets the hooks skip the lookup when idle
+
+AllocScope::AllocScope(AllocSite site)
+    : site(site), outer(NULL), slot(ALLOC_SLOTS), held(0), peakHeld(0), allocs(0), frees(0), bytes(0) {
+  TaskHandle_t task = xTaskGetCurrentTaskHandle();
+  for (uint8_t i = 0; i < ALLOC_SLOTS && slot == ALLOC_SLOTS; i++) {
+    if (allocSlots[i].task.load() == task) slot = i;
+  }
+  for (uint8_t i = 0; i < ALLOC_SLOTS && slot == ALLOC_SLOTS; i++) {
+    TaskHandle_t empty = NULL;
+    if (allocSlots[i].task.compare_exchange_strong(empty, task)) slot = i;
+  }
+  if (slot == ALLOC_SLOTS) return; // More tasks than slots; this scope goes uncounted
+  
+  outer = allocSlots[slot].scope;
+  allocSlots[slot].scope = this;
+  openAllocScopes++;
+}
+
+AllocScope::~AllocScope() {
+  if (slot == ALLOC_SLOTS) return;
+  
+  allocSlots[slot].scope = outer;
+  if (!outer) allocSlots[slot].task.store(NULL);
+  openAllocScopes--;
+  if (outer) { // The inner scope's heap use is part of the outer call's
+    outer->peakHeld = max(outer->peakHeld, outer->held + peakHeld);
+    outer->held += held;
+  }
+  
+  AllocSiteStats& stats = allocSiteStats[site];
+  stats.calls++;
+  stats.allocs += allocs;
+  stats.frees += frees;
+  stats.bytes += bytes;
+  stats.peak = max(stats.peak, (uint32_t)peakHeld);
+  stats.retained += held;
+  stats.maxAllocs = max(stats.maxAllocs, allocs);
+}
+
+// Innermost open scope of the calling task, if any
+AllocScope* IRAM_ATTR currentAllocScope() {
+  if (openAllocScopes.load(std::memory_order_relaxed) == 0) return NULL;
+  TaskHandle_t task = xTaskGetCurrentTaskHandle();
+  for (uint8_t i = 0; i < ALLOC_SLOTS; i++) {
+    if (allocSlots[i].task.load(std::memory_order_relaxed) == task) return allocSlots[i].scope;
+  }
+  return NULL;
+}
+
+// Heap use is counted by block size, as the allocator rounds it
+void IRAM_ATTR noteAlloc(void* ptr, size_t size) {
+  AllocScope* scope = currentAllocScope();
+  if (!scope || !ptr) return;
+  scope->allocs++;
+  scope->bytes += size;
+  scope->held += heap_caps_get_allocated_size(ptr);
+  if (scope->held > scope->peakHeld) scope->peakHeld = scope->held;
+}
+
+// Called before the block is released
+void IRAM_ATTR noteFree(void* ptr) {
+  AllocScope* scope = currentAllocScope();
+  if (!scope || !ptr) return;
+  scope->frees++;
+  scope->held -= heap_caps_get_allocated_size(ptr);
+}
+
+// Linked in place of the C library's allocator by -Wl,--wrap=<name>
+extern "C" {
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+void __real_free(void* ptr);
+
+void* IRAM_ATTR __wrap_malloc(size_t size) {
+  void* ptr = __real_malloc(size);
+  noteAlloc(ptr, size);
+  return ptr;
+}
+
+void* IRAM_ATTR __wrap_calloc(size_t count, size_t size) {
+  void* ptr = __real_calloc(count, size);
+  noteAlloc(ptr, count * size);
+  return ptr;
+}
+
+void* IRAM_ATTR __wrap_realloc(void* ptr, size_t size) {
+  AllocScope* scope = currentAllocScope();
+  size_t oldSize = (scope && ptr) ? heap_caps_get_allocated_size(ptr) : 0;
+  void* moved = __real_realloc(ptr, size);
+  if (!scope || (!moved && size)) return moved; // A failed realloc leaves the block alone
+  if (ptr) scope->frees++;
+  scope->held -= oldSize;
+  noteAlloc(moved, size);
+  return moved;
+}
+
+void IRAM_ATTR __wrap_free(void* ptr) {
+  noteFree(ptr);
+  __real_free(ptr);
+}
+}
+
+#define ALLOC_SCOPE(site) AllocScope allocScope(site)
+
+#else
+
+#define ALLOC_SCOPE(site)
+
+#endif
+
+// ===== Colour Stage =====
+
+// Display functions draw full-scale colours into the strip arrays. renderFrame() turns
+// them into LED output through per-channel tables that fold gamma, white balance and
+// brightness into one 8.8 fixed-point level, so a pixel costs three lookups. The tables
+// are only rebuilt when brightness or white balance change. The fraction is rounded
+// away, or with COLOR_DITHER spread over frames so dim settings keep their colour steps.
+#define GAMMA 2.2f
+
+#ifndef COLOR_DITHER
+#define COLOR_DITHER 0          // 1: temporal dithering at low brightness; best with RENDER_FPS of 50 or more
+#endif
+#define DITHER_BRIGHTNESS 64    // Dither only below this brightness; above it rounding is invisible
+#define NO_DITHER         0xFF  // Dither phase for plain rounding
+
+CRGB hueColors[256];            // CHSV(hue, 255, 255) for every hue of the rainbow mode
+uint16_t gammaTable[256];       // Colour value to linear light, 0-65535
+uint16_t channelTable[3][256];  // Colour value to output level (8.8 fixed point), per channel
+uint8_t tableBrightness = 0;
+CRGB tableWhiteBalance;
+bool channelTablesValid = false;
+
+// Rounding offsets for the 8 dither phases, in bit-reversed order so that consecutive
+// frames spread evenly; they average to 128, like plain rounding
+const uint8_t ditherOffsets[8] = {16, 144, 80, 208, 48, 176, 112, 240};
+uint8_t ditherFrame = 0;
+
+// Fill the tables that do not depend on settings
+void setupColor() {
+  for (uint16_t i = 0; i < 256; i++) {
+    hueColors[i] = CHSV(i, 255, 255);
+    gammaTable[i] = (uint16_t)(powf(i / 255.0f, GAMMA) * 65535.0f + 0.5f);
+  }
+}
+
+// Rebuild the channel tables if brightness or white balance changed
+void updateChannelTables(uint8_t brightness, CRGB balance) {
+  if (channelTablesValid && brightness == tableBrightness && balance == tableWhiteBalance) return;
+  
+  for (uint8_t c = 0; c < 3; c++) {
+    // Scale of a 16-bit linear value to 8.8 output, in 16.16 fixed point; 255 * 256 at most
+    uint32_t scale = (uint64_t)brightness * balance[c] * 256 * 65536 / (65535UL * 255);
+    for (uint16_t i = 0; i < 256; i++) {
+      channelTable[c][i] = (uint32_t)gammaTable[i] * scale >> 16;
+    }
+  }
+  tableBrightness = brightness;
+  tableWhiteBalance = balance;
+  channelTablesValid = true;
+}
+
+// Convert count pixels to output levels; ditherPhase is NO_DITHER or a frame counter
+void applyColor(const CRGB* in, CRGB* out, uint8_t count, uint8_t ditherPhase) {
+  for (uint8_t i = 0; i < count; i++) {
+    uint8_t offset = ditherPhase == NO_DITHER ? 128 : ditherOffsets[(ditherPhase + i) & 7];
+    for (uint8_t c = 0; c < 3; c++) {
+      out[i][c] = (channelTable[c][in[i][c]] + offset) >> 8;
+    }
+  }
+}
+
+// ===== Power =====
+
+// Busy time of loop() and the render task and the light the LEDs give off, turned into a
+// duty cycle and a supply current estimate once per POWER_WINDOW_MS (see /stats). The
+// current model is rough: a base for the chip with Wi‑Fi in modem sleep, a share per busy
+// core and the WS2812B drive current, which is linear in the output level.
+#define POWER_WINDOW_MS 10000
+#ifndef POWER_BASE_MA
+#define POWER_BASE_MA    25  // Chip with both cores blocked, Wi‑Fi in modem sleep
+#endif
+#ifndef POWER_CORE_MA
+#define POWER_CORE_MA    25  // Extra for one core busy all the time at 240 MHz
+#endif
+#ifndef LED_IDLE_MA
+#define LED_IDLE_MA      1   // WS2812B with all channels off
+#endif
+#ifndef LED_CHANNEL_MA
+#define LED_CHANNEL_MA   20  // One WS2812B channel at full level
+#endif
+
+// Written by their own task only; the counters wrap and are read as differences
+volatile uint32_t loopBusyUs = 0;   // loop() passes without their wait
+volatile uint32_t renderBusyUs = 0; // Render frames
+volatile uint32_t ledLevelMs = 0;   // Sum of the output levels shown, times how long (ms)
+volatile uint32_t ledShownMs = 0;   // Time covered by ledLevelMs
+uint16_t frameLevel = 0;            // Sum of the output levels of lastFrame
+unsigned long ledAccountedAt = 0;   // millis() up to which ledLevelMs is counted
+
+// Results of the last complete window
+float loopDuty = 0;
+float renderDuty = 0;
+uint16_t currentEstimateMa = 0;
+
+unsigned long powerWindowStart = 0;
+uint32_t powerLoopMark = 0;
+uint32_t powerRenderMark = 0;
+uint32_t powerLevelMark = 0;
+uint32_t powerShownMark = 0;
+
+// Count the time the current frame has been shown (render task only)
+void accountLedLevel() {
+  unsigned long currentMillis = millis();
+  uint32_t shown = currentMillis - ledAccountedAt;
+  ledAccountedAt = currentMillis;
+  ledLevelMs += frameLevel * shown;
+  ledShownMs += shown;
+}
+
+// Called from loop(): close the window once it is complete
+void updatePower() {
+  unsigned long currentMillis = millis();
+  uint32_t windowMs = currentMillis - powerWindowStart;
+  if (windowMs < POWER_WINDOW_MS) return;
+  
+  uint32_t loopUs = loopBusyUs;
+  uint32_t renderUs = renderBusyUs;
+  uint32_t levelMs = ledLevelMs;
+  uint32_t shownMs = ledShownMs;
+  
+  loopDuty = (float)(loopUs - powerLoopMark) / windowMs / 1000;
+  renderDuty = (float)(renderUs - powerRenderMark) / windowMs / 1000;
+  float level = shownMs != powerShownMark ? (float)(levelMs - powerLevelMark) / (shownMs - powerShownMark) : frameLevel;
+  currentEstimateMa = POWER_BASE_MA + (loopDuty + renderDuty) * POWER_CORE_MA +
+                      FRAME_LEDS * LED_IDLE_MA + level * LED_CHANNEL_MA / 255;
+  
+  powerWindowStart = currentMillis;
+  powerLoopMark = loopUs;
+  powerRenderMark = renderUs;
+  powerLevelMark = levelMs;
+  powerShownMark = shownMs;
+}
+
+// ===== Render Stage =====
+
+// Output levels the strips currently show, laid out like frameBuffer; FastLED sends from here
+CRGB lastFrame[FRAME_LEDS];
+bool lastFrameValid = false; // False until the first frame has been pushed
+
+// Convert the frame buffer to output levels and push only the strips that changed
+void renderFrame() {
+  uint8_t ditherPhase = NO_DITHER;
+#if COLOR_DITHER
+  if (tableBrightness < DITHER_BRIGHTNESS) ditherPhase = ditherFrame++ & 7;
+#endif
+  
+  CRGB frame[FRAME_LEDS];
+  applyColor(frameBuffer, frame, FRAME_LEDS, ditherPhase);
+  if (lastFrameValid && memcmp(frame, lastFrame, sizeof(frame)) == 0) {
+    framesSkipped++;
+    return;
+  }
+  
+  PROFILE_START(showMark);
+  for (uint8_t s = 0; s < STRIP_COUNT; s++) {
+    const StripMap& strip = stripMap[s];
+    if (!lastFrameValid || memcmp(frame + strip.offset, lastFrame + strip.offset, strip.count * sizeof(CRGB)) != 0) {
+      memcpy(lastFrame + strip.offset, frame + strip.offset, strip.count * sizeof(CRGB));
+      FastLED[s].showLeds(255); // Brightness is part of the output levels
+      bytesPushed += strip.count * sizeof(CRGB);
+    }
+  }
+  PROFILE_LAP(STAGE_SHOW, showMark);
+  
+  frameLevel = 0;
+  for (uint8_t i = 0; i < FRAME_LEDS; i++) {
+    frameLevel += lastFrame[i].r + lastFrame[i].g + lastFrame[i].b;
+  }
+  lastFrameValid = true;
+  framesRendered++;
+}
+
+// ===== Effects =====
+
+// The display functions draw lit segments in LIT; the effect selected by `mode` then
+// colours every lit LED of the frame in one pass. Animation follows the time, not the
+// number of frames, so a late frame catches up instead of slowing the effect. Once the
+// clock is set that time is the wall clock, so every watch synced to NTP shows the same
+// hue and blinks its colon at the same moment.
+const CRGB LIT = CRGB::White;
+
+#define HUE_RATE         335544 // Hue phase per ms and speed step: 20 hues/s, the old rainbow at 20 FPS
+#define BREATH_RATE      429497 // Breath phase per ms and speed step: one breath in 10 s at speed 1
+#define BREATH_FLOOR     24     // Lowest breathing level, so the time stays readable
+#define GRADIENT_STEP    12     // Hue difference between neighbouring segment columns
+#define HUE_STEP_MS      50     // Time per hue at speed 1 (2^24 / HUE_RATE)
+#define BREATH_STEP_MS   39     // Time per breath phase step at speed 1 (2^24 / BREATH_RATE)
+#define PULSE_STEP_MS    4      // Time per colon pulse step (1000 / 256)
+
+enum EffectId : uint8_t {
+  EFFECT_RAINBOW,     // Whole display cycles through the colour wheel
+  EFFECT_STATIC,      // Fixed colour
+  EFFECT_GRADIENT,    // Rainbow spread across the segment columns, moving
+  EFFECT_BREATHING,   // Fixed colour fading in and out
+  EFFECT_COLON_PULSE, // Fixed colour with the colon pulsing once a second
+  EFFECT_COUNT
+};
+
+// What every effect may draw from in one frame
+struct EffectFrame {
+  CRGB color;      // Static colour setting
+  uint8_t hue;     // Rainbow hue
+  uint8_t breath;  // Breathing level, 0-255
+  uint8_t pulse;   // Colon pulse level, 0-255
+};
+
+struct Effect {
+  const char* name;
+  void (*render)(const EffectFrame& frame);
+  bool steadyColon; // The clock leaves the colon lit for the effect to animate
+  uint16_t stepMs;  // Time between visible animation steps at speed 1; 0 for a still effect
+};
+
+// Horizontal position of each segment within a digit, in strip order (g, d, c, b, a, f, e)
+const uint8_t segmentColumn[NUM_LEDS] = {1, 1, 2, 2, 1, 0, 0};
+#define COLON_COLUMN 6 // Between the hour digits (columns 0-5) and the minute digits (7-12)
+
+// Give a colour the brightness level (0-255)
+CRGB scaleColor(CRGB color, uint8_t level) {
+  return CRGB((color.r * (level + 1)) >> 8, (color.g * (level + 1)) >> 8, (color.b * (level + 1)) >> 8);
+}
+
+// 0 → 255 → 0 over one phase cycle, eased so it lingers near the ends
+uint8_t easedWave(uint8_t phase) {
+  uint8_t triangle = phase < 128 ? phase * 2 : (255 - phase) * 2;
+  return (triangle * triangle) / 255;
+}
+
+// Colour the lit LEDs among count frame buffer LEDs starting at first
+void colorLit(uint8_t first, uint8_t count, CRGB color) {
+  for (uint8_t i = first; i < first + count; i++) {
+    if (frameBuffer[i] != CRGB::Black) frameBuffer[i] = color;
+  }
+}
+
+void effectRainbow(const EffectFrame& frame) {
+  colorLit(0, FRAME_LEDS, hueColors[frame.hue]);
+}
+
+void effectStatic(const EffectFrame& frame) {
+  colorLit(0, FRAME_LEDS, frame.color);
+}
+
+void effectGradient(const EffectFrame& frame) {
+  for (uint8_t d = 0; d < DIGIT_COUNT; d++) {
+    uint8_t firstColumn = d * 3 + (d >= 2 ? 1 : 0);
+    for (uint8_t i = 0; i < NUM_LEDS; i++) {
+      CRGB& led = frameBuffer[segmentLed(d, i)];
+      if (led != CRGB::Black) {
+        led = hueColors[(uint8_t)(frame.hue + (firstColumn + segmentColumn[i]) * GRADIENT_STEP)];
+      }
+    }
+  }
+  colorLit(colonLed(0), COLON_COUNT, hueColors[(uint8_t)(frame.hue + COLON_COLUMN * GRADIENT_STEP)]);
+}
+
+void effectBreathing(const EffectFrame& frame) {
+  colorLit(0, FRAME_LEDS, scaleColor(frame.color, frame.breath));
+}
+
+void effectColonPulse(const EffectFrame& frame) {
+  colorLit(segmentLed(0, 0), DIGIT_COUNT * NUM_LEDS, frame.color);
+  colorLit(colonLed(0), COLON_COUNT, scaleColor(frame.color, frame.pulse));
+}
+
+// Indexed by EffectId, which is what `mode` holds
+const Effect effects[EFFECT_COUNT] = {
+  {"rainbow", effectRainbow, false, HUE_STEP_MS},
+  {"static", effectStatic, false, 0},
+  {"gradient", effectGradient, false, HUE_STEP_MS},
+  {"breathing", effectBreathing, false, BREATH_STEP_MS},
+  {"colonPulse", effectColonPulse, true, PULSE_STEP_MS},
+};
+
+const Effect& activeEffect(uint8_t mode) {
+  return effects[mode < EFFECT_COUNT ? mode : (uint8_t)EFFECT_RAINBOW];
+}
+
+// UTC epoch ms once the clock is set, millis() until then
+int64_t animationMs(const DisplaySnapshot& snap, unsigned long now) {
+  return (int64_t)now + snap.clockOffsetMs;
+}
+
+// Work out the animation phases for the time and colour the frame. A phase is a
+// function of the time alone, so a speed change moves it, alike on every watch
+void applyEffect(const DisplaySnapshot& snap) {
+  int64_t time = animationMs(snap, millis());
+  // 2^32 is one full cycle, so the phases wrap with the low 32 bits of the time
+  uint32_t huePhase = (uint32_t)time * snap.rainbowSpeed * HUE_RATE;
+  uint32_t breathPhase = (uint32_t)time * snap.rainbowSpeed * BREATH_RATE;
+  
+  EffectFrame frame;
+  frame.color = snap.staticColor;
+  frame.hue = huePhase >> 24;
+  frame.breath = BREATH_FLOOR + easedWave(breathPhase >> 24) * (255 - BREATH_FLOOR) / 255;
+  frame.pulse = easedWave((time % 1000) * 256 / 1000);
+  activeEffect(snap.mode).render(frame);
+}
 
 // ===== Display Functions =====
 
-// Display a digit (0-9) on a given LED array with specified color
-void displayDigit(uint8_t digit, CRGB ledsArray[], CRGB color) {
-  if (digit > 9) digit = 0; // Prevent invalid indexes
-  
-  for (uint8_t i = 0; i < NUM_LEDS; i++) {
-    ledsArray[i] = pgm_read_byte(&digits[digit][i]) ? color : CRGB::Black;
-  }
+// Look up the segment mask for a character; anything outside the font is blank
+uint8_t glyphMask(char c) {
+  uint8_t index = (uint8_t)c - FONT_FIRST;
+  return index < FONT_SIZE ? pgm_read_byte(&font[index]) : 0;
+}
+
+// Set count frame buffer LEDs starting at first to one color
+void fillLeds(uint8_t first, uint8_t count, CRGB color) {
+  for (uint8_t i = first; i < first + count; i++) {
+    frameBuffer[i] = color;
+  }
+}
+
+// Light the segments of a mask on a digit position (0-3) with specified color
+void displayMask(uint8_t mask, uint8_t position, CRGB color) {
+  for (uint8_t i = 0; i < NUM_LEDS; i++) {
+    frameBuffer[segmentLed(position, i)] = (mask >> i) & 1 ? color : CRGB::Black;
+  }
+}
+
+// Display a digit (0-9) on a digit position with specified color
+void displayDigit(uint8_t digit, uint8_t position, CRGB color) {
+  if (digit > 9) digit = 0; // Prevent invalid indexes
+  displayMask(glyphMask('0' + digit), position, color);
+}
+
+// Display a character on a digit position with specified color
+void displayChar(char c, uint8_t position, CRGB color) {
+  displayMask(glyphMask(c), position, color);
+}
+
+// Light both colon dots, or turn them off with CRGB::Black
+void displayColon(CRGB color) {
+  fillLeds(colonLed(0), COLON_COUNT, color);
+}
+
+// Display a status (same digit on all displays); used for showing "0" or "2"
+void displayStatus(uint8_t status, CRGB color) {
+  for (uint8_t position = 0; position < DIGIT_COUNT; position++) {
+    displayDigit(status, position, color);
+  }
+  displayColon(CRGB::Black);
+}
+
+// Display the time (hours and minutes)
+void displayTime(const DisplaySnapshot& snap, CRGB color) {
+  uint8_t hours = snap.hour;
+  uint8_t minutes = snap.minute;
+  
+  displayDigit(hours / 10, 0, color);
+  displayDigit(hours % 10, 1, color);
+  displayDigit(minutes / 10, 2, color);
+  displayDigit(minutes % 10, 3, color);
+  
+  // Colon lit for the first half of every second; some effects animate a steady colon instead
+  bool colonLit = animationMs(snap, millis()) % 1000 < 500 || activeEffect(snap.mode).steadyColon;
+  displayColon(colonLit ? color : CRGB::Black);
+}
+
+// ===== Text Marquee =====
+
+#define MARQUEE_END_PAUSE    1000 // Extra hold (ms) on the last position before repeating
+#define MARQUEE_DEFAULT_STEP 500  // Default time (ms) per scroll step
+
+// Scrolls a text across the 4 digits; advanced by loop() without blocking
+struct Marquee {
+  char text[MARQUEE_MAX_LEN + 1];
+  uint8_t len;
+  uint8_t pos;                  // Index of the character shown on the first digit
+  uint16_t stepMs;              // Time per scroll step
+  uint8_t repeatsLeft;          // Passes still to run, including the current one
+  unsigned long nextStep;       // millis() at which pos advances
+  bool active;
+};
+Marquee marquee = {};
+
+// Ask the render task to scroll a text; replaces any text that is currently scrolling
+void requestMarquee(const char* text, uint16_t stepMs, uint8_t repeats) {
+  strncpy(marqueeRequestText, text, MARQUEE_MAX_LEN);
+  marqueeRequestText[MARQUEE_MAX_LEN] = '\0';
+  marqueeRequestStep = stepMs;
+  marqueeRequestRepeats = repeats;
+  marqueeRequestSerial++;
+}
+
+// Start scrolling a text (render task only)
+void startMarquee(const char* text, uint16_t stepMs, uint8_t repeats) {
+  strncpy(marquee.text, text, MARQUEE_MAX_LEN);
+  marquee.text[MARQUEE_MAX_LEN] = '\0';
+  marquee.len = strlen(marquee.text);
+  marquee.pos = 0;
+  marquee.stepMs = stepMs;
+  marquee.repeatsLeft = repeats > 0 ? repeats : 1;
+  marquee.nextStep = millis() + stepMs + (marquee.len <= 4 ? MARQUEE_END_PAUSE : 0);
+  marquee.active = true;
+}
+
+// Advance the scroll position when its step time has passed
+void updateMarquee() {
+  if (!marquee.active) return;
+  
+  unsigned long currentMillis = millis();
+  if ((long)(currentMillis - marquee.nextStep) < 0) return;
+  
+  uint8_t lastPos = marquee.len > 4 ? marquee.len - 4 : 0;
+  if (marquee.pos < lastPos) {
+    marquee.pos++;
+  } else if (--marquee.repeatsLeft > 0) {
+    marquee.pos = 0; // Start the next pass
+  } else {
+    marquee.active = false; // Hand the display back to the clock or timer
+    return;
+  }
+  
+  // Hold the last position a little longer so the end of the text can be read
+  marquee.nextStep = currentMillis + marquee.stepMs + (marquee.pos == lastPos ? MARQUEE_END_PAUSE : 0);
+}
+
+// Draw the current 4-character window of the marquee text
+void displayMarquee(CRGB color) {
+  for (uint8_t d = 0; d < DIGIT_COUNT; d++) {
+    uint8_t index = marquee.pos + d;
+    displayChar(index < marquee.len ? marquee.text[index] : ' ', d, color);
+  }
+  
+  // Turn off colon during text display
+  displayColon(CRGB::Black);
+}
+
+// ===== Schedule =====
+
+// Auto brightness and timed mode or colour changes follow a list of rules. A rule takes
+// effect at a minute of the day on some weekdays; its brightness holds until the next
+// rule that sets one and fades in over its ramp. loop() works out the fade and when
+// the next rule is due only when something changes, so each frame just checks whether
+// the fade is over. The default rules are the old fixed windows.
+#define MINUTES_PER_WEEK    10080
+#define MAX_RAMP_MINUTES    1439
+#define SCHEDULE_RECHECK_MS 3600000 // Look at the schedule at least this often, for DST changes and clock corrections
+
+const ScheduleRule defaultSchedule[] = {
+  {6 * 60, ALL_DAYS, LEVEL_TRANSITION, SCHEDULE_KEEP, false, CRGB(0, 0, 0), 0},
+  {9 * 60, ALL_DAYS, LEVEL_DAY, SCHEDULE_KEEP, false, CRGB(0, 0, 0), 0},
+  {18 * 60, ALL_DAYS, LEVEL_TRANSITION, SCHEDULE_KEEP, false, CRGB(0, 0, 0), 0},
+  {22 * 60, ALL_DAYS, LEVEL_NIGHT, SCHEDULE_KEEP, false, CRGB(0, 0, 0), 0},
+};
+
+unsigned long nextScheduleCheck = 0;          // millis() when the next rule is due, or a recheck
+bool scheduleStale = true;                    // Rules or the clock changed since the last look
+timeStatus_t scheduleTimeStatus = timeNotSet;
+
+// Rules changed: save them with the settings and work out the fade again
+void scheduleChanged() {
+  scheduleDirty = true;
+  scheduleStale = true;
+}
+
+void resetSchedule() {
+  memcpy(scheduleRules, defaultSchedule, sizeof(defaultSchedule));
+  scheduleRuleCount = sizeof(defaultSchedule) / sizeof(defaultSchedule[0]);
+}
+
+// Add a rule, keeping the list in time-of-day order; returns why not, or NULL
+const char* addScheduleRule(const ScheduleRule& rule) {
+  if (scheduleRuleCount >= MAX_SCHEDULE_RULES) return "schedule is full";
+  
+  uint8_t i = scheduleRuleCount++;
+  for (; i > 0 && scheduleRules[i - 1].minute > rule.minute; i--) {
+    scheduleRules[i] = scheduleRules[i - 1];
+  }
+  scheduleRules[i] = rule;
+  scheduleChanged();
+  return NULL;
+}
+
+const char* deleteScheduleRule(long index) {
+  if (index < 0 || index >= scheduleRuleCount) return "no such rule";
+  
+  memmove(scheduleRules + index, scheduleRules + index + 1, (scheduleRuleCount - index - 1) * sizeof(ScheduleRule));
+  scheduleRuleCount--;
+  scheduleChanged();
+  return NULL;
+}
+
+// "HH:MM" as minute of the day; false if text is not a valid time
+bool parseClockTime(const char* text, uint16_t& minute) {
+  unsigned hour, minutes;
+  char extra;
+  if (!text || sscanf(text, "%u:%u%c", &hour, &minutes, &extra) != 2 || hour > 23 || minutes > 59) return false;
+  minute = hour * 60 + minutes;
+  return true;
+}
+
+// Rule brightness from a percentage or "day", "night" or "transition"
+bool parseLevel(const char* text, uint8_t& level) {
+  if (!text || !*text) return false;
+  if (strcmp(text, "day") == 0) level = LEVEL_DAY;
+  else if (strcmp(text, "night") == 0) level = LEVEL_NIGHT;
+  else if (strcmp(text, "transition") == 0) level = LEVEL_TRANSITION;
+  else if (isdigit(*text)) level = constrain(atoi(text), 0, 100);
+  else return false;
+  return true;
+}
+
+// Name of a LEVEL_* brightness; NULL for a percentage
+const char* levelName(uint8_t level) {
+  switch (level) {
+    case LEVEL_DAY: return "day";
+    case LEVEL_NIGHT: return "night";
+    case LEVEL_TRANSITION: return "transition";
+    default: return NULL;
+  }
+}
+
+bool parseHexColor(const char* text, CRGB& color) {
+  if (!text) return false;
+  if (*text == '#') text++;
+  char* end;
+  long value = strtol(text, &end, 16);
+  if (end - text != 6 || *end) return false;
+  color = CRGB((value >> 16) & 0xFF, (value >> 8) & 0xFF, value & 0xFF);
+  return true;
+}
+
+// Local time as minute of the week (Monday 00:00 is 0) and milliseconds into that minute
+uint16_t localMinuteOfWeek(uint32_t& msIntoMinute) {
+  msIntoMinute = Poland.second() * 1000UL + UTC.ms();
+  uint8_t day = (Poland.weekday() + 5) % 7; // ezTime counts from Sunday = 1
+  return day * 1440 + Poland.hour() * 60 + Poland.minute();
+}
+
+// Minutes since the rule last started at or before minuteOfWeek (0: this minute);
+// MINUTES_PER_WEEK if it is set for no day
+uint16_t minutesSinceRule(const ScheduleRule& rule, uint16_t minuteOfWeek) {
+  uint16_t since = MINUTES_PER_WEEK;
+  for (uint8_t day = 0; day < 7; day++) {
+    if (!(rule.days & (1 << day))) continue;
+    uint16_t ago = (minuteOfWeek + MINUTES_PER_WEEK - (day * 1440 + rule.minute)) % MINUTES_PER_WEEK;
+    if (ago < since) since = ago;
+  }
+  return since;
+}
+
+// The rule whose brightness is in force at minuteOfWeek, and how long ago it started;
+// NULL if no rule sets brightness
+const ScheduleRule* brightnessRuleAt(uint16_t minuteOfWeek, uint16_t& since) {
+  const ScheduleRule* found = NULL;
+  since = MINUTES_PER_WEEK;
+  for (uint8_t i = 0; i < scheduleRuleCount; i++) {
+    const ScheduleRule& rule = scheduleRules[i];
+    if (rule.brightness == SCHEDULE_KEEP) continue;
+    uint16_t ago = minutesSinceRule(rule, minuteOfWeek);
+    if (ago < since) {
+      since = ago;
+      found = &rule;
+    }
+  }
+  return found;
+}
+
+// Mode and colour of a rule whose time has come
+void applyScheduleRule(const ScheduleRule& rule) {
+  if (rule.mode == SCHEDULE_KEEP && !rule.setsColor) return;
+  
+  if (rule.mode != SCHEDULE_KEEP) mode = rule.mode;
+  if (rule.setsColor) staticColor = rule.color;
+  saveSettings();
+  Serial.print("Schedule rule at minute ");
+  Serial.print(rule.minute);
+  Serial.println(" applied");
+}
+
+// Work out the current brightness fade and when the next rule is due. When due is set
+// the rules starting this minute also apply their mode and colour.
+void evaluateSchedule(bool due) {
+  uint32_t msIntoMinute;
+  uint16_t now = localMinuteOfWeek(msIntoMinute);
+  unsigned long currentMillis = millis();
+  
+  // The fade runs from the level before the rule in force to that rule's level
+  uint16_t since;
+  const ScheduleRule* rule = brightnessRuleAt(now, since);
+  if (rule) {
+    uint16_t before;
+    const ScheduleRule* previous = brightnessRuleAt((now + MINUTES_PER_WEEK - since - 1) % MINUTES_PER_WEEK, before);
+    scheduleFrom = previous->brightness;
+    scheduleTo = rule->brightness;
+    scheduleRampStart = currentMillis - since * 60000UL - msIntoMinute;
+    scheduleRampMs = rule->rampMinutes * 60000UL;
+  } else {
+    scheduleFrom = 100;
+    scheduleTo = 100;
+    scheduleRampMs = 0;
+  }
+  
+  // Wait for the next rule to start; one starting this minute is next due in a week
+  unsigned long wait = SCHEDULE_RECHECK_MS;
+  for (uint8_t i = 0; i < scheduleRuleCount; i++) {
+    const ScheduleRule& next = scheduleRules[i];
+    if (due && minutesSinceRule(next, now) == 0) applyScheduleRule(next);
+    
+    uint16_t until = MINUTES_PER_WEEK;
+    for (uint8_t day = 0; day < 7; day++) {
+      if (!(next.days & (1 << day))) continue;
+      uint16_t ahead = (day * 1440 + next.minute + MINUTES_PER_WEEK - now) % MINUTES_PER_WEEK;
+      if (ahead > 0 && ahead < until) until = ahead;
+    }
+    wait = min(wait, until * 60000UL - msIntoMinute);
+  }
+  nextScheduleCheck = currentMillis + wait;
+}
+
+// Called from loop(): look at the schedule again when a rule is due or the rules or the
+// clock changed; otherwise this is one comparison
+void updateSchedule() {
+  timeStatus_t status = timeStatus();
+  if (status != scheduleTimeStatus) {
+    scheduleTimeStatus = status;
+    scheduleStale = true;
+  }
+  
+  if (scheduleStale) {
+    scheduleStale = false;
+    evaluateSchedule(false);
+  } else if ((long)(millis() - nextScheduleCheck) >= 0) {
+    evaluateSchedule(true);
+  }
+}
+
+// Percent of the maximum brightness for a rule level
+uint8_t levelPercent(const DisplaySnapshot& snap, uint8_t level) {
+  switch (level) {
+    case LEVEL_DAY: return snap.dayBrightness;
+    case LEVEL_NIGHT: return snap.nightBrightness;
+    case LEVEL_TRANSITION: return snap.transitionBrightness;
+    default: return level;
+  }
+}
+
+// Brightness for this frame: the user setting or, with auto brightness, the scheduled
+// share of it, part way through a fade while one runs
+uint8_t getTimeBrightness(const DisplaySnapshot& snap) {
+  if (!snap.autoBrightness) {
+    return snap.brightness; // Return user setting if auto brightness is disabled
+  }
+  
+  // Calculate the actual brightness value based on user setting as maximum
+  uint8_t target = snap.brightness * levelPercent(snap, snap.scheduleTo) / 100;
+  uint32_t elapsed = millis() - snap.scheduleRampStart;
+  if (elapsed >= snap.scheduleRampMs) return target;
+  
+  uint8_t start = snap.brightness * levelPercent(snap, snap.scheduleFrom) / 100;
+  return start + (int64_t)(target - start) * elapsed / snap.scheduleRampMs;
+}
+
+// ===== Settings =====
+
+// Settings are written behind: changes only mark them dirty, and once they have been
+// quiet for SETTINGS_QUIET_MS the keys whose value differs from flash are written.
+#define SETTINGS_QUIET_MS 3000
+
+// Copy of the values currently stored in flash
+struct StoredSettings {
+  uint8_t brightness;
+  uint8_t mode;
+  uint8_t red;
+  uint8_t green;
+  uint8_t blue;
+  uint8_t rainbowSpeed;
+  bool autoBrightness;
+  uint8_t dayBrightness;
+  uint8_t nightBrightness;
+  uint8_t transitionBrightness;
+  uint8_t wbRed;
+  uint8_t wbGreen;
+  uint8_t wbBlue;
+};
+StoredSettings storedSettings;
+bool storedSettingsValid = false;    // False until flash is known to hold every key
+
+bool settingsDirty = false;
+unsigned long settingsChangedAt = 0; // millis() of the most recent change
+unsigned long nvsWrites = 0;         // Keys written since boot
+unsigned long nvsWritesTotal = 0;    // Keys written over the device's lifetime
+
+// Note that settings changed; they are written once changes stop coming in
+void saveSettings() {
+  settingsDirty = true;
+  settingsChangedAt = millis();
+}
+
+// Write one key if flash does not hold this value yet
+void persistUChar(const char* key, uint8_t value, uint8_t& stored) {
+  if (storedSettingsValid && value == stored) return;
+  if (preferences.putUChar(key, value)) {
+    stored = value;
+    nvsWrites++;
+  }
+}
+
+void persistBool(const char* key, bool value, bool& stored) {
+  if (storedSettingsValid && value == stored) return;
+  if (preferences.putBool(key, value)) {
+    stored = value;
+    nvsWrites++;
+  }
+}
+
+// Settings to be written, copied under the state lock so flash is written outside it
+struct SettingsCopy {
+  StoredSettings values;
+  bool writeSchedule;                 // Rules changed and are written too
+  uint8_t scheduleRuleCount;
+  ScheduleRule scheduleRules[MAX_SCHEDULE_RULES];
+  bool writeGroups;                   // Likewise the groups
+  uint8_t groupCount;
+  char groups[MAX_GROUPS][GROUP_NAME_LEN + 1];
+};
+SettingsCopy settingsCopy;            // Only used by loop(); too big for its stack
+
+// Take the pending settings and mark them written (state lock held)
+void copySettings(SettingsCopy& copy) {
+  settingsDirty = false;
+  copy.values.brightness = userBrightness;
+  copy.values.mode = mode;
+  copy.values.red = staticColor.red;
+  copy.values.green = staticColor.green;
+  copy.values.blue = staticColor.blue;
+  copy.values.rainbowSpeed = rainbowSpeed;
+  copy.values.autoBrightness = autoBrightnessEnabled;
+  copy.values.dayBrightness = dayBrightness;
+  copy.values.nightBrightness = nightBrightness;
+  copy.values.transitionBrightness = transitionBrightness;
+  copy.values.wbRed = whiteBalance.red;
+  copy.values.wbGreen = whiteBalance.green;
+  copy.values.wbBlue = whiteBalance.blue;
+  
+  copy.writeSchedule = scheduleDirty;
+  if (scheduleDirty) {
+    copy.scheduleRuleCount = scheduleRuleCount;
+    memcpy(copy.scheduleRules, scheduleRules, sizeof(scheduleRules));
+    scheduleDirty = false;
+  }
+  copy.writeGroups = groupsDirty;
+  if (groupsDirty) {
+    copy.groupCount = groupCount;
+    memcpy(copy.groups, groups, sizeof(groups));
+    groupsDirty = false;
+  }
+}
+
+// Write copied settings to non-volatile storage now
+void writeSettings(const SettingsCopy& copy) {
+  unsigned long writesBefore = nvsWrites;
+  preferences.begin("clockSettings", false); // "clockSettings" is the namespace
+  
+  persistUChar("brightness", copy.values.brightness, storedSettings.brightness);
+  persistUChar("mode", copy.values.mode, storedSettings.mode);
+  persistUChar("red", copy.values.red, storedSettings.red);
+  persistUChar("green", copy.values.green, storedSettings.green);
+  persistUChar("blue", copy.values.blue, storedSettings.blue);
+  persistUChar("rainbowSpeed", copy.values.rainbowSpeed, storedSettings.rainbowSpeed);
+  persistBool("autoBrightness", copy.values.autoBrightness, storedSettings.autoBrightness);
+  persistUChar("dayBrightness", copy.values.dayBrightness, storedSettings.dayBrightness);
+  persistUChar("nightBrightness", copy.values.nightBrightness, storedSettings.nightBrightness);
+  persistUChar("transBrightness", copy.values.transitionBrightness, storedSettings.transitionBrightness);
+  persistUChar("wbRed", copy.values.wbRed, storedSettings.wbRed);
+  persistUChar("wbGreen", copy.values.wbGreen, storedSettings.wbGreen);
+  persistUChar("wbBlue", copy.values.wbBlue, storedSettings.wbBlue);
+  storedSettingsValid = true;
+  
+  // Schedule rules are written as one block whenever they changed; the count on its
+  // own, as an empty block cannot be stored
+  if (copy.writeSchedule) {
+    if (preferences.putUChar("scheduleCount", copy.scheduleRuleCount)) nvsWrites++;
+    if (copy.scheduleRuleCount &&
+        preferences.putBytes("schedule", copy.scheduleRules, copy.scheduleRuleCount * sizeof(ScheduleRule))) {
+      nvsWrites++;
+    }
+  }
+  if (copy.writeGroups) {
+    if (preferences.putUChar("groupCount", copy.groupCount)) nvsWrites++;
+    if (copy.groupCount && preferences.putBytes("groups", copy.groups, copy.groupCount * sizeof(copy.groups[0]))) {
+      nvsWrites++;
+    }
+  }
+  
+  // Lifetime write counter for tracking flash wear (counts its own write too)
+  unsigned long written = nvsWrites - writesBefore;
+  if (written > 0) {
+    nvsWritesTotal += written + 1;
+    preferences.putULong("nvsWrites", nvsWritesTotal);
+    nvsWrites++;
+  }
+  
+  preferences.end();
+  Serial.print("Settings saved to flash (");
+  Serial.print(written);
+  Serial.println(" keys written)");
+}
+
+// Write pending settings now; also run at a software restart
+void flushSettings() {
+  if (!settingsDirty) return;
+  copySettings(settingsCopy);
+  writeSettings(settingsCopy);
+}
+
+// Flush pending settings once they have been quiet long enough; takes the state lock
+// for the copy only
+void updateSettings() {
+  ALLOC_SCOPE(ALLOC_SETTINGS);
+  {
+    StateLock lock;
+    if (!settingsDirty || millis() - settingsChangedAt < SETTINGS_QUIET_MS) return;
+    copySettings(settingsCopy);
+  }
+  writeSettings(settingsCopy);
+}
+
+// Load settings from non-volatile storage
+void loadSettings() {
+  preferences.begin("clockSettings", true); // true = read-only mode
+  
+  if (preferences.isKey("brightness")) {
+    userBrightness = preferences.getUChar("brightness", 25);
+    mode = preferences.getUChar("mode", 0);
+    staticColor.red = preferences.getUChar("red", 255);
+    staticColor.green = preferences.getUChar("green", 0);
+    staticColor.blue = preferences.getUChar("blue", 0);
+    rainbowSpeed = preferences.getUChar("rainbowSpeed", 1);
+    autoBrightnessEnabled = preferences.getBool("autoBrightness", true);
+    dayBrightness = preferences.getUChar("dayBrightness", 100);
+    nightBrightness = preferences.getUChar("nightBrightness", 10);
+    transitionBrightness = preferences.getUChar("transBrightness", 50);
+    whiteBalance.red = preferences.getUChar("wbRed", 255);
+    whiteBalance.green = preferences.getUChar("wbGreen", 255);
+    whiteBalance.blue = preferences.getUChar("wbBlue", 255);
+    
+    Serial.println("Settings loaded from flash");
+  } else {
+    Serial.println("No saved settings found, using defaults");
+  }
+  
+  // Without saved rules, or with ones that do not fit this layout, the default schedule applies
+  uint8_t ruleCount = preferences.getUChar("scheduleCount", SCHEDULE_KEEP);
+  size_t ruleBytes = ruleCount * sizeof(ScheduleRule);
+  if (ruleCount <= MAX_SCHEDULE_RULES &&
+      (ruleCount == 0 || preferences.getBytes("schedule", scheduleRules, sizeof(scheduleRules)) == ruleBytes)) {
+    scheduleRuleCount = ruleCount;
+  } else {
+    resetSchedule();
+  }
+  
+  // No groups unless a complete list was saved
+  uint8_t savedGroups = preferences.getUChar("groupCount", 0);
+  if (savedGroups <= MAX_GROUPS &&
+      (savedGroups == 0 || preferences.getBytes("groups", groups, sizeof(groups)) == savedGroups * sizeof(groups[0]))) {
+    groupCount = savedGroups;
+    for (uint8_t i = 0; i < groupCount; i++) groups[i][GROUP_NAME_LEN] = 0;
+  }
+  
+  // Remember what flash holds so unchanged keys are never rewritten
+  storedSettings.brightness = userBrightness;
+  storedSettings.mode = mode;
+  storedSettings.red = staticColor.red;
+  storedSettings.green = staticColor.green;
+  storedSettings.blue = staticColor.blue;
+  storedSettings.rainbowSpeed = rainbowSpeed;
+  storedSettings.autoBrightness = autoBrightnessEnabled;
+  storedSettings.dayBrightness = dayBrightness;
+  storedSettings.nightBrightness = nightBrightness;
+  storedSettings.transitionBrightness = transitionBrightness;
+  storedSettings.wbRed = whiteBalance.red;
+  storedSettings.wbGreen = whiteBalance.green;
+  storedSettings.wbBlue = whiteBalance.blue;
+  storedSettingsValid = preferences.isKey("transBrightness");
+  nvsWritesTotal = preferences.getULong("nvsWrites", 0);
+  
+  preferences.end();
+}
+
+// ===== Wall Clock =====
+
+// The time on the display runs on millis() from the last NTP sync, corrected for the
+// crystal's drift as measured between syncs. RTC memory survives any reset but a power
+// loss, so after a crash or a restart the clock carries on from where it was within a
+// second of booting and NTP only corrects it. Small corrections are slewed rather than
+// stepped, so the display neither jumps back nor skips a minute.
+#define CLOCK_BOOTLOADER_MS   100       // Reset to the start of millis() (ROM and bootloader), which millis() misses
+#define CLOCK_FIRST_GAP_MS    2000      // Gap between record writes assumed until one has been timed
+#define CLOCK_NTP_ERROR_MS    50        // Accuracy of an NTP sync over Wi‑Fi
+#define CLOCK_STEP_MS         10000     // Larger corrections are stepped, not slewed
+#define CLOCK_SLEW_RATE       20        // Slew by 1 ms every this many ms (5 %)
+#define CLOCK_REBASE_MS       3600000UL // Fold elapsed time into the base this often
+#define CLOCK_DRIFT_SPAN_MS   7200000   // Measure the drift over at least this much NTP time
+#define CLOCK_DRIFT_MAX_PPM   500       // More than that is a clock change, not drift
+#define CLOCK_CRYSTAL_PPM     40        // Uncertainty of a crystal not yet measured
+#define CLOCK_RESIDUAL_PPM    5         // Uncertainty left once it is
+#define CLOCK_SAVE_PPM        1.0f      // Save the drift when it moved this much
+#define CLOCK_MIN_EPOCH_MS    1704067200000LL // 2024-01-01; nothing earlier is a real time
+#define CLOCK_RECORD_MAGIC    0x434c4b31 // "CLK1"
+
+enum ClockSource : uint8_t {
+  CLOCK_NONE,       // Not known yet
+  CLOCK_ESTIMATE,   // Carried over a reset, waiting for NTP
+  CLOCK_NTP
+};
+
+// Written on every loop() pass and at shutdown; RTC_NOINIT keeps it across resets
+struct ClockRecord {
+  uint32_t magic;
+  uint32_t errorMs;            // Accuracy of epochMs
+  int64_t epochMs;             // Wall clock when written
+  uint32_t gapMs;              // Longest time until the next write, as timed (0 at shutdown)
+  uint32_t checksum;
+};
+
+// Saved to flash when a new drift measurement differs enough from the saved one
+struct StoredClock {
+  int64_t syncedEpochMs;       // NTP time at the sync that measured it
+  float driftPpm;
+};
+
+RTC_NOINIT_ATTR ClockRecord clockRecord;
+
+ClockSource clockSource = CLOCK_NONE;
+int64_t clockBaseMs = 0;              // UTC epoch ms at clockBaseMillis
+unsigned long clockBaseMillis = 0;
+uint32_t clockBaseErrorMs = 0;        // Accuracy of clockBaseMs
+int32_t clockSlewMs = 0;              // Shown minus true time at the base, slewed away from there
+float clockDriftPpm = 0;              // millis() runs fast by this much (negative: slow)
+bool clockDriftMeasured = false;
+float clockSavedDriftPpm = 0;
+int64_t clockSyncedEpochMs = 0;       // Last NTP sync, this boot or saved
+time_t clockLastNtpUpdate = 0;        // ezTime's, to spot a new sync
+int64_t clockDriftStartMs = 0;        // NTP time and millis() the drift is measured from
+unsigned long clockDriftStartMillis = 0;
+unsigned long clockWriteMillis = 0;   // Last RTC record write from loop()
+uint32_t clockWriteGapMs = 0;         // Longest time between two of them; 0 until timed
+
+// Milliseconds since the epoch (UTC), as ezTime has it
+int64_t epochMs() {
+  return (int64_t)UTC.now() * 1000 + UTC.ms();
+}
+
+// Part of the last correction still to slew away, elapsed ms after the base
+int32_t clockSlewLeft(uint32_t elapsed) {
+  uint32_t slewed = elapsed / CLOCK_SLEW_RATE;
+  if (slewed >= (uint32_t)abs(clockSlewMs)) return 0;
+  return clockSlewMs > 0 ? clockSlewMs - (int32_t)slewed : clockSlewMs + (int32_t)slewed;
+}
+
+// UTC epoch ms as the display shows it; 0 while the time is not known
+int64_t wallClockMs() {
+  if (clockSource == CLOCK_NONE) return 0;
+  uint32_t elapsed = millis() - clockBaseMillis;
+  return clockBaseMs + elapsed - (int64_t)(elapsed * clockDriftPpm / 1e6f) + clockSlewLeft(elapsed);
+}
+
+// How far wallClockMs() may be off: the base's error, what is left to slew and the
+// drift that has not been corrected for since
+uint32_t wallClockErrorMs() {
+  uint32_t elapsed = millis() - clockBaseMillis;
+  uint32_t ppm = clockDriftMeasured ? CLOCK_RESIDUAL_PPM : CLOCK_CRYSTAL_PPM;
+  return clockBaseErrorMs + abs(clockSlewLeft(elapsed)) + elapsed / 1000 * ppm / 1000;
+}
+
+// millis() at which the wall clock reaches its next minute; early rather than late
+// while it runs fast to slew
+unsigned long nextClockMinute(unsigned long now) {
+  uint32_t left = 60000 - wallClockMs() % 60000;
+  if (clockSlewLeft(now - clockBaseMillis) < 0) left -= left / CLOCK_SLEW_RATE;
+  return now + left;
+}
+
+// FNV-1a
+uint32_t hashBytes(const void* data, size_t length) {
+  uint32_t hash = 2166136261u;
+  const uint8_t* bytes = (const uint8_t*)data;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+uint32_t clockChecksum(const ClockRecord& record) {
+  return hashBytes(&record, offsetof(ClockRecord, checksum));
+}
+
+// The chip restarted without losing power (crash, watchdog, software restart), so RTC
+// memory and whatever the network knew about the watch a moment ago still hold
+bool warmReset() {
+  esp_reset_reason_t reason = esp_reset_reason();
+  return reason != ESP_RST_UNKNOWN && reason != ESP_RST_POWERON && reason != ESP_RST_BROWNOUT &&
+         reason != ESP_RST_DEEPSLEEP;
+}
+
+void writeClockRecord(uint32_t gapMs) {
+  if (clockSource == CLOCK_NONE) return;
+  ClockRecord record;
+  memset(&record, 0, sizeof(record));
+  record.magic = CLOCK_RECORD_MAGIC;
+  record.errorMs = wallClockErrorMs();
+  record.epochMs = wallClockMs();
+  record.gapMs = gapMs;
+  record.checksum = clockChecksum(record);
+  clockRecord = record;
+}
+
+void writeClockRecordAtShutdown() {
+  writeClockRecord(0);
+}
+
+void saveClockDrift() {
+  StoredClock stored = {clockSyncedEpochMs, clockDriftPpm};
+  preferences.begin("clock", false);
+  if (preferences.putBytes("drift", &stored, sizeof(stored)) > 0) {
+    nvsWrites++;
+    nvsWritesTotal++;
+  }
+  preferences.end();
+  clockSavedDriftPpm = clockDriftPpm;
+  Serial.print("Clock drift saved: ");
+  Serial.print(clockDriftPpm, 1);
+  Serial.println(" ppm");
+}
+
+// Pick up the saved drift and, after a reset that kept RTC memory, the time from before it
+void restoreWallClock() {
+  StoredClock stored;
+  preferences.begin("clock", true);
+  bool saved = preferences.isKey("drift") && preferences.getBytes("drift", &stored, sizeof(stored)) == sizeof(stored);
+  preferences.end();
+  if (saved) {
+    clockDriftPpm = clockSavedDriftPpm = stored.driftPpm;
+    clockDriftMeasured = true;
+    clockSyncedEpochMs = stored.syncedEpochMs;
+  }
+  
+  // RTC memory holds noise after a power loss or brownout, and a deep sleep's length is unknown
+  ClockRecord record = clockRecord;
+  if (!warmReset() || record.magic != CLOCK_RECORD_MAGIC || record.checksum != clockChecksum(record) ||
+      record.epochMs < max(clockSyncedEpochMs, CLOCK_MIN_EPOCH_MS)) {
+    Serial.println("Clock: waiting for NTP");
+    return;
+  }
+  
+  // The reset came somewhere within the gap after the last write; millis() has counted
+  // the time since the bootloader handed over
+  unsigned long now = millis();
+  clockSource = CLOCK_ESTIMATE;
+  clockBaseMs = record.epochMs + record.gapMs / 2 + CLOCK_BOOTLOADER_MS + now;
+  clockBaseMillis = now;
+  clockBaseErrorMs = record.errorMs + record.gapMs / 2 + CLOCK_BOOTLOADER_MS;
+  Serial.print("Clock estimated from before the reset: ");
+  Serial.print(Poland.dateTime(clockBaseMs / 1000, UTC_TIME, "Y-m-d H:i:s"));
+  Serial.print(" (±");
+  Serial.print(clockBaseErrorMs);
+  Serial.println(" ms)");
+}
+
+// Take over a new NTP time: slew or step to it and measure the drift since an earlier sync
+void syncWallClock(int64_t ntpMs) {
+  unsigned long now = millis();
+  ClockSource previous = clockSource;
+  int64_t offset = previous == CLOCK_NONE ? 0 : wallClockMs() - ntpMs;
+  
+  if (clockDriftStartMs && ntpMs - clockDriftStartMs >= CLOCK_DRIFT_SPAN_MS) {
+    int64_t span = ntpMs - clockDriftStartMs;
+    float ppm = ((int64_t)(now - clockDriftStartMillis) - span) * 1e6f / span;
+    if (fabsf(ppm) <= CLOCK_DRIFT_MAX_PPM) {
+      clockDriftPpm = clockDriftMeasured ? clockDriftPpm + (ppm - clockDriftPpm) / 4 : ppm;
+      clockDriftMeasured = true;
+    }
+    clockDriftStartMs = 0;
+  }
+  if (!clockDriftStartMs) {
+    clockDriftStartMs = ntpMs;
+    clockDriftStartMillis = now;
+  }
+  
+  clockSource = CLOCK_NTP;
+  clockBaseMs = ntpMs;
+  clockBaseMillis = now;
+  clockBaseErrorMs = CLOCK_NTP_ERROR_MS;
+  clockSlewMs = offset > -CLOCK_STEP_MS && offset < CLOCK_STEP_MS ? offset : 0;
+  clockSyncedEpochMs = ntpMs;
+  
+  if (previous == CLOCK_NTP && clockSlewMs == offset) return; // Routine resync
+  Serial.print("Clock set from NTP");
+  if (previous != CLOCK_NONE) {
+    Serial.print(", ");
+    Serial.print(clockSlewMs == offset ? "slewing " : "stepped by ");
+    Serial.print((long)offset);
+    Serial.print(" ms");
+  }
+  Serial.println();
+}
+
+// Follow NTP syncs, keep the base recent and the RTC record current (loop() only)
+void updateWallClock() {
+  time_t ntpUpdate = lastNtpUpdateTime();
+  if (timeStatus() != timeNotSet && ntpUpdate != clockLastNtpUpdate) {
+    clockLastNtpUpdate = ntpUpdate;
+    syncWallClock(epochMs());
+  }
+  if (clockSource == CLOCK_NONE) return;
+  
+  // Keeps elapsed times short enough for the float drift correction and millis() wrap
+  uint32_t elapsed = millis() - clockBaseMillis;
+  if (elapsed >= CLOCK_REBASE_MS && clockSlewLeft(elapsed) == 0) {
+    clockBaseErrorMs = wallClockErrorMs();
+    clockBaseMs += elapsed - (int64_t)(elapsed * clockDriftPpm / 1e6f);
+    clockBaseMillis += elapsed;
+    clockSlewMs = 0;
+  }
+  
+  // loop() blocks for up to IDLE_MAX_MS between passes and a pass can take a while, so
+  // the next write is assumed no further off than the longest gap timed so far
+  unsigned long now = millis();
+  if (clockWriteMillis) clockWriteGapMs = max(clockWriteGapMs, (uint32_t)(now - clockWriteMillis));
+  clockWriteMillis = now;
+  writeClockRecord(clockWriteGapMs ? clockWriteGapMs : CLOCK_FIRST_GAP_MS);
+}
+
+// Save the drift once it has moved far enough from the saved value. Called from loop()
+// outside the state lock; only loop() changes the drift
+void updateClockDrift() {
+  if (clockDriftMeasured && fabsf(clockDriftPpm - clockSavedDriftPpm) >= CLOCK_SAVE_PPM) {
+    saveClockDrift();
+  }
+}
+
+// Rounded up to 1, 2 or 5 times a power of ten, so the status only changes now and then
+uint32_t roundAccuracy(uint32_t ms) {
+  uint32_t step = 1;
+  while (true) {
+    if (ms <= step) return step;
+    if (ms <= step * 2) return step * 2;
+    if (ms <= step * 5) return step * 5;
+    if (step >= 100000000) return step * 10;
+    step *= 10;
+  }
+}
+
+const char* clockSourceName(uint8_t source) {
+  switch (source) {
+    case CLOCK_ESTIMATE: return "estimate";
+    case CLOCK_NTP:      return "ntp";
+    default:             return "none";
+  }
+}
+
+// ===== Timer Functions =====
+
+// Running countdowns and alarms sit in a min-heap of timer slots ordered by deadline,
+// so loop() only ever checks the one that ends first. Deadlines are millis() values
+// compared by their signed difference, which holds across the 49-day wrap.
+uint8_t timerHeap[MAX_TIMERS];
+uint8_t timerHeapSize = 0;
+
+const char* const timerKindNames[] = {"countdown", "alarm", "stopwatch"};
+const char* const timerStateNames[] = {"stopped", "running", "paused", "ringing"};
+
+bool deadlineBefore(uint8_t a, uint8_t b) {
+  return (int32_t)(timers[a].mark - timers[b].mark) < 0;
+}
+
+void heapPlace(uint8_t pos, uint8_t slot) {
+  timerHeap[pos] = slot;
+  timers[slot].heapPos = pos;
+}
+
+void heapSiftUp(uint8_t pos) {
+  uint8_t slot = timerHeap[pos];
+  while (pos > 0) {
+    uint8_t parent = (pos - 1) / 2;
+    if (!deadlineBefore(slot, timerHeap[parent])) break;
+    heapPlace(pos, timerHeap[parent]);
+    pos = parent;
+  }
+  heapPlace(pos, slot);
+}
+
+void heapSiftDown(uint8_t pos) {
+  uint8_t slot = timerHeap[pos];
+  for (;;) {
+    uint8_t child = pos * 2 + 1;
+    if (child >= timerHeapSize) break;
+    if (child + 1 < timerHeapSize && deadlineBefore(timerHeap[child + 1], timerHeap[child])) child++;
+    if (!deadlineBefore(timerHeap[child], slot)) break;
+    heapPlace(pos, timerHeap[child]);
+    pos = child;
+  }
+  heapPlace(pos, slot);
+}
+
+void heapPush(uint8_t slot) {
+  heapPlace(timerHeapSize++, slot);
+  heapSiftUp(timerHeapSize - 1);
+}
+
+void heapRemove(uint8_t slot) {
+  uint8_t pos = timers[slot].heapPos;
+  uint8_t last = timerHeap[--timerHeapSize];
+  if (last == slot) return;
+  
+  // The last entry fills the gap and moves whichever way its deadline demands
+  heapPlace(pos, last);
+  heapSiftDown(pos);
+  heapSiftUp(timers[last].heapPos);
+}
+
+// Timer table changes are saved once they have been quiet for SETTINGS_QUIET_MS
+bool timersDirty = false;
+unsigned long timersChangedAt = 0;
+
+// Timers running at the last save wait, paused, until the clock is set; then their
+// deadline or start (UTC epoch ms, 0 if unknown) puts them back on millis()
+bool timersRestorePending = false;
+int64_t timerRestoreEpochMs[MAX_TIMERS] = {};
+
+void timersChanged() {
+  timersDirty = true;
+  timersChangedAt = millis();
+}
+
+// The clock has been set at least once; epoch times and alarms need it
+bool clockValid() {
+  return timeStatus() != timeNotSet;
+}
+
+Timer* findTimer(uint8_t id) {
+  for (Timer& timer : timers) {
+    if (timer.id == id) return &timer;
+  }
+  return NULL;
+}
+
+uint8_t timerSlot(const Timer& timer) {
+  return &timer - timers;
+}
+
+uint8_t timerCount() {
+  uint8_t count = 0;
+  for (const Timer& timer : timers) {
+    if (timer.id) count++;
+  }
+  return count;
+}
+
+// Remaining (countdown, alarm) or elapsed (stopwatch) milliseconds
+uint32_t timerValueMs(const Timer& timer, unsigned long now) {
+  if (timer.state == TIMER_RINGING) return 0;
+  if (timer.state != TIMER_RUNNING) return timer.held;
+  if (timer.kind == TIMER_STOPWATCH) return now - timer.mark;
+  return (int32_t)(timer.mark - now) > 0 ? timer.mark - now : 0;
+}
+
+// Whole seconds as displayed: remaining time rounds up, so a countdown only reads
+// 00:00 when it goes off; elapsed time rounds down
+long timerSeconds(const Timer& timer, unsigned long now) {
+  uint32_t ms = timerValueMs(timer, now);
+  return timer.kind == TIMER_STOPWATCH ? ms / 1000 : (ms + 999) / 1000;
+}
+
+// Milliseconds until the local clock next reads minuteOfDay:00 (a DST change in
+// between shifts it by the hour until the alarm re-arms)
+uint32_t msUntilAlarm(uint16_t minuteOfDay) {
+  long secondOfDay = Poland.hour() * 3600L + Poland.minute() * 60 + Poland.second();
+  long seconds = (minuteOfDay * 60L - secondOfDay + 86400) % 86400;
+  if (seconds == 0) seconds = 86400;
+  return seconds * 1000UL - UTC.ms();
+}
+
+// Count towards the deadline (countdown, alarm) or from the start (stopwatch) in mark
+void runTimer(Timer& timer, uint32_t mark) {
+  timer.mark = mark;
+  timer.state = TIMER_RUNNING;
+  if (timer.kind != TIMER_STOPWATCH) heapPush(timerSlot(timer));
+}
+
+// Stop counting, keeping held milliseconds for a later resume
+void holdTimer(Timer& timer, TimerState state, uint32_t held) {
+  if (timer.state == TIMER_RUNNING && timer.kind != TIMER_STOPWATCH) heapRemove(timerSlot(timer));
+  timer.state = state;
+  timer.held = held;
+}
+
+void armAlarm(Timer& timer) {
+  runTimer(timer, millis() + msUntilAlarm(timer.length));
+}
+
+// The timer with this ID, stopped and set up as kind; NULL if every slot is taken.
+// A NULL name keeps the name of an existing timer.
+Timer* claimTimer(uint8_t id, TimerKind kind, const char* name) {
+  Timer* timer = findTimer(id);
+  if (timer) {
+    holdTimer(*timer, TIMER_STOPPED, 0);
+  } else {
+    timer = findTimer(0);
+    if (!timer) return NULL;
+    memset(timer, 0, sizeof(*timer));
+    timer->id = id;
+  }
+  timer->kind = kind;
+  if (name) strlcpy(timer->name, name, sizeof(timer->name));
+  return timer;
+}
+
+void logTimer(const Timer& timer, const char* what) {
+  Serial.print("Timer ");
+  Serial.print(timer.id);
+  if (timer.name[0]) {
+    Serial.print(" (");
+    Serial.print(timer.name);
+    Serial.print(")");
+  }
+  Serial.print(" ");
+  Serial.println(what);
+}
+
+// Why a timer in this state cannot be paused or resumed, or NULL; the batch checks
+// use these too
+const char* pauseProblem(const Timer& timer) {
+  return timer.state != TIMER_RUNNING ? "timer is not running" : NULL;
+}
+
+const char* resumeProblem(const Timer& timer) {
+  if (timer.state == TIMER_RINGING) return "timer has gone off";
+  if (timer.state != TIMER_RUNNING && timer.kind == TIMER_ALARM && !clockValid()) return "clock not set";
+  return NULL;
+}
+
+// ----- Timer control -----
+// Return why the request cannot be carried out, or NULL once it is
+
+const char* startCountdown(uint8_t id, const char* name, uint32_t durationMs) {
+  Timer* timer = claimTimer(id, TIMER_COUNTDOWN, name);
+  if (!timer) return "no free timer";
+  
+  timer->length = durationMs;
+  runTimer(*timer, millis() + durationMs);
+  timersChanged();
+  Serial.print("Timer ");
+  Serial.print(id);
+  Serial.print(" started for ");
+  Serial.print(durationMs / 1000);
+  Serial.println(" seconds");
+  return NULL;
+}
+
+// Daily alarm at hour:minute local time
+const char* startAlarm(uint8_t id, const char* name, uint8_t hour, uint8_t minute) {
+  if (!clockValid()) return "clock not set";
+  Timer* timer = claimTimer(id, TIMER_ALARM, name);
+  if (!timer) return "no free timer";
+  
+  timer->length = hour * 60 + minute;
+  armAlarm(*timer);
+  timersChanged();
+  logTimer(*timer, "armed");
+  return NULL;
+}
+
+const char* startStopwatch(uint8_t id, const char* name) {
+  Timer* timer = claimTimer(id, TIMER_STOPWATCH, name);
+  if (!timer) return "no free timer";
+  
+  runTimer(*timer, millis());
+  timersChanged();
+  logTimer(*timer, "started");
+  return NULL;
+}
+
+const char* pauseTimer(uint8_t id) {
+  Timer* timer = findTimer(id);
+  if (!timer) return "no such timer";
+  const char* problem = pauseProblem(*timer);
+  if (problem) return problem;
+  
+  holdTimer(*timer, TIMER_PAUSED, timerValueMs(*timer, millis()));
+  timersChanged();
+  logTimer(*timer, "paused");
+  return NULL;
+}
+
+// Continue a paused or stopped timer; a stopped countdown starts over
+const char* resumeTimer(uint8_t id) {
+  Timer* timer = findTimer(id);
+  if (!timer) return "no such timer";
+  const char* problem = resumeProblem(*timer);
+  if (problem) return problem;
+  if (timer->state == TIMER_RUNNING) return NULL;
+  
+  if (timer->kind == TIMER_ALARM) {
+    armAlarm(*timer);
+  } else if (timer->kind == TIMER_STOPWATCH) {
+    runTimer(*timer, millis() - timer->held);
+  } else {
+    runTimer(*timer, millis() + timer->held);
+  }
+  timersChanged();
+  logTimer(*timer, "resumed");
+  return NULL;
+}
+
+// A countdown stops and rewinds, a stopwatch stops where it is. A ringing alarm is
+// silenced and stays armed for the next day; otherwise an alarm is switched off.
+const char* stopTimer(uint8_t id) {
+  Timer* timer = findTimer(id);
+  if (!timer) return "no such timer";
+  
+  if (timer->kind == TIMER_ALARM && timer->state == TIMER_RINGING) {
+    holdTimer(*timer, TIMER_STOPPED, 0);
+    armAlarm(*timer);
+  } else {
+    uint32_t held = 0;
+    if (timer->kind == TIMER_COUNTDOWN) held = timer->length;
+    if (timer->kind == TIMER_STOPWATCH) held = timerValueMs(*timer, millis());
+    holdTimer(*timer, TIMER_STOPPED, held);
+  }
+  timersChanged();
+  logTimer(*timer, "stopped");
+  return NULL;
+}
+
+// Back to the start: like stop, except that a stopwatch goes back to zero and keeps
+// running if it was
+const char* resetTimer(uint8_t id) {
+  Timer* timer = findTimer(id);
+  if (!timer) return "no such timer";
+  if (timer->kind != TIMER_STOPWATCH) return stopTimer(id);
+  
+  bool running = timer->state == TIMER_RUNNING;
+  holdTimer(*timer, TIMER_STOPPED, 0);
+  if (running) runTimer(*timer, millis());
+  timersChanged();
+  logTimer(*timer, "reset");
+  return NULL;
+}
+
+const char* deleteTimer(uint8_t id) {
+  Timer* timer = findTimer(id);
+  if (!timer) return "no such timer";
+  
+  logTimer(*timer, "deleted");
+  holdTimer(*timer, TIMER_STOPPED, 0);
+  memset(timer, 0, sizeof(*timer));
+  timersChanged();
+  return NULL;
+}
+
+// The timer the display shows: one that went off, else the running countdown that ends
+// first, else a running stopwatch. Alarms only take over the clock when they go off.
+const Timer* displayedTimer() {
+  const Timer* countdown = NULL;
+  const Timer* stopwatch = NULL;
+  for (const Timer& timer : timers) {
+    if (!timer.id) continue;
+    if (timer.state == TIMER_RINGING) return &timer;
+    if (timer.state != TIMER_RUNNING) continue;
+    
+    if (timer.kind == TIMER_COUNTDOWN && (!countdown || (int32_t)(timer.mark - countdown->mark) < 0)) {
+      countdown = &timer;
+    } else if (timer.kind == TIMER_STOPWATCH && !stopwatch) {
+      stopwatch = &timer;
+    }
+  }
+  return countdown ? countdown : stopwatch;
+}
+
+// ----- Timer persistence -----
+
+// A timer as saved to flash. millis() starts over after a reboot, so running timers
+// keep their deadline (countdown, alarm) or start (stopwatch) as UTC epoch ms.
+struct StoredTimer {
+  uint8_t id;
+  uint8_t kind;
+  uint8_t state;
+  char name[TIMER_NAME_LEN + 1];
+  uint32_t length;
+  uint32_t held;    // Time left or elapsed at the save
+  int64_t epochMs;  // Running or ringing: deadline or start; 0 if the clock was not set
+};
+
+// The timer table as it is saved, and mark it written (state lock held); returns the
+// number of timers
+size_t copyTimers(StoredTimer* stored) {
+  timersDirty = false;
+  memset(stored, 0, MAX_TIMERS * sizeof(StoredTimer));
+  size_t count = 0;
+  unsigned long now = millis();
+  int64_t nowEpochMs = clockValid() ? epochMs() : 0;
+  
+  for (const Timer& timer : timers) {
+    if (!timer.id) continue;
+    StoredTimer& entry = stored[count++];
+    entry.id = timer.id;
+    entry.kind = timer.kind;
+    entry.state = timer.state;
+    memcpy(entry.name, timer.name, sizeof(entry.name));
+    entry.length = timer.length;
+    entry.held = timerValueMs(timer, now);
+    if (nowEpochMs && (timer.state == TIMER_RUNNING || timer.state == TIMER_RINGING)) {
+      entry.epochMs = nowEpochMs + (int32_t)(timer.mark - now);
+    }
+  }
+  return count;
+}
+
+// Write a copied timer table to flash now
+void writeTimers(const StoredTimer* stored, size_t count) {
+  preferences.begin("timers", false);
+  bool written = count ? preferences.putBytes("table", stored, count * sizeof(StoredTimer)) > 0
+                       : preferences.remove("table");
+  preferences.end();
+  if (written) {
+    nvsWrites++;
+    nvsWritesTotal++;
+  }
+  Serial.print("Timers saved to flash (");
+  Serial.print(count);
+  Serial.println(" timers)");
+}
+
+// Write the timer table to flash now, at a software restart
+void flushTimers() {
+  if (!timersDirty || timersRestorePending) return;
+  StoredTimer stored[MAX_TIMERS];
+  size_t count = copyTimers(stored);
+  writeTimers(stored, count);
+}
+
+// Load the timer table; running timers come back paused until restoreTimers()
+void loadTimers() {
+  StoredTimer stored[MAX_TIMERS];
+  preferences.begin("timers", true);
+  size_t length = preferences.isKey("table") ? preferences.getBytes("table", stored, sizeof(stored)) : 0;
+  preferences.end();
+  
+  size_t count = length / sizeof(StoredTimer);
+  for (size_t i = 0; i < count; i++) {
+    const StoredTimer& entry = stored[i];
+    Timer& timer = timers[i];
+    timer.id = entry.id;
+    timer.kind = (TimerKind)entry.kind;
+    memcpy(timer.name, entry.name, sizeof(timer.name));
+    timer.name[TIMER_NAME_LEN] = 0;
+    timer.length = entry.length;
+    timer.held = entry.held;
+    
+    // Without a saved epoch time a running timer stays paused at the time left then
+    bool running = entry.state == TIMER_RUNNING || entry.state == TIMER_RINGING;
+    timer.state = running ? TIMER_PAUSED : (TimerState)entry.state;
+    timerRestoreEpochMs[i] = running ? entry.epochMs : 0;
+    timersRestorePending |= timerRestoreEpochMs[i] != 0;
+  }
+  
+  if (count > 0) {
+    Serial.print("Timers loaded from flash: ");
+    Serial.println(count);
+  }
+}
+
+// Put timers that were running at the last save back on millis(), now the clock is
+// set. Countdowns that ended while the watch was off go off straight away, and so do
+// alarms missed by less than TIMER_RING_MS.
+void restoreTimers() {
+  timersRestorePending = false;
+  int64_t nowEpochMs = epochMs();
+  unsigned long now = millis();
+  
+  for (uint8_t i = 0; i < MAX_TIMERS; i++) {
+    Timer& timer = timers[i];
+    int64_t epoch = timerRestoreEpochMs[i];
+    timerRestoreEpochMs[i] = 0;
+    if (!epoch || !timer.id) continue;
+    
+    int64_t left = epoch - nowEpochMs;
+    if (timer.kind == TIMER_STOPWATCH) {
+      runTimer(timer, now + (int32_t)max(left, -(int64_t)INT32_MAX));
+    } else if (timer.kind == TIMER_ALARM && left < -(int64_t)TIMER_RING_MS) {
+      armAlarm(timer);
+    } else {
+      runTimer(timer, now + (int32_t)(timer.kind == TIMER_ALARM ? left : max(left, (int64_t)0)));
+    }
+    logTimer(timer, "restored");
+  }
+  timersChanged();
+}
+
+// Called from loop(): set off timers whose deadline has passed, re-arm alarms nobody
+// stopped and save the table once changes settle. Takes the state lock for all but
+// the flash write
+void updateTimers() {
+  StoredTimer stored[MAX_TIMERS];
+  size_t count;
+  {
+    StateLock lock;
+    if (timersRestorePending && clockValid()) {
+      restoreTimers();
+    }
+    
+    unsigned long now = millis();
+    while (timerHeapSize > 0 && (int32_t)(timers[timerHeap[0]].mark - now) <= 0) {
+      Timer& timer = timers[timerHeap[0]];
+      holdTimer(timer, TIMER_RINGING, 0); // The deadline stays in mark and sets the flash phase
+      timersChanged();
+      logTimer(timer, timer.kind == TIMER_ALARM ? "alarm!" : "completed!");
+    }
+    
+    for (Timer& timer : timers) {
+      if (timer.id && timer.kind == TIMER_ALARM && timer.state == TIMER_RINGING && now - timer.mark >= TIMER_RING_MS) {
+        holdTimer(timer, TIMER_STOPPED, 0);
+        armAlarm(timer);
+        timersChanged();
+      }
+    }
+    
+    if (!timersDirty || timersRestorePending || now - timersChangedAt < SETTINGS_QUIET_MS) return;
+    count = copyTimers(stored);
+  }
+  writeTimers(stored, count);
+}
+
+// Display the timer from the snapshot as minutes and seconds, or as hours and minutes
+// from 100 minutes up; 00:00 flashes once it has gone off
+void displayTimer(const DisplaySnapshot& snap, CRGB color) {
+  unsigned long now = millis();
+  uint32_t seconds = 0;
+  
+  if (snap.timerRinging) {
+    // Flash at 1 Hz, starting lit at the deadline
+    if ((now - snap.timerMark) / TIMER_FLASH_MS % 2) {
+      fillLeds(0, FRAME_LEDS, CRGB::Black);
+      return;
+    }
+  } else if (snap.timerCountsUp) {
+    seconds = (now - snap.timerMark) / 1000;
+  } else {
+    int32_t left = snap.timerMark - now;
+    seconds = left > 0 ? (left + 999) / 1000 : 0;
+  }
+  
+  uint32_t high = seconds / 60;
+  uint32_t low = seconds % 60;
+  if (high >= 100) {
+    low = high % 60;
+    high /= 60;
+  }
+  high %= 100;
+  
+  displayDigit(high / 10, 0, color);
+  displayDigit(high % 10, 1, color);
+  displayDigit(low / 10, 2, color);
+  displayDigit(low % 10, 3, color);
+  
+  // Always show colon during timer mode
+  displayColon(color);
+}
+
+// Handle timer actions from web server. The timer is picked with id (default 1):
+//   action=start&minutes=5&seconds=0[&name=tea]   countdown of up to 5999:59
+//   action=alarm&hour=7&minute=30                 daily alarm
+//   action=stopwatch
+//   action=pause|resume|stop|reset|delete
+// Answers with the displayed timer, in the fields of the single timer before, and a
+// list of all timers
+void handleTimer(AsyncWebServerRequest* request) {
+  ALLOC_SCOPE(ALLOC_HTTP_TIMER);
+  StateLock lock;
+  const String& action = request->arg("action");
+  uint8_t id = request->hasArg("id") ? constrain(request->arg("id").toInt(), 1, 255) : TIMER_DEFAULT_ID;
+  const char* name = request->hasArg("name") ? request->arg("name").c_str() : NULL;
+  const char* error = NULL;
+  
+  if (action == "start") {
+    unsigned long minutes = constrain(request->arg("minutes").toInt(), 0, TIMER_MAX_MINUTES);
+    unsigned long seconds = constrain(request->arg("seconds").toInt(), 0, 59);
+    error = startCountdown(id, name, (minutes * 60 + seconds) * 1000);
+  } 
+  else if (action == "alarm") {
+    uint8_t hour = constrain(request->arg("hour").toInt(), 0, 23);
+    uint8_t minute = constrain(request->arg("minute").toInt(), 0, 59);
+    error = startAlarm(id, name, hour, minute);
+  } 
+  else if (action == "stopwatch") {
+    error = startStopwatch(id, name);
+  } 
+  else if (action == "pause") {
+    error = pauseTimer(id);
+  } 
+  else if (action == "resume") {
+    error = resumeTimer(id);
+  } 
+  else if (action == "stop") {
+    error = stopTimer(id);
+  } 
+  else if (action == "reset") {
+    error = resetTimer(id);
+  } 
+  else if (action == "delete") {
+    error = deleteTimer(id);
+  } 
+  else if (action.length() > 0) {
+    error = "unknown action";
+  }
+  if (action.length() > 0 && !error) {
+    wakeLoop();
+  }
+  
+  // Current timer status as JSON
+  unsigned long now = millis();
+  const Timer* shown = displayedTimer();
+  long remaining = shown ? timerSeconds(*shown, now) : 0;
+  AsyncResponseStream* response = request->beginResponseStream("application/json");
+  response->printf("{\"active\":%s,\"completed\":%s,\"minutes\":%ld,\"seconds\":%ld,\"id\":%u,",
+                   shown ? "true" : "false", shown && shown->state == TIMER_RINGING ? "true" : "false",
+                   remaining / 60, remaining % 60, shown ? shown->id : 0);
+  if (error) {
+    response->printf("\"error\":\"%s\",", error);
+  }
+  
+  response->print("\"timers\":[");
+  bool first = true;
+  for (const Timer& timer : timers) {
+    if (!timer.id) continue;
+    response->printf("%s{\"id\":%u,\"name\":\"", first ? "" : ",", timer.id);
+    for (const char* c = timer.name; *c; c++) {
+      if (*c == '"' || *c == '\\') response->print('\\');
+      response->print(*c);
+    }
+    response->printf("\",\"kind\":\"%s\",\"state\":\"%s\",\"ms\":%u}", timerKindNames[timer.kind],
+                     timerStateNames[timer.state], timerValueMs(timer, now));
+    first = false;
+  }
+  response->print("]}");
+  request->send(response);
+}
+
+// ===== MQTT Functions =====
+
+// Fixed buffer that backs the JSON documents of one MQTT command, so parsing and
+// answering a command never touches the heap. Blocks are bump-allocated and the
+// whole arena is released at once before the next command. Only the most recent
+// block can grow; ArduinoJson treats a refused allocation as out of memory, and
+// overflowed records that one was refused since reset().
+#define COMMAND_ARENA_SIZE   6144 // A full batch as parsed (test_full_batch_is_answered)
+#define RESPONSE_ARENA_SIZE  4096 // Its response, or getSchedule with every rule in use
+#define MAX_BATCH_OPS        16   // Operations accepted in one "batch" command
+#define RESPONSE_BUFFER_SIZE 1280 // Room for listTimers and getSchedule with every slot in use
+
+template <size_t SIZE>
+class ArenaAllocator : public ArduinoJson::Allocator {
+ public:
+  void* allocate(size_t size) override {
+    size = alignSize(size);
+    if (used + sizeof(size_t) + size > SIZE) {
+      overflowed = true;
+      return NULL;
+    }
+    
+    *(size_t*)(buffer + used) = size;
+    lastBlock = used + sizeof(size_t);
+    used = lastBlock + size;
+    if (used > peak) peak = used;
+    return buffer + lastBlock;
+  }
+  
+  void deallocate(void* ptr) override {
+    // Only the most recent block can be given back; the rest is freed by reset()
+    if (ptr == buffer + lastBlock) used = lastBlock - sizeof(size_t);
+  }
+  
+  void* reallocate(void* ptr, size_t newSize) override {
+    if (ptr == NULL) return allocate(newSize);
+    
+    size_t* header = (size_t*)ptr - 1;
+    newSize = alignSize(newSize);
+    if (ptr == buffer + lastBlock) {
+      // Grow or shrink the most recent block in place
+      if (lastBlock + newSize > SIZE) {
+        overflowed = true;
+        return NULL;
+      }
+      *header = newSize;
+      used = lastBlock + newSize;
+      if (used > peak) peak = used;
+      return ptr;
+    }
+    
+    // An older block stays where it is: shrinking it (shrinkToFit()) costs nothing, and
+    // growing it would need a copy that strands the old block until reset()
+    if (newSize <= *header) return ptr;
+    overflowed = true;
+    return NULL;
+  }
+  
+  void reset() { used = 0; lastBlock = 0; overflowed = false; }
+  
+  size_t peak = 0;         // High-water mark in bytes
+  bool overflowed = false; // An allocation was refused since reset()
+  
+ private:
+  static size_t alignSize(size_t size) { return (size + 7) & ~(size_t)7; }
+  
+  alignas(8) uint8_t buffer[SIZE];
+  size_t used = 0;
+  size_t lastBlock = 0;
+};
+
+ArenaAllocator<COMMAND_ARENA_SIZE> commandArena;
+ArenaAllocator<RESPONSE_ARENA_SIZE> responseArena;
+JsonDocument commandFilter;            // Fields kept when parsing a command
+unsigned long mqttCommandsHandled = 0; // Commands dispatched since boot
+
+// FNV-1a hash, usable at compile time for the command table
+constexpr uint32_t commandHash(const char* s, uint32_t hash = 2166136261u) {
+  return *s ? commandHash(s + 1, (hash ^ (uint8_t)*s) * 16777619u) : hash;
+}
+
+// Build the parse filter once; anything else in a message (e.g. "timestamp") is skipped.
+// The operations of a batch carry the same fields as a single command.
+void setupCommandFilter() {
+  const char* fields[] = {"command", "value", "red", "green", "blue", "enabled", "id", "name",
+                          "minutes", "seconds", "hour", "minute", "text", "speed", "repeat",
+                          "at", "days", "brightness", "mode", "color", "ramp", "groups"};
+  for (const char* field : fields) {
+    commandFilter[field] = true;
+    commandFilter["ops"][0][field] = true;
+  }
+  
+  // Schedule rules, as in addScheduleRule
+  const char* ruleFields[] = {"at", "days", "brightness", "mode", "color", "ramp"};
+  for (const char* field : ruleFields) {
+    commandFilter["rules"][0][field] = true;
+    commandFilter["ops"][0]["rules"][0][field] = true;
+  }
+}
+
+// Arguments a command requires; they are checked before anything is applied
+enum : uint16_t {
+  ARG_VALUE   = 1 << 0, // Number "value"
+  ARG_RGB     = 1 << 1, // Numbers "red", "green" and "blue"
+  ARG_ENABLED = 1 << 2, // Boolean "enabled"
+  ARG_TIME    = 1 << 3, // Numbers "minutes" and "seconds"
+  ARG_TEXT    = 1 << 4, // String "text"
+  ARG_ALARM   = 1 << 5, // Numbers "hour" and "minute"
+  ARG_RULES   = 1 << 6, // Array "rules"
+  ARG_GROUPS  = 1 << 7, // Array "groups"
+  ARG_RULE    = 1 << 8, // String "at"; the other rule fields are optional
+};
+
+// Returns why args cannot be applied, or NULL if they are fine
+const char* checkArguments(JsonObjectConst args, uint16_t required) {
+  if ((required & ARG_VALUE) && !args["value"].is<long>()) {
+    return "value must be a number";
+  }
+  if ((required & ARG_RGB) && !(args["red"].is<long>() && args["green"].is<long>() && args["blue"].is<long>())) {
+    return "red, green and blue must be numbers";
+  }
+  if ((required & ARG_ENABLED) && !args["enabled"].is<bool>()) {
+    return "enabled must be true or false";
+  }
+  if ((required & ARG_TIME) && !(args["minutes"].is<long>() && args["seconds"].is<long>())) {
+    return "minutes and seconds must be numbers";
+  }
+  if ((required & ARG_TEXT) && !args["text"].is<const char*>()) {
+    return "text must be a string";
+  }
+  if ((required & ARG_ALARM) && !(args["hour"].is<long>() && args["minute"].is<long>())) {
+    return "hour and minute must be numbers";
+  }
+  if ((required & ARG_RULES) && !args["rules"].is<JsonArrayConst>()) {
+    return "rules must be an array";
+  }
+  if ((required & ARG_GROUPS) && !args["groups"].is<JsonArrayConst>()) {
+    return "groups must be an array";
+  }
+  if ((required & ARG_RULE) && !args["at"].is<const char*>()) {
+    return "at must be a string";
+  }
+  return NULL;
+}
+
+// Numeric values are reported as strings, as they always have been
+void setResult(JsonObject result, const char* key, long value) {
+  char text[12];
+  snprintf(text, sizeof(text), "%ld", value);
+  result[key] = text;
+}
+
+// ----- Fleet groups -----
+// A watch takes commands from its own topic, from the broadcast topic and, once it is
+// in a group, from esp32watch/group/<name>/command for each of its groups. One wildcard
+// subscription covers every group topic, so the broker sends commands for other
+// groups too; they are dropped here by name.
+
+#define GROUP_TOPIC_PREFIX "esp32watch/group/"
+#define GROUP_TOPIC_SUFFIX "/command"
+
+bool groupsSubscribed = false;   // The group wildcard is subscribed on this connection
+
+// 1 to GROUP_NAME_LEN letters, digits, '-' or '_', so a name never spans topic levels
+bool validGroupName(const char* name, size_t length) {
+  if (length == 0 || length > GROUP_NAME_LEN) return false;
+  for (size_t i = 0; i < length; i++) {
+    if (!isalnum((unsigned char)name[i]) && name[i] != '-' && name[i] != '_') return false;
+  }
+  return true;
+}
+
+bool inGroup(const char* name, size_t length) {
+  for (uint8_t i = 0; i < groupCount; i++) {
+    if (strlen(groups[i]) == length && strncmp(groups[i], name, length) == 0) return true;
+  }
+  return false;
+}
+
+// Work out which fleet topic a command came in on: via is left empty for the
+// watch's own topic, or set to "all" or "group/<name>". Returns false for a
+// group this watch is not in
+bool commandSource(const char* topic, char* via, size_t size) {
+  via[0] = 0;
+  if (strcmp(topic, mqtt_topic_broadcast) == 0) {
+    strlcpy(via, "all", size);
+    return true;
+  }
+  size_t prefix = strlen(GROUP_TOPIC_PREFIX);
+  if (strncmp(topic, GROUP_TOPIC_PREFIX, prefix) != 0) return true;
+  
+  const char* name = topic + prefix;
+  const char* end = strchr(name, '/');
+  if (!end || strcmp(end, GROUP_TOPIC_SUFFIX) != 0 || !inGroup(name, end - name)) return false;
+  snprintf(via, size, "group/%.*s", (int)(end - name), name);
+  return true;
+}
+
+// Subscribe to group topics while the watch is in a group, and drop them when it leaves
+// its last one. Not called from the MQTT callback, which shares the client's buffer
+void updateGroupSubscription() {
+  bool wanted = groupCount > 0;
+  if (wanted == groupsSubscribed) return;
+  
+  bool done = wanted ? mqttClient.subscribe(mqtt_topic_groups) : mqttClient.unsubscribe(mqtt_topic_groups);
+  if (!done) return;
+  groupsSubscribed = wanted;
+  Serial.print(wanted ? "Subscribed to: " : "Unsubscribed from: ");
+  Serial.println(mqtt_topic_groups);
+}
+
+// ----- Command handlers -----
+// Arguments and everything else that could make a command fail have been checked
+// (see Command checks below), so handlers cannot fail: they change state and report
+// what they set in result. Settings are saved by the dispatcher, once per message.
+
+void cmdSetBrightness(JsonObjectConst args, JsonObject result) {
+  userBrightness = constrain(args["value"].as<int>(), 1, 255);
+  setResult(result, "brightness", userBrightness);
+}
+
+void cmdSetMode(JsonObjectConst args, JsonObject result) {
+  mode = constrain(args["value"].as<int>(), 0, EFFECT_COUNT - 1);
+  setResult(result, "mode", mode);
+}
+
+void cmdSetColor(JsonObjectConst args, JsonObject result) {
+  staticColor.red = constrain(args["red"].as<int>(), 0, 255);
+  staticColor.green = constrain(args["green"].as<int>(), 0, 255);
+  staticColor.blue = constrain(args["blue"].as<int>(), 0, 255);
+  
+  char color[12];
+  snprintf(color, sizeof(color), "%u,%u,%u", staticColor.red, staticColor.green, staticColor.blue);
+  result["color"] = color;
+}
+
+// Per-channel scale that evens out the LEDs' white point; 255 leaves a channel as is
+void cmdSetWhiteBalance(JsonObjectConst args, JsonObject result) {
+  whiteBalance.red = constrain(args["red"].as<int>(), 0, 255);
+  whiteBalance.green = constrain(args["green"].as<int>(), 0, 255);
+  whiteBalance.blue = constrain(args["blue"].as<int>(), 0, 255);
+  
+  char balance[12];
+  snprintf(balance, sizeof(balance), "%u,%u,%u", whiteBalance.red, whiteBalance.green, whiteBalance.blue);
+  result["whiteBalance"] = balance;
+}
+
+void cmdSetRainbowSpeed(JsonObjectConst args, JsonObject result) {
+  rainbowSpeed = constrain(args["value"].as<int>(), 1, 10);
+  setResult(result, "rainbowSpeed", rainbowSpeed);
+}
+
+void cmdSetAutoBrightness(JsonObjectConst args, JsonObject result) {
+  autoBrightnessEnabled = args["enabled"].as<bool>();
+  result["autoBrightness"] = autoBrightnessEnabled ? "true" : "false";
+}
+
+void cmdSetDayBrightness(JsonObjectConst args, JsonObject result) {
+  dayBrightness = constrain(args["value"].as<int>(), 0, 100);
+  setResult(result, "dayBrightness", dayBrightness);
+}
+
+void cmdSetNightBrightness(JsonObjectConst args, JsonObject result) {
+  nightBrightness = constrain(args["value"].as<int>(), 0, 100);
+  setResult(result, "nightBrightness", nightBrightness);
+}
+
+void cmdSetTransitionBrightness(JsonObjectConst args, JsonObject result) {
+  transitionBrightness = constrain(args["value"].as<int>(), 0, 100);
+  setResult(result, "transitionBrightness", transitionBrightness);
+}
+
+// Timer commands pick a timer with "id" (1-255, default 1) and may name it with "name"
+uint8_t timerId(JsonObjectConst args) {
+  return constrain(args["id"] | TIMER_DEFAULT_ID, 1, 255);
+}
+
+void setTimerResult(JsonObject result, uint8_t id, const char* error, const char* done) {
+  setResult(result, "id", id);
+  if (error) {
+    result["error"] = error;
+  } else {
+    result["timer"] = done;
+  }
+}
+
+void cmdStartTimer(JsonObjectConst args, JsonObject result) {
+  unsigned long minutes = constrain(args["minutes"].as<long>(), 0, TIMER_MAX_MINUTES);
+  unsigned long seconds = constrain(args["seconds"].as<long>(), 0, 59);
+  uint8_t id = timerId(args);
+  const char* error = startCountdown(id, args["name"].as<const char*>(), (minutes * 60 + seconds) * 1000);
+  setTimerResult(result, id, error, "started");
+}
+
+void cmdStartAlarm(JsonObjectConst args, JsonObject result) {
+  uint8_t hour = constrain(args["hour"].as<int>(), 0, 23);
+  uint8_t minute = constrain(args["minute"].as<int>(), 0, 59);
+  uint8_t id = timerId(args);
+  const char* error = startAlarm(id, args["name"].as<const char*>(), hour, minute);
+  setTimerResult(result, id, error, "armed");
+}
+
+void cmdStartStopwatch(JsonObjectConst args, JsonObject result) {
+  uint8_t id = timerId(args);
+  const char* error = startStopwatch(id, args["name"].as<const char*>());
+  setTimerResult(result, id, error, "started");
+}
+
+void cmdPauseTimer(JsonObjectConst args, JsonObject result) {
+  uint8_t id = timerId(args);
+  setTimerResult(result, id, pauseTimer(id), "paused");
+}
+
+void cmdResumeTimer(JsonObjectConst args, JsonObject result) {
+  uint8_t id = timerId(args);
+  setTimerResult(result, id, resumeTimer(id), "resumed");
+}
+
+void cmdStopTimer(JsonObjectConst args, JsonObject result) {
+  uint8_t id = timerId(args);
+  setTimerResult(result, id, stopTimer(id), "stopped");
+}
+
+void cmdResetTimer(JsonObjectConst args, JsonObject result) {
+  uint8_t id = timerId(args);
+  setTimerResult(result, id, resetTimer(id), "reset");
+}
+
+void cmdDeleteTimer(JsonObjectConst args, JsonObject result) {
+  uint8_t id = timerId(args);
+  setTimerResult(result, id, deleteTimer(id), "deleted");
+}
+
+// Every timer with its remaining (countdown, alarm) or elapsed (stopwatch) ms
+void cmdListTimers(JsonObjectConst, JsonObject result) {
+  unsigned long now = millis();
+  JsonArray list = result["timers"].to<JsonArray>();
+  for (const Timer& timer : timers) {
+    if (!timer.id) continue;
+    JsonObject entry = list.add<JsonObject>();
+    entry["id"] = timer.id;
+    entry["name"] = timer.name;
+    entry["kind"] = timerKindNames[timer.kind];
+    entry["state"] = timerStateNames[timer.state];
+    entry["ms"] = timerValueMs(timer, now);
+  }
+}
+
+// A schedule rule from JSON: "at" ("HH:MM") and optionally "days" (weekday mask, bit 0
+// Monday; default every day), "brightness" (percent or "day", "night", "transition"),
+// "mode", "color" ("#RRGGBB") and "ramp" (fade-in minutes). Returns why it is invalid, or NULL.
+const char* ruleFromJson(JsonObjectConst json, ScheduleRule& rule) {
+  if (!parseClockTime(json["at"].as<const char*>(), rule.minute)) return "at must be HH:MM";
+  rule.days = (json["days"] | ALL_DAYS) & ALL_DAYS;
+  
+  rule.brightness = SCHEDULE_KEEP;
+  JsonVariantConst level = json["brightness"];
+  if (level.is<long>()) {
+    rule.brightness = constrain(level.as<long>(), 0, 100);
+  } else if (!level.isNull() && !parseLevel(level.as<const char*>(), rule.brightness)) {
+    return "brightness must be 0-100, day, night or transition";
+  }
+  
+  rule.mode = json["mode"].is<long>() ? constrain(json["mode"].as<long>(), 0, EFFECT_COUNT - 1) : SCHEDULE_KEEP;
+  rule.setsColor = !json["color"].isNull();
+  if (rule.setsColor && !parseHexColor(json["color"].as<const char*>(), rule.color)) return "color must be #RRGGBB";
+  if (!rule.setsColor) rule.color = CRGB::Black;
+  rule.rampMinutes = constrain(json["ramp"] | 0, 0, MAX_RAMP_MINUTES);
+  return NULL;
+}
+
+void ruleToJson(const ScheduleRule& rule, JsonObject json) {
+  char text[8];
+  snprintf(text, sizeof(text), "%02u:%02u", rule.minute / 60, rule.minute % 60);
+  json["at"] = text;
+  json["days"] = rule.days;
+  if (rule.brightness != SCHEDULE_KEEP) {
+    if (levelName(rule.brightness)) {
+      json["brightness"] = levelName(rule.brightness);
+    } else {
+      json["brightness"] = rule.brightness;
+    }
+  }
+  if (rule.mode != SCHEDULE_KEEP) json["mode"] = rule.mode;
+  if (rule.setsColor) {
+    snprintf(text, sizeof(text), "#%02X%02X%02X", rule.color.red, rule.color.green, rule.color.blue);
+    json["color"] = text;
+  }
+  if (rule.rampMinutes) json["ramp"] = rule.rampMinutes;
+}
+
+// Replace all rules: {"command":"setSchedule","rules":[{"at":"07:00","brightness":60,"ramp":30}, ...]}
+void cmdSetSchedule(JsonObjectConst args, JsonObject result) {
+  scheduleRuleCount = 0;
+  for (JsonObjectConst json : args["rules"].as<JsonArrayConst>()) {
+    ScheduleRule rule;
+    ruleFromJson(json, rule);
+    addScheduleRule(rule);
+  }
+  scheduleChanged();
+  setResult(result, "scheduleRules", scheduleRuleCount);
+}
+
+void cmdAddScheduleRule(JsonObjectConst args, JsonObject result) {
+  ScheduleRule rule;
+  ruleFromJson(args, rule);
+  addScheduleRule(rule);
+  setResult(result, "scheduleRules", scheduleRuleCount);
+}
+
+// "value" is the rule's position in getSchedule
+void cmdDeleteScheduleRule(JsonObjectConst args, JsonObject result) {
+  deleteScheduleRule(args["value"].as<long>());
+  setResult(result, "scheduleRules", scheduleRuleCount);
+}
+
+void cmdResetSchedule(JsonObjectConst, JsonObject result) {
+  resetSchedule();
+  scheduleChanged();
+  setResult(result, "scheduleRules", scheduleRuleCount);
+}
+
+void cmdGetSchedule(JsonObjectConst, JsonObject result) {
+  JsonArray rules = result["rules"].to<JsonArray>();
+  for (uint8_t i = 0; i < scheduleRuleCount; i++) {
+    ruleToJson(scheduleRules[i], rules.add<JsonObject>());
+  }
+}
+
+void groupsToJson(JsonObject result) {
+  JsonArray list = result["groups"].to<JsonArray>();
+  for (uint8_t i = 0; i < groupCount; i++) {
+    list.add(groups[i]);
+  }
+}
+
+// Replace the watch's groups: {"command":"setGroups","groups":["kitchen","upstairs"]}
+// An empty list leaves every group.
+void cmdSetGroups(JsonObjectConst args, JsonObject result) {
+  char parsed[MAX_GROUPS][GROUP_NAME_LEN + 1] = {};
+  uint8_t count = 0;
+  for (JsonVariantConst name : args["groups"].as<JsonArrayConst>()) {
+    const char* text = name.as<const char*>();
+    bool duplicate = false;
+    for (uint8_t i = 0; i < count; i++) {
+      duplicate |= strcmp(parsed[i], text) == 0;
+    }
+    if (!duplicate) strlcpy(parsed[count++], text, sizeof(parsed[0]));
+  }
+  
+  if (count != groupCount || memcmp(parsed, groups, sizeof(groups)) != 0) {
+    memcpy(groups, parsed, sizeof(groups));
+    groupCount = count;
+    groupsDirty = true;
+  }
+  groupsToJson(result);
+}
+
+void cmdGetGroups(JsonObjectConst, JsonObject result) {
+  groupsToJson(result);
+}
+
+void cmdShowText(JsonObjectConst args, JsonObject result) {
+  const char* text = args["text"];
+  uint16_t stepMs = constrain(args["speed"] | MARQUEE_DEFAULT_STEP, 100, 2000);
+  uint8_t repeats = constrain(args["repeat"] | 1, 1, 20);
+  requestMarquee(text, stepMs, repeats);
+  result["text"] = text;
+}
+
+void cmdGetStatus(JsonObjectConst, JsonObject) {
+  requestFullStatus();
+}
+
+// ----- Command checks -----
+// What could make a command fail beyond its arguments is checked before anything is
+// applied, so a batch is applied whole or not at all. A check sees the state as the
+// earlier operations of the batch will leave it (CommandPlan), records its own effect
+// there and changes nothing else. Each returns why the command cannot be applied, or NULL.
+
+struct CommandPlan {
+  uint8_t scheduleRuleCount;
+  Timer timers[MAX_TIMERS];  // Only id, kind and state are kept up to date
+};
+
+void startPlan(CommandPlan& plan) {
+  plan.scheduleRuleCount = scheduleRuleCount;
+  memcpy(plan.timers, timers, sizeof(timers));
+}
+
+Timer* plannedTimer(CommandPlan& plan, uint8_t id) {
+  for (Timer& timer : plan.timers) {
+    if (timer.id == id) return &timer;
+  }
+  return NULL;
+}
+
+// As claimTimer(): the timer with this ID, or else a free slot, then running as kind
+const char* planTimerStart(CommandPlan& plan, JsonObjectConst args, TimerKind kind) {
+  uint8_t id = timerId(args);
+  Timer* timer = plannedTimer(plan, id);
+  if (!timer) timer = plannedTimer(plan, 0);
+  if (!timer) return "no free timer";
+  
+  timer->id = id;
+  timer->kind = kind;
+  timer->state = TIMER_RUNNING;
+  return NULL;
+}
+
+// As stopTimer(): a ringing alarm stays armed
+void planTimerStop(Timer& timer) {
+  bool rearmed = timer.kind == TIMER_ALARM && timer.state == TIMER_RINGING;
+  timer.state = rearmed ? TIMER_RUNNING : TIMER_STOPPED;
+}
+
+const char* checkStartTimer(JsonObjectConst args, CommandPlan& plan, JsonObject) {
+  return planTimerStart(plan, args, TIMER_COUNTDOWN);
+}
+
+const char* checkStartAlarm(JsonObjectConst args, CommandPlan& plan, JsonObject) {
+  if (!clockValid()) return "clock not set";
+  return planTimerStart(plan, args, TIMER_ALARM);
+}
+
+const char* checkStartStopwatch(JsonObjectConst args, CommandPlan& plan, JsonObject) {
+  return planTimerStart(plan, args, TIMER_STOPWATCH);
+}
+
+const char* checkPauseTimer(JsonObjectConst args, CommandPlan& plan, JsonObject) {
+  Timer* timer = plannedTimer(plan, timerId(args));
+  if (!timer) return "no such timer";
+  const char* problem = pauseProblem(*timer);
+  if (!problem) timer->state = TIMER_PAUSED;
+  return problem;
+}
+
+const char* checkResumeTimer(JsonObjectConst args, CommandPlan& plan, JsonObject) {
+  Timer* timer = plannedTimer(plan, timerId(args));
+  if (!timer) return "no such timer";
+  const char* problem = resumeProblem(*timer);
+  if (!problem) timer->state = TIMER_RUNNING;
+  return problem;
+}
+
+const char* checkStopTimer(JsonObjectConst args, CommandPlan& plan, JsonObject) {
+  Timer* timer = plannedTimer(plan, timerId(args));
+  if (!timer) return "no such timer";
+  planTimerStop(*timer);
+  return NULL;
+}
+
+// As resetTimer(): a running stopwatch keeps running
+const char* checkResetTimer(JsonObjectConst args, CommandPlan& plan, JsonObject) {
+  Timer* timer = plannedTimer(plan, timerId(args));
+  if (!timer) return "no such timer";
+  if (timer->kind != TIMER_STOPWATCH) {
+    planTimerStop(*timer);
+  } else if (timer->state != TIMER_RUNNING) {
+    timer->state = TIMER_STOPPED;
+  }
+  return NULL;
+}
+
+const char* checkDeleteTimer(JsonObjectConst args, CommandPlan& plan, JsonObject) {
+  Timer* timer = plannedTimer(plan, timerId(args));
+  if (!timer) return "no such timer";
+  timer->id = 0;
+  return NULL;
+}
+
+// Every rule must be valid; result gets the position of the first one that is not
+const char* checkSetSchedule(JsonObjectConst args, CommandPlan& plan, JsonObject result) {
+  JsonArrayConst rules = args["rules"];
+  if (rules.size() > MAX_SCHEDULE_RULES) return "too many rules";
+  
+  uint8_t count = 0;
+  for (JsonObjectConst json : rules) {
+    ScheduleRule rule;
+    const char* error = ruleFromJson(json, rule);
+    if (error) {
+      result["rule"] = count;
+      return error;
+    }
+    count++;
+  }
+  plan.scheduleRuleCount = count;
+  return NULL;
+}
+
+const char* checkAddScheduleRule(JsonObjectConst args, CommandPlan& plan, JsonObject) {
+  ScheduleRule rule;
+  const char* error = ruleFromJson(args, rule);
+  if (error) return error;
+  if (plan.scheduleRuleCount >= MAX_SCHEDULE_RULES) return "schedule is full";
+  plan.scheduleRuleCount++;
+  return NULL;
+}
+
+const char* checkDeleteScheduleRule(JsonObjectConst args, CommandPlan& plan, JsonObject) {
+  long index = args["value"].as<long>();
+  if (index < 0 || index >= plan.scheduleRuleCount) return "no such rule";
+  plan.scheduleRuleCount--;
+  return NULL;
+}
+
+const char* checkResetSchedule(JsonObjectConst, CommandPlan& plan, JsonObject) {
+  plan.scheduleRuleCount = sizeof(defaultSchedule) / sizeof(defaultSchedule[0]);
+  return NULL;
+}
+
+const char* checkSetGroups(JsonObjectConst args, CommandPlan&, JsonObject) {
+  JsonArrayConst names = args["groups"];
+  if (names.size() > MAX_GROUPS) return "too many groups";
+  for (JsonVariantConst name : names) {
+    const char* text = name.as<const char*>();
+    if (!text || !validGroupName(text, strlen(text))) return "group names are 1-15 letters, digits, - or _";
+  }
+  return NULL;
+}
+
+// Command names are hashed at compile time; dispatch compares hashes, then names
+typedef void (*CommandHandler)(JsonObjectConst args, JsonObject result);
+typedef const char* (*CommandCheck)(JsonObjectConst args, CommandPlan& plan, JsonObject result);
+struct Command {
+  uint32_t hash;
+  const char* name;
+  CommandHandler handler;
+  CommandCheck check; // NULL if only the arguments can be wrong
+  uint16_t required;  // ARG_* flags
+  bool persist;       // Changes settings that are saved to flash
+};
+
+#define COMMAND(name, handler, check, required, persist) {commandHash(name), name, handler, check, required, persist}
+const Command commands[] = {
+  COMMAND("setBrightness", cmdSetBrightness, NULL, ARG_VALUE, true),
+  COMMAND("setMode", cmdSetMode, NULL, ARG_VALUE, true),
+  COMMAND("setColor", cmdSetColor, NULL, ARG_RGB, true),
+  COMMAND("setWhiteBalance", cmdSetWhiteBalance, NULL, ARG_RGB, true),
+  COMMAND("setRainbowSpeed", cmdSetRainbowSpeed, NULL, ARG_VALUE, true),
+  COMMAND("setAutoBrightness", cmdSetAutoBrightness, NULL, ARG_ENABLED, true),
+  COMMAND("setDayBrightness", cmdSetDayBrightness, NULL, ARG_VALUE, true),
+  COMMAND("setNightBrightness", cmdSetNightBrightness, NULL, ARG_VALUE, true),
+  COMMAND("setTransitionBrightness", cmdSetTransitionBrightness, NULL, ARG_VALUE, true),
+  COMMAND("startTimer", cmdStartTimer, checkStartTimer, ARG_TIME, false),
+  COMMAND("startAlarm", cmdStartAlarm, checkStartAlarm, ARG_ALARM, false),
+  COMMAND("startStopwatch", cmdStartStopwatch, checkStartStopwatch, 0, false),
+  COMMAND("pauseTimer", cmdPauseTimer, checkPauseTimer, 0, false),
+  COMMAND("resumeTimer", cmdResumeTimer, checkResumeTimer, 0, false),
+  COMMAND("stopTimer", cmdStopTimer, checkStopTimer, 0, false),
+  COMMAND("resetTimer", cmdResetTimer, checkResetTimer, 0, false),
+  COMMAND("deleteTimer", cmdDeleteTimer, checkDeleteTimer, 0, false),
+  COMMAND("listTimers", cmdListTimers, NULL, 0, false),
+  COMMAND("setSchedule", cmdSetSchedule, checkSetSchedule, ARG_RULES, true),
+  COMMAND("addScheduleRule", cmdAddScheduleRule, checkAddScheduleRule, ARG_RULE, true),
+  COMMAND("deleteScheduleRule", cmdDeleteScheduleRule, checkDeleteScheduleRule, ARG_VALUE, true),
+  COMMAND("resetSchedule", cmdResetSchedule, checkResetSchedule, 0, true),
+  COMMAND("getSchedule", cmdGetSchedule, NULL, 0, false),
+  COMMAND("setGroups", cmdSetGroups, checkSetGroups, ARG_GROUPS, true),
+  COMMAND("getGroups", cmdGetGroups, NULL, 0, false),
+  COMMAND("showText", cmdShowText, NULL, ARG_TEXT, false),
+  COMMAND("getStatus", cmdGetStatus, NULL, 0, false),
+};
+#undef COMMAND
+
+const Command* findCommand(const char* name) {
+  uint32_t hash = commandHash(name);
+  for (const Command& command : commands) {
+    if (command.hash == hash && strcmp(command.name, name) == 0) {
+      return &command;
+    }
+  }
+  return NULL;
+}
+
+// Look up and check one operation against plan; returns NULL and sets error if it
+// cannot be applied
+const Command* checkOperation(JsonObjectConst op, CommandPlan& plan, JsonObject result, const char*& error) {
+  const Command* command = findCommand(op["command"] | "");
+  if (!command) {
+    error = "unknown command";
+    return NULL;
+  }
+  error = checkArguments(op, command->required);
+  if (!error && command->check) error = command->check(op, plan, result);
+  return error ? NULL : command;
+}
+
+// {"command":"batch","ops":[{"command":"setMode","value":1}, ...]}
+// All operations are checked first, each against the state the earlier ones leave,
+// and none is applied unless every one can be. They then run back to back within
+// this loop() pass, so the render task sees them in the same snapshot, and settings
+// are saved once. Returns whether the operations were applied.
+bool runBatch(JsonArrayConst ops, JsonObject response) {
+  struct {
+    const Command* command;
+    JsonObjectConst args;
+    JsonObject result;
+  } batch[MAX_BATCH_OPS];
+  size_t count = 0;
+  bool valid = ops.size() > 0 && ops.size() <= MAX_BATCH_OPS;
+  CommandPlan plan;
+  startPlan(plan);
+  
+  JsonArray results = response["results"].to<JsonArray>();
+  if (!valid) {
+    response["error"] = "a batch takes 1 to 16 operations";
+  } else {
+    for (JsonObjectConst op : ops) {
+      JsonObject result = results.add<JsonObject>();
+      result["command"] = op["command"];
+      
+      const char* error;
+      batch[count].command = checkOperation(op, plan, result, error);
+      batch[count].args = op;
+      batch[count].result = result;
+      if (!batch[count].command) {
+        result["error"] = error;
+        valid = false;
+      }
+      count++;
+    }
+  }
+  
+  // Results that did not fit would be left out of the answer, so nothing is applied
+  if (valid && responseArena.overflowed) {
+    response["error"] = "batch too large to answer";
+    valid = false;
+  }
+  if (!valid) {
+    response["applied"] = false;
+    Serial.println("Batch rejected, nothing applied");
+    return false;
+  }
+  
+  bool persist = false;
+  for (size_t i = 0; i < count; i++) {
+    batch[i].command->handler(batch[i].args, batch[i].result);
+    persist |= batch[i].command->persist;
+    mqttCommandsHandled++;
+  }
+  response["applied"] = true;
+  if (persist) {
+    saveSettings();
+  }
+  Serial.print("Batch applied: ");
+  Serial.print(count);
+  Serial.println(" operations");
+  return true;
+}
+
+// Run the command or batch of one message. Commands change state that web requests use,
+// so this holds the state lock; the response is published after it is released.
+// Returns whether the command ran.
+bool dispatchCommand(JsonObjectConst doc, JsonObject response) {
+  StateLock lock;
+  const char* name = doc["command"] | "";
+  if (strcmp(name, "batch") == 0) {
+    return runBatch(doc["ops"].as<JsonArrayConst>(), response);
+  }
+  
+  const char* reason;
+  CommandPlan plan;
+  startPlan(plan);
+  const Command* command = checkOperation(doc, plan, response, reason);
+  if (!command) {
+    Serial.print("Rejected command ");
+    Serial.print(name);
+    Serial.print(": ");
+    Serial.println(reason);
+    response["command"] = name;
+    response["error"] = reason;
+    return false;
+  }
+  command->handler(doc, response);
+  if (command->persist) {
+    saveSettings();
+  }
+  mqttCommandsHandled++;
+  return true;
+}
+
+// Fields every response starts with
+void startResponse(JsonDocument& response, const char* via) {
+  response["device"] = device_id;
+  response["timestamp"] = millis();
+  if (via[0]) response["via"] = via;
+}
+
+// MQTT callback function - handles incoming messages
+void mqttCallback(char* topic, byte* payload, unsigned int length) {
+  ALLOC_SCOPE(ALLOC_MQTT_COMMAND);
+  // The topic lives in the client's buffer, which publishing the response reuses
+  char via[sizeof("group/") + GROUP_NAME_LEN];
+  if (!commandSource(topic, via, sizeof(via))) return;
+  
+  Serial.print("MQTT message received on topic: ");
+  Serial.print(topic);
+  Serial.print(" - Message: ");
+  Serial.write(payload, length);
+  Serial.println();
+  
+  // Parse JSON message straight from the payload into the arena
+  commandArena.reset();
+  responseArena.reset();
+  JsonDocument doc(&commandArena);
+  JsonDocument response(&responseArena);
+  DeserializationError error = deserializeJson(doc, (const char*)payload, length,
+                                               DeserializationOption::Filter(commandFilter));
+  
+  if (error) {
+    Serial.print("JSON parsing failed: ");
+    Serial.println(error.c_str());
+    if (error == DeserializationError::NoMemory) {
+      startResponse(response, via);
+      response["error"] = "command too large";
+      sendMQTTResponse(response);
+    }
+    return;
+  }
+  
+  startResponse(response, via);
+  size_t header = response.size();
+  bool applied = dispatchCommand(doc.as<JsonObjectConst>(), response.as<JsonObject>());
+  
+  // A response that ran out of room would be missing fields; say so instead
+  if (responseArena.overflowed) {
+    Serial.println("MQTT response too large for its arena");
+    response.clear();
+    responseArena.reset();
+    startResponse(response, via);
+    response["command"] = doc["command"];
+    response["error"] = "response too large";
+    response["applied"] = applied;
+  }
+  
+  // Commands that report nothing (getStatus) get no response
+  if (response.size() > header) {
+    sendMQTTResponse(response);
+  }
+}
+
+// Topics of this watch, from device_id
+void setupTopics() {
+  String base = "esp32watch/" + String(device_id);
+  mqtt_topic_command = base + "/command";
+  mqtt_topic_status = base + "/status";
+  mqtt_topic_status_delta = base + "/status/delta";
+  mqtt_topic_response = base + "/response";
+  mqtt_topic_metrics = base + "/metrics";
+}
+
+// Make one attempt to connect to the MQTT broker and subscribe; returns true on success
+bool connectMQTT() {
+  Serial.print("Attempting MQTT connection...");
+  
+  if (!mqttClient.connect(device_id)) {
+    Serial.print("failed, rc=");
+    Serial.println(mqttClient.state());
+    return false;
+  }
+  
+  Serial.println("connected");
+  // Subscribe to command topic
+  mqttClient.subscribe(mqtt_topic_command.c_str());
+  Serial.print("Subscribed to: ");
+  Serial.println(mqtt_topic_command);
+  mqttClient.subscribe(mqtt_topic_broadcast);
+  Serial.print("Subscribed to: ");
+  Serial.println(mqtt_topic_broadcast);
+  groupsSubscribed = false;
+  updateGroupSubscription();
+  
+  // Refresh the retained snapshot; it may predate a reboot
+  requestFullStatus();
+  return true;
+}
+
+// Send response via MQTT, serialized into a stack buffer
+void sendMQTTResponse(const JsonDocument& response) {
+  ALLOC_SCOPE(ALLOC_MQTT_RESPONSE);
+  char output[RESPONSE_BUFFER_SIZE];
+  size_t length = serializeJson(response, output, sizeof(output));
+  if (length >= sizeof(output)) {
+    Serial.println("MQTT response too large, sending an error instead");
+    snprintf(output, sizeof(output), "{\"device\":\"%s\",\"timestamp\":%lu,\"error\":\"response too large\"}",
+             device_id, millis());
+  }
+  
+  mqttClient.publish(mqtt_topic_response.c_str(), output);
+  Serial.print("MQTT response sent: ");
+  Serial.println(output);
+}
+
+// ===== MQTT Status =====
+
+// The full status is published retained, so a new subscriber gets it straight away.
+// In between, only the fields that changed go to the delta topic, at most once per
+// STATUS_MIN_INTERVAL_MS. Counters and diagnostics ride along with the full snapshot,
+// which is refreshed once changes settle and as a heartbeat.
+#define STATUS_MIN_INTERVAL_MS 1000  // Minimum time between two status publishes
+#define STATUS_SETTLE_MS       5000  // Refresh the retained snapshot this long after the last delta
+#define STATUS_HEARTBEAT_MS    60000 // Full snapshot at least this often
+#define STATUS_ARENA_SIZE      4096
+#define STATUS_BUFFER_SIZE     1024  // Largest serialized status payload
+
+// What subscribers see; compared field by field to publish only what changed
+struct StatusState {
+  uint8_t brightness;
+  uint8_t mode;
+  CRGB color;
+  CRGB whiteBalance;
+  uint8_t rainbowSpeed;
+  bool autoBrightness;
+  uint8_t dayBrightness;
+  uint8_t nightBrightness;
+  uint8_t transitionBrightness;
+  bool timerActive;            // The displayed timer (see displayedTimer())
+  bool timerCompleted;
+  long timerRemaining;         // Seconds; elapsed for a stopwatch
+  uint8_t timerId;
+  uint8_t timerCount;          // Timers set, including stopped ones
+  bool wifiConnected;
+  uint32_t ip;
+  char time[17];               // "YYYY-MM-DD HH:MM"; minute resolution keeps deltas rare
+  uint8_t clockSource;
+  uint32_t clockAccuracyMs;    // Rounded (see roundAccuracy()), for the same reason
+  char groups[MAX_GROUPS][GROUP_NAME_LEN + 1];
+  uint8_t groupCount;
+};
+
+ArenaAllocator<STATUS_ARENA_SIZE> statusArena;
+StatusState publishedStatus;           // Last state sent, full or delta
+bool fullStatusRequested = false;
+bool retainedStatusStale = false;      // Deltas were sent since the last full snapshot
+unsigned long lastStatusPublish = 0;
+unsigned long lastFullStatus = 0;
+unsigned long statusDeltasSent = 0;
+unsigned long statusFullSent = 0;
+unsigned long statusBytesSent = 0;
+
+void captureStatus(StatusState& state) {
+  state.brightness = userBrightness;
+  state.mode = mode;
+  state.color = staticColor;
+  state.whiteBalance = whiteBalance;
+  state.rainbowSpeed = rainbowSpeed;
+  state.autoBrightness = autoBrightnessEnabled;
+  state.dayBrightness = dayBrightness;
+  state.nightBrightness = nightBrightness;
+  state.transitionBrightness = transitionBrightness;
+  const Timer* timer = displayedTimer();
+  state.timerActive = timer != NULL;
+  state.timerCompleted = timer && timer->state == TIMER_RINGING;
+  state.timerRemaining = timer ? timerSeconds(*timer, millis()) : 0;
+  state.timerId = timer ? timer->id : 0;
+  state.timerCount = timerCount();
+  state.wifiConnected = (WiFi.status() == WL_CONNECTED);
+  state.ip = (uint32_t)WiFi.localIP();
+  strlcpy(state.time, Poland.dateTime(wallClockMs() / 1000, UTC_TIME, "Y-m-d H:i").c_str(), sizeof(state.time));
+  state.clockSource = clockSource;
+  state.clockAccuracyMs = clockSource != CLOCK_NONE ? roundAccuracy(wallClockErrorMs()) : 0;
+  memcpy(state.groups, groups, sizeof(state.groups));
+  state.groupCount = groupCount;
+}
+
+// Fill doc with the fields of state that differ from previous (all fields when
+// previous is NULL); returns false if nothing changed
+bool buildStatus(JsonDocument& doc, const StatusState& state, const StatusState* previous) {
+#define CHANGED(field) (!previous || state.field != previous->field)
+  if (CHANGED(brightness)) doc["brightness"] = state.brightness;
+  if (CHANGED(mode)) doc["mode"] = state.mode;
+  if (CHANGED(color)) {
+    doc["color"]["red"] = state.color.red;
+    doc["color"]["green"] = state.color.green;
+    doc["color"]["blue"] = state.color.blue;
+  }
+  if (CHANGED(whiteBalance)) {
+    doc["whiteBalance"]["red"] = state.whiteBalance.red;
+    doc["whiteBalance"]["green"] = state.whiteBalance.green;
+    doc["whiteBalance"]["blue"] = state.whiteBalance.blue;
+  }
+  if (CHANGED(rainbowSpeed)) doc["rainbowSpeed"] = state.rainbowSpeed;
+  if (CHANGED(autoBrightness)) doc["autoBrightness"] = state.autoBrightness;
+  if (CHANGED(dayBrightness)) doc["dayBrightness"] = state.dayBrightness;
+  if (CHANGED(nightBrightness)) doc["nightBrightness"] = state.nightBrightness;
+  if (CHANGED(transitionBrightness)) doc["transitionBrightness"] = state.transitionBrightness;
+  if (CHANGED(timerActive) || CHANGED(timerCompleted) || CHANGED(timerRemaining) || CHANGED(timerId) ||
+      CHANGED(timerCount)) {
+    doc["timer"]["active"] = state.timerActive;
+    doc["timer"]["completed"] = state.timerCompleted;
+    if (state.timerActive) {
+      doc["timer"]["minutes"] = state.timerRemaining / 60;
+      doc["timer"]["seconds"] = state.timerRemaining % 60;
+      doc["timer"]["id"] = state.timerId;
+    }
+    doc["timer"]["count"] = state.timerCount;
+  }
+  if (CHANGED(wifiConnected) || CHANGED(ip)) {
+    doc["wifi"]["connected"] = state.wifiConnected;
+    doc["wifi"]["ip"] = IPAddress(state.ip).toString();
+  }
+  if (!previous || strcmp(state.time, previous->time) != 0) doc["time"] = state.time;
+  if (CHANGED(clockSource) || CHANGED(clockAccuracyMs)) {
+    doc["clock"]["source"] = clockSourceName(state.clockSource);
+    if (state.clockSource != CLOCK_NONE) doc["clock"]["accuracyMs"] = state.clockAccuracyMs;
+  }
+  if (CHANGED(groupCount) || (previous && memcmp(state.groups, previous->groups, sizeof(state.groups)) != 0)) {
+    JsonArray list = doc["groups"].to<JsonArray>();
+    for (uint8_t i = 0; i < state.groupCount; i++) list.add(state.groups[i]);
+  }
+#undef CHANGED
+  
+  return doc.size() > 0;
+}
+
+// Counters that only go out with the full snapshot
+void buildDiagnostics(JsonDocument& doc) {
+  doc["render"]["rendered"] = framesRendered;
+  doc["render"]["skipped"] = framesSkipped;
+  doc["render"]["bytes"] = bytesPushed;
+  doc["render"]["fps"] = RENDER_FPS;
+  doc["render"]["jitterMaxUs"] = frameJitterMaxUs;
+  doc["render"]["jitterAvgUs"] = frameJitterAvgUs;
+  
+  doc["power"]["loopDuty"] = loopDuty;
+  doc["power"]["renderDuty"] = renderDuty;
+  doc["power"]["currentMa"] = currentEstimateMa;
+  
+  if (clockDriftMeasured) doc["clock"]["driftPpm"] = clockDriftPpm;
+  
+  doc["settings"]["nvsWrites"] = nvsWrites;
+  doc["settings"]["nvsWritesTotal"] = nvsWritesTotal;
+  doc["settings"]["pending"] = settingsDirty;
+  
+  doc["mqtt"]["commands"] = mqttCommandsHandled;
+  doc["mqtt"]["arenaPeak"] = commandArena.peak;
+  doc["mqtt"]["responseArenaPeak"] = responseArena.peak;
+  doc["mqtt"]["statusFull"] = statusFullSent;
+  doc["mqtt"]["statusDeltas"] = statusDeltasSent;
+  doc["mqtt"]["statusBytes"] = statusBytesSent;
+  
+  doc["net"]["wifi"]["state"] = linkStateName(wifiLink.state);
+  doc["net"]["wifi"]["retries"] = wifiLink.retries;
+  doc["net"]["wifi"]["joinMs"] = wifiJoinMs;
+  doc["net"]["wifi"]["bootMs"] = wifiBootMs;
+  doc["net"]["wifi"]["fastJoins"] = wifiFastJoins;
+  doc["net"]["mqtt"]["state"] = linkStateName(mqttLink.state);
+  doc["net"]["mqtt"]["retries"] = mqttLink.retries;
+  doc["net"]["ntp"]["state"] = linkStateName(ntpLink.state);
+  doc["net"]["ntp"]["retries"] = ntpLink.retries;
+}
+
+// Serialize doc and publish it; returns false if the broker did not take it
+bool publishStatus(const char* topic, JsonDocument& doc, bool retained) {
+  uint8_t output[STATUS_BUFFER_SIZE];
+#if STATUS_MSGPACK
+  size_t length = serializeMsgPack(doc, output, sizeof(output));
+#else
+  size_t length = serializeJson(doc, (char*)output, sizeof(output));
+#endif
+  if (length == 0 || length >= sizeof(output)) {
+    Serial.println("Status too large for the output buffer");
+    return false;
+  }
+  
+  if (!mqttClient.publish(topic, output, length, retained)) return false;
+  statusBytesSent += length;
+  lastStatusPublish = millis();
+  return true;
+}
+
+// Publish the full status as soon as the rate limit allows
+void requestFullStatus() {
+  fullStatusRequested = true;
+}
+
+void sendFullStatus(const StatusState& state) {
+  statusArena.reset();
+  JsonDocument doc(&statusArena);
+  doc["device"] = device_id;
+  doc["timestamp"] = millis();
+  buildStatus(doc, state, NULL);
+  buildDiagnostics(doc);
+  
+  if (!publishStatus(mqtt_topic_status.c_str(), doc, true)) return;
+  publishedStatus = state;
+  fullStatusRequested = false;
+  retainedStatusStale = false;
+  lastFullStatus = lastStatusPublish;
+  statusFullSent++;
+  Serial.print("Status snapshot sent, ");
+  Serial.print(doc.size());
+  Serial.println(" fields");
+}
+
+void sendStatusDelta(const StatusState& state) {
+  statusArena.reset();
+  JsonDocument doc(&statusArena);
+  if (!buildStatus(doc, state, &publishedStatus)) return;
+  doc["device"] = device_id;
+  doc["timestamp"] = millis();
+  
+  if (!publishStatus(mqtt_topic_status_delta.c_str(), doc, false)) return;
+  publishedStatus = state;
+  retainedStatusStale = true;
+  statusDeltasSent++;
+}
+
+// Called from loop(): publish changes, refresh the retained snapshot and the heartbeat
+void updateStatus() {
+  ALLOC_SCOPE(ALLOC_MQTT_STATUS);
+  if (!mqttClient.connected()) return;
+  
+  unsigned long currentMillis = millis();
+  if (currentMillis - lastStatusPublish < STATUS_MIN_INTERVAL_MS) return;
+  
+  // Only the copy is made under the state lock; building and publishing happen outside
+  StatusState state;
+  {
+    StateLock lock;
+    captureStatus(state);
+  }
+  
+  if (fullStatusRequested || currentMillis - lastFullStatus >= STATUS_HEARTBEAT_MS ||
+      (retainedStatusStale && currentMillis - lastStatusPublish >= STATUS_SETTLE_MS)) {
+    sendFullStatus(state);
+  } else {
+    sendStatusDelta(state);
+  }
+}
+
+#if PROFILING
+// Per-stage window statistics, published like the status but not retained
+#ifndef METRICS_INTERVAL_MS
+#define METRICS_INTERVAL_MS PROFILE_WINDOW_MS // 0 disables the metrics topic
+#endif
+
+unsigned long lastMetricsPublish = 0;
+
+// Called from loop(): one message per window, "stage": [runs, minUs, meanUs, maxUs]
+void updateMetrics() {
+  ALLOC_SCOPE(ALLOC_MQTT_STATUS);
+  if (METRICS_INTERVAL_MS == 0 || !mqttClient.connected()) return;
+  
+  unsigned long currentMillis = millis();
+  if (currentMillis - lastMetricsPublish < METRICS_INTERVAL_MS ||
+      currentMillis - lastStatusPublish < STATUS_MIN_INTERVAL_MS) return;
+  
+  statusArena.reset();
+  JsonDocument doc(&statusArena);
+  doc["device"] = device_id;
+  doc["timestamp"] = currentMillis;
+  doc["windowMs"] = PROFILE_WINDOW_MS;
+  JsonObject stages = doc["stages"].to<JsonObject>();
+  for (uint8_t i = 0; i < STAGE_COUNT; i++) {
+    const ProfileWindow& w = profileWindow(stageProfiles[i]);
+    JsonArray stage = stages[stageNames[i]].to<JsonArray>();
+    stage.add(w.count);
+    stage.add(w.minCycles / cyclesPerUs);
+    stage.add(w.count ? (uint32_t)(w.totalCycles / w.count / cyclesPerUs) : 0);
+    stage.add(w.maxCycles / cyclesPerUs);
+  }
+  
+  if (publishStatus(mqtt_topic_metrics.c_str(), doc, false)) {
+    lastMetricsPublish = currentMillis;
+  }
+}
+#endif
+
+// ===== Connection Manager =====
+
+#define BACKOFF_BASE_MS      1000  // Delay after the first failed attempt
+#define BACKOFF_MAX_MS       60000 // Upper bound for the retry delay
+#define WIFI_JOIN_TIMEOUT_MS 15000 // Give up on a Wi‑Fi join attempt after this long
+#define NTP_SYNC_INTERVAL    1800  // Seconds between NTP updates once time is set
+
+#define WIFI_FAST_JOIN_TIMEOUT_MS 3000      // A join on the cached channel and BSSID takes well under this
+#define WIFI_LEASE_REUSE_MS       1800000UL // Take a DHCP lease this long after reusing an address
+
+unsigned long wifiJoinStart = 0; // millis() when the current Wi‑Fi join began
+bool ipShown = false;            // IP address is scrolled once after the first connection
+
+// Where the last connection went, so the next join can skip the channel scan and, right
+// after a warm reset, DHCP as well. Saved only when the access point or lease changes
+struct WifiCache {
+  uint32_t ssidHash;           // Network it belongs to (see ssid)
+  uint32_t ip;                 // Last DHCP lease
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+  uint8_t bssid[6];
+  uint8_t channel;
+};
+
+WifiCache wifiCache = {};
+bool wifiCacheValid = false;     // Loaded or learned, and not failed since
+bool wifiFastJoin = false;       // The current join uses the cache
+bool wifiStaticIp = false;       // Address is the cached lease, not one from DHCP
+unsigned long wifiConnectedAt = 0;
+
+const char* linkStateName(LinkState state) {
+  switch (state) {
+    case LINK_UP:         return "up";
+    case LINK_CONNECTING: return "connecting";
+    default:              return "down";
+  }
+}
+
+// Exponential backoff with jitter so many devices do not retry in lockstep
+void scheduleRetry(Link& link) {
+  if (link.failures < 255) link.failures++;
+  
+  unsigned long delayMs = BACKOFF_BASE_MS << min(link.failures - 1, 6);
+  if (delayMs > BACKOFF_MAX_MS) delayMs = BACKOFF_MAX_MS;
+  delayMs = delayMs / 2 + random(delayMs / 2 + 1);
+  
+  link.state = LINK_DOWN;
+  link.nextAttempt = millis() + delayMs;
+}
+
+void markUp(Link& link) {
+  link.state = LINK_UP;
+  link.failures = 0;
+}
+
+bool retryDue(const Link& link) {
+  return (long)(millis() - link.nextAttempt) >= 0;
+}
+
+void loadWifiCache() {
+  preferences.begin("wifi", true);
+  wifiCacheValid = preferences.isKey("cache") &&
+                   preferences.getBytes("cache", &wifiCache, sizeof(wifiCache)) == sizeof(wifiCache) &&
+                   wifiCache.ssidHash == hashBytes(ssid, strlen(ssid));
+  preferences.end();
 }
 
-// Display a character on a given LED array with specified color
-void displayChar(char c, CRGB ledsArray[], CRGB color) {
-  const bool* mapping;
-  
-  if (c >= '0' && c <= '9') {
-    // It's a digit
-    displayDigit(c - '0', ledsArray, color);
-    return;
-  } else if (c == '.') {
-    mapping = letter_period;
+// Remember the access point just joined and the lease DHCP gave us; flash is only
+// written when either changed
+void updateWifiCache() {
+  WifiCache fresh;
+  memset(&fresh, 0, sizeof(fresh)); // Padding too, for the comparison below
+  fresh.ssidHash = hashBytes(ssid, strlen(ssid));
+  if (wifiStaticIp) {
+    fresh.ip = wifiCache.ip;
+    fresh.gateway = wifiCache.gateway;
+    fresh.subnet = wifiCache.subnet;
+    fresh.dns = wifiCache.dns;
   } else {
-    mapping = letter_space;
+    fresh.ip = WiFi.localIP();
+    fresh.gateway = WiFi.gatewayIP();
+    fresh.subnet = WiFi.subnetMask();
+    fresh.dns = WiFi.dnsIP();
   }
+  const uint8_t* bssid = WiFi.BSSID();
+  if (bssid) memcpy(fresh.bssid, bssid, sizeof(fresh.bssid));
+  fresh.channel = WiFi.channel();
   
-  for (uint8_t i = 0; i < NUM_LEDS; i++) {
-    ledsArray[i] = pgm_read_byte(&mapping[i]) ? color : CRGB::Black;
+  wifiCacheValid = true;
+  if (memcmp(&fresh, &wifiCache, sizeof(fresh)) == 0) return;
+  wifiCache = fresh;
+  preferences.begin("wifi", false);
+  if (preferences.putBytes("cache", &wifiCache, sizeof(wifiCache)) > 0) {
+    nvsWrites++;
+    nvsWritesTotal++;
   }
+  preferences.end();
+  Serial.println("Wi‑Fi cache saved");
 }
 
-// Display a status (same digit on all displays); used for showing "0" or "2"
-void displayStatus(uint8_t status, CRGB color) {
-  displayDigit(status, leds1, color);
-  displayDigit(status, leds2, color);
-  displayDigit(status, leds3, color);
-  displayDigit(status, leds4, color);
+// Join on the cached channel and BSSID if there is a cache, otherwise scan for the network
+void startWifiJoin(unsigned long now) {
+  wifiFastJoin = wifiCacheValid;
+  // Right after a warm reset the router still holds our lease, so the address is reused
+  bool reuseLease = wifiFastJoin && wifiLink.retries == 0 && wifiCache.ip && warmReset();
+  if (reuseLease) {
+    WiFi.config(IPAddress(wifiCache.ip), IPAddress(wifiCache.gateway), IPAddress(wifiCache.subnet),
+                IPAddress(wifiCache.dns));
+  } else if (wifiStaticIp) {
+    WiFi.config(IPAddress(), IPAddress(), IPAddress()); // Back to DHCP
+  }
+  wifiStaticIp = reuseLease;
   
-  // Turn off colon
-  for (uint8_t i = 0; i < COLON_COUNT; i++) {
-    colon[i] = CRGB::Black;
+  if (wifiFastJoin) {
+    Serial.println("Connecting to Wi‑Fi (cached access point)...");
+    WiFi.begin(ssid, password, wifiCache.channel, wifiCache.bssid);
+  } else {
+    Serial.println("Connecting to Wi‑Fi...");
+    WiFi.begin(ssid, password);
   }
-  FastLED.show();
+  wifiLink.state = LINK_CONNECTING;
+  wifiLink.retries++;
+  wifiJoinStart = now;
 }
 
-// Display the time (hours and minutes)
-void displayTime(CRGB color) {
-  uint8_t hours = Poland.hour();
-  uint8_t minutes = Poland.minute();
-  
-  displayDigit(hours / 10, leds1, color);
-  displayDigit(hours % 10, leds2, color);
-  displayDigit(minutes / 10, leds3, color);
-  displayDigit(minutes % 10, leds4, color);
-  
-  // Check if it's time to update the colon state (every 500ms)
+// Drive Wi‑Fi join, NTP sync and MQTT connect; called from loop(), never blocks on retries
+void updateConnections() {
+  ALLOC_SCOPE(ALLOC_CONNECTIONS);
   unsigned long currentMillis = millis();
-  if (currentMillis - lastColonUpdate >= 500) {
-    lastColonUpdate = currentMillis;
-    colonState = !colonState; // Toggle colon state
+  
+  // Wi‑Fi
+  wl_status_t wifiStatus = WiFi.status();
+  if (wifiStatus != WL_CONNECTED) {
+    if (wifiLink.state == LINK_UP) {
+      Serial.println("Wi‑Fi connection lost");
+      wifiLink.state = LINK_DOWN;
+      wifiLink.nextAttempt = currentMillis;
+    }
+    if (mqttLink.state == LINK_UP) {
+      mqttLink.state = LINK_DOWN;
+    }
     
-    // Set colon based on state
-    for (uint8_t i = 0; i < COLON_COUNT; i++) {
-      colon[i] = colonState ? color : CRGB::Black;
+    bool fastJoinFailed = wifiStatus == WL_NO_SSID_AVAIL || wifiStatus == WL_CONNECT_FAILED ||
+                          currentMillis - wifiJoinStart >= WIFI_FAST_JOIN_TIMEOUT_MS;
+    if (wifiLink.state == LINK_CONNECTING && wifiFastJoin && fastJoinFailed) {
+      // The access point moved to another channel or was replaced; scan for it straight away
+      Serial.println("Cached Wi‑Fi access point not found");
+      WiFi.disconnect();
+      wifiCacheValid = false;
+      startWifiJoin(currentMillis);
+    } else if (wifiLink.state == LINK_CONNECTING && currentMillis - wifiJoinStart >= WIFI_JOIN_TIMEOUT_MS) {
+      Serial.println("Wi‑Fi join timed out");
+      WiFi.disconnect();
+      scheduleRetry(wifiLink);
+    } else if (wifiLink.state == LINK_DOWN && retryDue(wifiLink)) {
+      startWifiJoin(currentMillis);
     }
+    return; // NTP and MQTT need Wi‑Fi
   }
   
-  FastLED.show();
-}
-
-// Displays the IP address by scrolling it on the 4-digit display
-void showIPAddress(CRGB color) {
-  String ipString = WiFi.localIP().toString();
-  uint8_t len = ipString.length();
-  unsigned long startTime = millis();
-  
-  // Display IP for 10 seconds
-  while (millis() - startTime < 10000) {
-    for (uint8_t pos = 0; pos <= len - 4; pos++) {
-      // Get 4 characters of the IP address
-      displayChar((pos < len) ? ipString.charAt(pos) : ' ', leds1, color);
-      displayChar(((pos + 1) < len) ? ipString.charAt(pos + 1) : ' ', leds2, color);
-      displayChar(((pos + 2) < len) ? ipString.charAt(pos + 2) : ' ', leds3, color);
-      displayChar(((pos + 3) < len) ? ipString.charAt(pos + 3) : ' ', leds4, color);
-      
-      // Turn off colon during IP display
-      for (uint8_t i = 0; i < COLON_COUNT; i++) {
-        colon[i] = CRGB::Black;
-      }
-      
-      FastLED.show();
-      delay(500); // Slightly slower scroll for readability
+  if (wifiLink.state != LINK_UP) {
+    markUp(wifiLink);
+    wifiConnectedAt = currentMillis;
+    wifiJoinMs = currentMillis - wifiJoinStart;
+    if (wifiFastJoin) wifiFastJoins++;
+    Serial.print("Wi‑Fi Connected! IP: ");
+    Serial.print(WiFi.localIP().toString());
+    Serial.print(wifiStaticIp ? " (reused, " : " (");
+    Serial.print(wifiJoinMs);
+    Serial.println(wifiFastJoin ? " ms, cached access point)" : " ms, full scan)");
+    if (!wifiBootMs) {
+      wifiBootMs = currentMillis;
+      Serial.print("Start-up to Wi‑Fi: ");
+      Serial.print(wifiBootMs);
+      Serial.println(" ms");
     }
+    updateWifiCache();
     
-    // Pause at the end before restarting the scroll
-    delay(1000);
-  }
-}
-
-// Calculate brightness based on time of day
-uint8_t getTimeBrightness() {
-  if (!autoBrightnessEnabled) {
-    return userBrightness; // Return user setting if auto brightness is disabled
+    if (!ipShown) {
+      ipShown = true;
+      requestMarquee(WiFi.localIP().toString().c_str(), MARQUEE_DEFAULT_STEP, 2);
+    }
   }
   
-  uint8_t hour = Poland.hour();
-  uint8_t brightnessPercent;
-  
-  // Night time: 22:00-06:00
-  if (hour >= 22 || hour < 6) {
-    brightnessPercent = nightBrightness;
-  }
-  // Full day: 09:00-18:00
-  else if (hour >= 9 && hour < 18) {
-    brightnessPercent = dayBrightness;
+  // A reused address was never renewed with the router; get a lease of our own in good time
+  if (wifiStaticIp && currentMillis - wifiConnectedAt >= WIFI_LEASE_REUSE_MS) {
+    Serial.println("Reconnecting to Wi‑Fi for a DHCP lease");
+    WiFi.disconnect();
+    return;
   }
-  // Transition periods: 06:00-09:00 and 18:00-22:00
-  else {
-    brightnessPercent = transitionBrightness;
+  
+  // NTP: a single query is bounded by ezTime's NTP timeout
+  if (ntpLink.state != LINK_UP) {
+    if (timeStatus() == timeSet) {
+      markUp(ntpLink);
+      setInterval(NTP_SYNC_INTERVAL); // Hand periodic resyncs back to ezTime's events()
+      Serial.print("Poland time: ");
+      Serial.println(Poland.dateTime());
+    } else if (retryDue(ntpLink)) {
+      ntpLink.retries++;
+      updateNTP();
+      if (timeStatus() != timeSet) {
+        scheduleRetry(ntpLink);
+      }
+    }
   }
   
-  // Calculate the actual brightness value based on user setting as maximum
-  uint8_t maxBrightness = userBrightness;
-  return (maxBrightness * brightnessPercent) / 100;
+  // MQTT: a single attempt is bounded by the client's socket timeout
+  if (mqttClient.connected()) {
+    if (mqttLink.state != LINK_UP) markUp(mqttLink);
+    updateGroupSubscription();
+  } else {
+    if (mqttLink.state == LINK_UP) {
+      Serial.println("MQTT connection lost");
+      mqttLink.state = LINK_DOWN;
+      mqttLink.nextAttempt = currentMillis;
+    }
+    if (retryDue(mqttLink)) {
+      mqttLink.retries++;
+      if (connectMQTT()) {
+        markUp(mqttLink);
+      } else {
+        scheduleRetry(mqttLink);
+      }
+    }
+  }
 }
 
-// Save settings to non-volatile storage
-void saveSettings() {
-  preferences.begin("clockSettings", false); // "clockSettings" is the namespace
-  
-  preferences.putUChar("brightness", userBrightness);
-  preferences.putUChar("mode", mode);
-  preferences.putUChar("red", staticColor.red);
-  preferences.putUChar("green", staticColor.green);
-  preferences.putUChar("blue", staticColor.blue);
-  preferences.putUChar("rainbowSpeed", rainbowSpeed);
-  preferences.putBool("autoBrightness", autoBrightnessEnabled);
-  preferences.putUChar("dayBrightness", dayBrightness);
-  preferences.putUChar("nightBrightness", nightBrightness);
-  preferences.putUChar("transitionBrightness", transitionBrightness);
-  
-  preferences.end();
-  Serial.println("Settings saved to flash");
+// ===== Web Server Handlers =====
+
+#if WEB_ASSETS
+
+// Find an embedded web asset by request path
+const WebAsset* findAsset(const char* path) {
+  for (const WebAsset& asset : webAssets) {
+    if (strcmp(asset.path, path) == 0) {
+      return &asset;
+    }
+  }
+  return NULL;
 }
 
-// Load settings from non-volatile storage
-void loadSettings() {
-  preferences.begin("clockSettings", true); // true = read-only mode
+// Stream a gzipped asset straight from flash as the TCP window allows; pages are
+// revalidated with their ETag, content-hashed scripts are cached for a year
+void serveAsset(AsyncWebServerRequest* request, const char* path) {
+  ALLOC_SCOPE(ALLOC_HTTP_PAGE);
+  const WebAsset* asset = findAsset(path);
+  if (!asset) {
+    request->send(404, "text/plain", "Not found");
+    return;
+  }
   
-  if (preferences.isKey("brightness")) {
-    userBrightness = preferences.getUChar("brightness", 25);
-    mode = preferences.getUChar("mode", 0);
-    staticColor.red = preferences.getUChar("red", 255);
-    staticColor.green = preferences.getUChar("green", 0);
-    staticColor.blue = preferences.getUChar("blue", 0);
-    rainbowSpeed = preferences.getUChar("rainbowSpeed", 1);
-    autoBrightnessEnabled = preferences.getBool("autoBrightness", true);
-    dayBrightness = preferences.getUChar("dayBrightness", 100);
-    nightBrightness = preferences.getUChar("nightBrightness", 10);
-    transitionBrightness = preferences.getUChar("transitionBrightness", 50);
-    
-    Serial.println("Settings loaded from flash");
+  AsyncWebServerResponse* response;
+  if (request->hasHeader("If-None-Match") && request->getHeader("If-None-Match")->value() == asset->etag) {
+    response = request->beginResponse(304, asset->contentType, "");
   } else {
-    Serial.println("No saved settings found, using defaults");
+    response = request->beginResponse_P(200, asset->contentType, asset->data, asset->length);
+    response->addHeader("Content-Encoding", "gzip");
   }
-  
-  preferences.end();
+  response->addHeader("ETag", asset->etag);
+  response->addHeader("Cache-Control", asset->cacheControl);
+  request->send(response);
 }
 
-// ===== Timer Functions =====
+#else
 
-// Start the timer with specified duration
-void startTimer(unsigned long minutes, unsigned long seconds) {
-  timerDuration = (minutes * 60) + seconds;
-  timerStartTime = millis() / 1000; // Convert to seconds
-  timerActive = true;
-  timerCompleted = false;
-  Serial.print("Timer started for ");
-  Serial.print(minutes);
-  Serial.print(" minutes and ");
-  Serial.print(seconds);
-  Serial.println(" seconds");
+void serveAsset(AsyncWebServerRequest* request, const char*) {
+  request->send(404, "text/plain", "Not found");
 }
 
-// Stop the timer
-void stopTimer() {
-  timerActive = false;
-  timerCompleted = false;
-  Serial.println("Timer stopped");
+#endif
+
+// Any other embedded asset (remote control pages, vendored scripts)
+void handleAsset(AsyncWebServerRequest* request) {
+  serveAsset(request, request->url().c_str());
 }
 
-// Reset the timer
-void resetTimer() {
-  timerActive = false;
-  timerCompleted = false;
-  Serial.println("Timer reset");
+// Main page; its settings are pushed by the device over /events
+void handleRoot(AsyncWebServerRequest* request) {
+  serveAsset(request, "/");
 }
 
-// Get remaining time in seconds
-long getTimerRemaining() {
-  if (!timerActive) return 0;
+// Handler for settings update
+void handleSet(AsyncWebServerRequest* request) {
+  ALLOC_SCOPE(ALLOC_HTTP_SET);
+  StateLock lock;
+  
+  if (request->hasArg("brightness")) {
+    int percent = request->arg("brightness").toInt();
+    percent = constrain(percent, 0, 100);
+    userBrightness = (percent * 255) / 100;
+  }
   
-  unsigned long elapsedSeconds = (millis() / 1000) - timerStartTime;
-  long remaining = timerDuration - elapsedSeconds;
+  // Handle auto brightness setting
+  autoBrightnessEnabled = request->hasArg("autoBrightness");
   
-  if (remaining <= 0) {
-    remaining = 0;
-    if (!timerCompleted) {
-      timerCompleted = true;
-      Serial.println("Timer completed!");
-    }
+  // Process brightness settings for different times of day
+  if (request->hasArg("dayBrightness")) {
+    dayBrightness = constrain(request->arg("dayBrightness").toInt(), 0, 100);
   }
   
-  return remaining;
-}
-
-// Display the timer on the clock
-void displayTimer(CRGB color) {
-  long remaining = getTimerRemaining();
+  if (request->hasArg("nightBrightness")) {
+    nightBrightness = constrain(request->arg("nightBrightness").toInt(), 0, 100);
+  }
   
-  // If timer completed, flash the display
-  if (timerCompleted) {
-    unsigned long currentMillis = millis();
-    if (currentMillis - timerLastFlash >= 500) { // Flash at 2Hz (500ms)
-      timerLastFlash = currentMillis;
-      timerFlashState = !timerFlashState;
-    }
-    
-    if (!timerFlashState) {
-      // During off phase of flashing, clear display
-      for (uint8_t i = 0; i < NUM_LEDS; i++) {
-        leds1[i] = CRGB::Black;
-        leds2[i] = CRGB::Black;
-        leds3[i] = CRGB::Black;
-        leds4[i] = CRGB::Black;
-      }
-      for (uint8_t i = 0; i < COLON_COUNT; i++) {
-        colon[i] = CRGB::Black;
-      }
-      FastLED.show();
-      return;
-    }
-    
-    // During on phase, show zeros
-    remaining = 0;
+  if (request->hasArg("transitionBrightness")) {
+    transitionBrightness = constrain(request->arg("transitionBrightness").toInt(), 0, 100);
+  }
+  
+  if (request->hasArg("mode")) {
+    mode = constrain(request->arg("mode").toInt(), 0, EFFECT_COUNT - 1);
   }
   
-  // Convert seconds to minutes:seconds
-  uint8_t minutes = remaining / 60;
-  uint8_t seconds = remaining % 60;
+  if (request->hasArg("color")) {
+    String colorStr = request->arg("color");
+    if (colorStr.charAt(0) == '#') {
+      colorStr = colorStr.substring(1);
+    }
+    long colorVal = strtol(colorStr.c_str(), NULL, 16);
+    staticColor = CRGB((colorVal >> 16) & 0xFF, (colorVal >> 8) & 0xFF, colorVal & 0xFF);
+  }
   
-  // Display minutes and seconds
-  displayDigit(minutes / 10, leds1, color);
-  displayDigit(minutes % 10, leds2, color);
-  displayDigit(seconds / 10, leds3, color);
-  displayDigit(seconds % 10, leds4, color);
+  // White balance as #RRGGBB channel scales, like the color
+  if (request->hasArg("whiteBalance")) {
+    String balanceStr = request->arg("whiteBalance");
+    if (balanceStr.charAt(0) == '#') {
+      balanceStr = balanceStr.substring(1);
+    }
+    long balanceVal = strtol(balanceStr.c_str(), NULL, 16);
+    whiteBalance = CRGB((balanceVal >> 16) & 0xFF, (balanceVal >> 8) & 0xFF, balanceVal & 0xFF);
+  }
   
-  // Always show colon during timer mode
-  for (uint8_t i = 0; i < COLON_COUNT; i++) {
-    colon[i] = color;
+  // Handle rainbow speed
+  if (request->hasArg("rainbowSpeed")) {
+    rainbowSpeed = constrain(request->arg("rainbowSpeed").toInt(), 1, 10);
   }
   
-  FastLED.show();
+  // Save settings to flash once changes stop coming in
+  saveSettings();
+  wakeLoop();
+  
+  serveAsset(request, "/updated");
 }
 
-// Handle timer actions from web server
-void handleTimer() {
-  String action = server.arg("action");
+// Schedule rules: lists them as JSON, after an optional change:
+//   action=add&at=07:00[&days=31][&brightness=60|day|night|transition][&mode=1][&color=#FF8800][&ramp=30]
+//   action=delete&index=2, action=clear, action=reset (the default day/night windows)
+void handleSchedule(AsyncWebServerRequest* request) {
+  ALLOC_SCOPE(ALLOC_HTTP_SCHEDULE);
+  StateLock lock;
+  const String& action = request->arg("action");
+  const char* error = NULL;
   
-  if (action == "start") {
-    unsigned long minutes = server.arg("minutes").toInt();
-    unsigned long seconds = server.arg("seconds").toInt();
-    minutes = constrain(minutes, 0, 99); // Max 99 minutes
-    seconds = constrain(seconds, 0, 59); // Max 59 seconds
+  if (action == "add") {
+    ScheduleRule rule;
+    rule.days = request->hasArg("days") ? request->arg("days").toInt() & ALL_DAYS : ALL_DAYS;
+    rule.brightness = SCHEDULE_KEEP;
+    rule.mode = request->hasArg("mode") ? constrain(request->arg("mode").toInt(), 0, EFFECT_COUNT - 1) : SCHEDULE_KEEP;
+    rule.setsColor = request->hasArg("color");
+    rule.color = CRGB::Black;
+    rule.rampMinutes = constrain(request->arg("ramp").toInt(), 0, MAX_RAMP_MINUTES);
     
-    startTimer(minutes, seconds);
+    if (!parseClockTime(request->arg("at").c_str(), rule.minute)) {
+      error = "at must be HH:MM";
+    } else if (request->hasArg("brightness") && !parseLevel(request->arg("brightness").c_str(), rule.brightness)) {
+      error = "brightness must be 0-100, day, night or transition";
+    } else if (rule.setsColor && !parseHexColor(request->arg("color").c_str(), rule.color)) {
+      error = "color must be #RRGGBB";
+    } else {
+      error = addScheduleRule(rule);
+    }
   } 
-  else if (action == "stop") {
-    stopTimer();
+  else if (action == "delete") {
+    error = deleteScheduleRule(request->hasArg("index") ? request->arg("index").toInt() : -1);
+  } 
+  else if (action == "clear") {
+    scheduleRuleCount = 0;
+    scheduleChanged();
   } 
   else if (action == "reset") {
-    resetTimer();
+    resetSchedule();
+    scheduleChanged();
+  } 
+  else if (action.length() > 0) {
+    error = "unknown action";
+  }
+  if (action.length() > 0 && !error) {
+    saveSettings();
+    wakeLoop();
   }
   
-  // Send back current timer status as JSON
-  String response = "{";
-  response += "\"active\":" + String(timerActive ? "true" : "false") + ",";
-  response += "\"completed\":" + String(timerCompleted ? "true" : "false") + ",";
-  
-  long remaining = getTimerRemaining();
-  uint8_t minutes = remaining / 60;
-  uint8_t seconds = remaining % 60;
-  
-  response += "\"minutes\":" + String(minutes) + ",";
-  response += "\"seconds\":" + String(seconds);
-  response += "}";
-  
-  server.send(200, "application/json", response);
+  AsyncResponseStream* response = request->beginResponseStream("application/json");
+  response->print("{");
+  if (error) {
+    response->printf("\"error\":\"%s\",", error);
+  }
+  response->print("\"rules\":[");
+  for (uint8_t i = 0; i < scheduleRuleCount; i++) {
+    const ScheduleRule& rule = scheduleRules[i];
+    response->printf("%s{\"at\":\"%02u:%02u\",\"days\":%u", i ? "," : "", rule.minute / 60, rule.minute % 60, rule.days);
+    if (levelName(rule.brightness)) {
+      response->printf(",\"brightness\":\"%s\"", levelName(rule.brightness));
+    } else if (rule.brightness != SCHEDULE_KEEP) {
+      response->printf(",\"brightness\":%u", rule.brightness);
+    }
+    if (rule.mode != SCHEDULE_KEEP) response->printf(",\"mode\":%u", rule.mode);
+    if (rule.setsColor) response->printf(",\"color\":\"#%02X%02X%02X\"", rule.color.red, rule.color.green, rule.color.blue);
+    if (rule.rampMinutes) response->printf(",\"ramp\":%u", rule.rampMinutes);
+    response->print("}");
+  }
+  response->print("]}");
+  request->send(response);
 }
 
-// ===== MQTT Functions =====
+// ===== Live State =====
 
-// MQTT callback function - handles incoming messages
-void mqttCallback(char* topic, byte* payload, unsigned int length) {
-  String message = "";
-  for (int i = 0; i < length; i++) {
-    message += (char)payload[i];
+// What the web page shows; compared field by field to send only what changed
+struct LiveState {
+  uint8_t brightness;          // Percent, as shown on the page
+  bool autoBrightness;
+  uint8_t dayBrightness;
+  uint8_t nightBrightness;
+  uint8_t transitionBrightness;
+  uint8_t mode;
+  uint8_t rainbowSpeed;
+  uint32_t color;
+  bool timerActive;            // The displayed timer (see displayedTimer())
+  bool timerCompleted;
+  long timerRemaining;
+  uint8_t timerId;
+  uint8_t timerCount;
+};
+
+void captureLiveState(LiveState& state) {
+  state.brightness = userBrightness * 100 / 255;
+  state.autoBrightness = autoBrightnessEnabled;
+  state.dayBrightness = dayBrightness;
+  state.nightBrightness = nightBrightness;
+  state.transitionBrightness = transitionBrightness;
+  state.mode = mode;
+  state.rainbowSpeed = rainbowSpeed;
+  state.color = (uint32_t)staticColor.red << 16 | staticColor.green << 8 | staticColor.blue;
+  const Timer* timer = displayedTimer();
+  state.timerActive = timer != NULL;
+  state.timerCompleted = timer && timer->state == TIMER_RINGING;
+  state.timerRemaining = timer ? timerSeconds(*timer, millis()) : 0;
+  state.timerId = timer ? timer->id : 0;
+  state.timerCount = timerCount();
+}
+
+// Append formatted text to a buffer, keeping track of the length
+void appendJson(char* buf, size_t size, size_t& len, const char* format, ...) {
+  if (len >= size) return;
+  va_list args;
+  va_start(args, format);
+  int written = vsnprintf(buf + len, size - len, format, args);
+  va_end(args);
+  if (written > 0) len += written;
+}
+
+// Format the fields of state that differ from previous as a JSON object (all fields
+// when previous is NULL); returns 0 if nothing changed
+size_t formatLiveState(const LiveState& state, const LiveState* previous, char* buf, size_t size) {
+  size_t len = 0;
+  appendJson(buf, size, len, "{");
+  
+#define CHANGED(field) (!previous || state.field != previous->field)
+  if (CHANGED(brightness)) appendJson(buf, size, len, "\"brightness\":%u,", state.brightness);
+  if (CHANGED(autoBrightness)) appendJson(buf, size, len, "\"autoBrightness\":%s,", state.autoBrightness ? "true" : "false");
+  if (CHANGED(dayBrightness)) appendJson(buf, size, len, "\"dayBrightness\":%u,", state.dayBrightness);
+  if (CHANGED(nightBrightness)) appendJson(buf, size, len, "\"nightBrightness\":%u,", state.nightBrightness);
+  if (CHANGED(transitionBrightness)) appendJson(buf, size, len, "\"transitionBrightness\":%u,", state.transitionBrightness);
+  if (CHANGED(mode)) appendJson(buf, size, len, "\"mode\":%u,", state.mode);
+  if (CHANGED(rainbowSpeed)) appendJson(buf, size, len, "\"rainbowSpeed\":%u,", state.rainbowSpeed);
+  if (CHANGED(color)) appendJson(buf, size, len, "\"color\":\"#%06X\",", state.color);
+  if (CHANGED(timerActive) || CHANGED(timerCompleted) || CHANGED(timerRemaining) || CHANGED(timerId) ||
+      CHANGED(timerCount)) {
+    appendJson(buf, size, len, "\"timer\":{\"active\":%s,\"completed\":%s,\"minutes\":%ld,\"seconds\":%ld,"
+               "\"id\":%u,\"count\":%u},",
+               state.timerActive ? "true" : "false", state.timerCompleted ? "true" : "false",
+               state.timerRemaining / 60, state.timerRemaining % 60, state.timerId, state.timerCount);
   }
+#undef CHANGED
   
-  Serial.print("MQTT message received on topic: ");
-  Serial.print(topic);
-  Serial.print(" - Message: ");
-  Serial.println(message);
+  if (len <= 1 || len >= size) return 0;
+  buf[len - 1] = '}'; // Replace the trailing comma
+  return len;
+}
+
+// Current settings and timer as JSON
+void handleState(AsyncWebServerRequest* request) {
+  ALLOC_SCOPE(ALLOC_HTTP_STATE);
+  StateLock lock;
+  LiveState state;
+  captureLiveState(state);
   
-  // Parse JSON message
-  JsonDocument doc;
-  DeserializationError error = deserializeJson(doc, message);
+  char response[320];
+  formatLiveState(state, NULL, response, sizeof(response));
+  request->send(200, "application/json", response);
+}
+
+// Loop and render timing, used by tools/http_load.py; ?reset=1 clears the maxima
+void handleStats(AsyncWebServerRequest* request) {
+  ALLOC_SCOPE(ALLOC_HTTP_DIAG);
+  char response[320];
+  snprintf(response, sizeof(response),
+           "{\"loopMaxUs\":%lu,\"loopAvgUs\":%lu,\"frameJitterMaxUs\":%u,\"frameJitterAvgUs\":%u,"
+           "\"framesRendered\":%lu,\"framesSkipped\":%lu,\"freeHeap\":%u,"
+           "\"loopDuty\":%.4f,\"renderDuty\":%.4f,\"currentMa\":%u}",
+           loopMaxUs, loopAvgUs, frameJitterMaxUs, frameJitterAvgUs,
+           framesRendered, framesSkipped, ESP.getFreeHeap(),
+           loopDuty, renderDuty, currentEstimateMa);
   
-  if (error) {
-    Serial.print("JSON parsing failed: ");
-    Serial.println(error.c_str());
-    return;
+  if (request->hasArg("reset")) {
+    loopMaxUs = 0;
+    frameJitterMaxUs = 0;
   }
+  request->send(200, "application/json", response);
+}
+
+// Heap samples and, with ALLOC_TRACKING, allocations per code path as JSON
+void handleHeap(AsyncWebServerRequest* request) {
+  ALLOC_SCOPE(ALLOC_HTTP_DIAG);
+  AsyncResponseStream* response = request->beginResponseStream("application/json");
   
-  // Handle different commands
-  String command = doc["command"].as<String>();
+  uint32_t freeHeap = ESP.getFreeHeap();
+  uint32_t largestBlock = ESP.getMaxAllocHeap();
+  response->printf("{\"freeHeap\":%u,\"largestBlock\":%u,\"minFreeHeap\":%u,\"fragmentation\":%u,",
+                   freeHeap, largestBlock, ESP.getMinFreeHeap(), heapFragmentation(freeHeap, largestBlock));
   
-  if (command == "setBrightness") {
-    userBrightness = constrain(doc["value"].as<int>(), 1, 255);
-    saveSettings();
-    sendMQTTResponse("brightness", String(userBrightness));
-  }
-  else if (command == "setMode") {
-    mode = constrain(doc["value"].as<int>(), 0, 1);
-    saveSettings();
-    sendMQTTResponse("mode", String(mode));
-  }
-  else if (command == "setColor") {
-    staticColor.red = constrain(doc["red"].as<int>(), 0, 255);
-    staticColor.green = constrain(doc["green"].as<int>(), 0, 255);
-    staticColor.blue = constrain(doc["blue"].as<int>(), 0, 255);
-    saveSettings();
-    sendMQTTResponse("color", String(staticColor.red) + "," + String(staticColor.green) + "," + String(staticColor.blue));
-  }
-  else if (command == "setRainbowSpeed") {
-    rainbowSpeed = constrain(doc["value"].as<int>(), 1, 10);
-    saveSettings();
-    sendMQTTResponse("rainbowSpeed", String(rainbowSpeed));
-  }
-  else if (command == "setAutoBrightness") {
-    autoBrightnessEnabled = doc["enabled"].as<bool>();
-    saveSettings();
-    sendMQTTResponse("autoBrightness", String(autoBrightnessEnabled ? "true" : "false"));
-  }
-  else if (command == "setDayBrightness") {
-    dayBrightness = constrain(doc["value"].as<int>(), 0, 100);
-    saveSettings();
-    sendMQTTResponse("dayBrightness", String(dayBrightness));
-  }
-  else if (command == "setNightBrightness") {
-    nightBrightness = constrain(doc["value"].as<int>(), 0, 100);
-    saveSettings();
-    sendMQTTResponse("nightBrightness", String(nightBrightness));
-  }
-  else if (command == "setTransitionBrightness") {
-    transitionBrightness = constrain(doc["value"].as<int>(), 0, 100);
-    saveSettings();
-    sendMQTTResponse("transitionBrightness", String(transitionBrightness));
-  }
-  else if (command == "startTimer") {
-    unsigned long minutes = constrain(doc["minutes"].as<int>(), 0, 99);
-    unsigned long seconds = constrain(doc["seconds"].as<int>(), 0, 59);
-    startTimer(minutes, seconds);
-    sendMQTTResponse("timer", "started");
-  }
-  else if (command == "stopTimer") {
-    stopTimer();
-    sendMQTTResponse("timer", "stopped");
-  }
-  else if (command == "resetTimer") {
-    resetTimer();
-    sendMQTTResponse("timer", "reset");
+  // Oldest first: [uptime s, free, largest block, min free, fragmentation %]
+  response->print("\"history\":[");
+  for (uint8_t i = 0; i < heapHistoryCount; i++) {
+    const HeapSample& sample = heapHistory[(heapHistoryNext + HEAP_HISTORY - heapHistoryCount + i) % HEAP_HISTORY];
+    response->printf("%s[%u,%u,%u,%u,%u]", i ? "," : "", sample.uptime, sample.freeHeap,
+                     sample.largestBlock, sample.minFreeHeap, heapFragmentation(sample.freeHeap, sample.largestBlock));
   }
-  else if (command == "getStatus") {
-    sendStatusUpdate();
+  response->print("]");
+  
+#if ALLOC_TRACKING
+  response->print(",\"sites\":{");
+  for (uint8_t i = 0; i < ALLOC_SITE_COUNT; i++) {
+    const AllocSiteStats& stats = allocSiteStats[i];
+    response->printf("%s\"%s\":{\"calls\":%u,\"allocs\":%u,\"frees\":%u,\"bytes\":%u,\"peak\":%u,\"retained\":%d,\"maxAllocs\":%u}",
+                     i ? "," : "", allocSiteNames[i], stats.calls, stats.allocs, stats.frees, stats.bytes,
+                     stats.peak, stats.retained, stats.maxAllocs);
   }
+  response->print("}");
+#endif
+  
+  response->print("}");
+  request->send(response);
 }
 
-// Connect to MQTT broker
-void connectMQTT() {
-  while (!mqttClient.connected()) {
-    Serial.print("Attempting MQTT connection...");
-    
-    if (mqttClient.connect(device_id)) {
-      Serial.println("connected");
-      // Subscribe to command topic
-      mqttClient.subscribe(mqtt_topic_command.c_str());
-      Serial.print("Subscribed to: ");
-      Serial.println(mqtt_topic_command);
-      
-      // Send initial status
-      sendStatusUpdate();
-    } else {
-      Serial.print("failed, rc=");
-      Serial.print(mqttClient.state());
-      Serial.println(" try again in 5 seconds");
-      delay(5000);
+#if PROFILING
+// Profiler in the Prometheus text format: a histogram per stage since boot, and
+// min/mean/max over the last window
+void handleMetrics(AsyncWebServerRequest* request) {
+  ALLOC_SCOPE(ALLOC_HTTP_DIAG);
+  AsyncResponseStream* response = request->beginResponseStream("text/plain; version=0.0.4");
+  
+  response->print("# HELP watch_stage_seconds Time per run of a loop() or render stage\n"
+                  "# TYPE watch_stage_seconds histogram\n");
+  for (uint8_t i = 0; i < STAGE_COUNT; i++) {
+    const StageProfile& p = stageProfiles[i];
+    uint32_t cumulative = 0;
+    for (uint8_t b = 0; b < PROFILE_BUCKETS - 1; b++) {
+      cumulative += p.buckets[b];
+      response->printf("watch_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %u\n",
+                       stageNames[i], profileBucketUs[b] / 1e6, cumulative);
     }
+    response->printf("watch_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %u\n", stageNames[i], p.count);
+    response->printf("watch_stage_seconds_sum{stage=\"%s\"} %.6f\n", stageNames[i], (double)p.totalCycles / cyclesPerUs / 1e6);
+    response->printf("watch_stage_seconds_count{stage=\"%s\"} %u\n", stageNames[i], p.count);
+  }
+  
+  response->printf("# HELP watch_stage_window_seconds Min, mean and max time per run over the last %u s\n"
+                   "# TYPE watch_stage_window_seconds gauge\n", (unsigned)(PROFILE_WINDOW_MS / 1000));
+  for (uint8_t i = 0; i < STAGE_COUNT; i++) {
+    const ProfileWindow& w = profileWindow(stageProfiles[i]);
+    double mean = w.count ? (double)w.totalCycles / w.count : 0;
+    response->printf("watch_stage_window_seconds{stage=\"%s\",stat=\"min\"} %.6f\n", stageNames[i], w.minCycles / 1e6 / cyclesPerUs);
+    response->printf("watch_stage_window_seconds{stage=\"%s\",stat=\"mean\"} %.6f\n", stageNames[i], mean / 1e6 / cyclesPerUs);
+    response->printf("watch_stage_window_seconds{stage=\"%s\",stat=\"max\"} %.6f\n", stageNames[i], w.maxCycles / 1e6 / cyclesPerUs);
   }
+  
+  response->print("# TYPE watch_frames_rendered_total counter\n");
+  response->printf("watch_frames_rendered_total %lu\n", framesRendered);
+  response->print("# TYPE watch_frames_skipped_total counter\n");
+  response->printf("watch_frames_skipped_total %lu\n", framesSkipped);
+  response->print("# TYPE watch_free_heap_bytes gauge\n");
+  response->printf("watch_free_heap_bytes %u\n", ESP.getFreeHeap());
+  response->printf("# HELP watch_cpu_duty_ratio Share of the last %u s a task was busy\n"
+                   "# TYPE watch_cpu_duty_ratio gauge\n", (unsigned)(POWER_WINDOW_MS / 1000));
+  response->printf("watch_cpu_duty_ratio{task=\"loop\"} %.6f\n", loopDuty);
+  response->printf("watch_cpu_duty_ratio{task=\"render\"} %.6f\n", renderDuty);
+  response->print("# HELP watch_supply_current_amperes Estimated average supply current\n"
+                  "# TYPE watch_supply_current_amperes gauge\n");
+  response->printf("watch_supply_current_amperes %.3f\n", currentEstimateMa / 1000.0);
+  
+  request->send(response);
 }
+#endif
 
-// Send response via MQTT
-void sendMQTTResponse(String key, String value) {
-  JsonDocument doc;
-  doc["device"] = device_id;
-  doc["timestamp"] = millis();
-  doc[key] = value;
-  
-  String output;
-  serializeJson(doc, output);
+// Server-Sent Events on /events: each subscriber gets the full state once, then only
+// the fields that changed, serialized once and fanned out by the event source.
+LiveState lastLiveState;
+bool lastLiveStateValid = false;
+
+void onEventsConnect(AsyncEventSourceClient* client) {
+  ALLOC_SCOPE(ALLOC_HTTP_STATE);
+  StateLock lock;
+  LiveState state;
+  captureLiveState(state);
   
-  mqttClient.publish(mqtt_topic_response.c_str(), output.c_str());
-  Serial.print("MQTT response sent: ");
-  Serial.println(output);
+  char json[320];
+  formatLiveState(state, NULL, json, sizeof(json));
+  client->send(json, NULL, millis(), 3000);
 }
 
-// Send complete status update via MQTT
-void sendStatusUpdate() {
-  JsonDocument doc;
-  doc["device"] = device_id;
-  doc["timestamp"] = millis();
-  doc["brightness"] = userBrightness;
-  doc["mode"] = mode;
-  doc["color"]["red"] = staticColor.red;
-  doc["color"]["green"] = staticColor.green;
-  doc["color"]["blue"] = staticColor.blue;
-  doc["rainbowSpeed"] = rainbowSpeed;
-  doc["autoBrightness"] = autoBrightnessEnabled;
-  doc["dayBrightness"] = dayBrightness;
-  doc["nightBrightness"] = nightBrightness;
-  doc["transitionBrightness"] = transitionBrightness;
-  doc["timer"]["active"] = timerActive;
-  doc["timer"]["completed"] = timerCompleted;
-  
-  if (timerActive) {
-    long remaining = getTimerRemaining();
-    doc["timer"]["minutes"] = remaining / 60;
-    doc["timer"]["seconds"] = remaining % 60;
-  }
-  
-  doc["wifi"]["connected"] = (WiFi.status() == WL_CONNECTED);
-  doc["wifi"]["ip"] = WiFi.localIP().toString();
-  doc["time"] = Poland.dateTime();
-  
-  String output;
-  serializeJson(doc, output);
-  
-  mqttClient.publish(mqtt_topic_status.c_str(), output.c_str());
-  Serial.print("Status update sent: ");
-  Serial.println(output);
+// Push changed state to all subscribers; called from loop()
+void updateLiveEvents() {
+  ALLOC_SCOPE(ALLOC_LIVE_EVENTS);
+  if (liveEvents.count() == 0) {
+    lastLiveStateValid = false;
+    return;
+  }
+  
+  LiveState state;
+  {
+    StateLock lock;
+    captureLiveState(state);
+  }
+  char json[320];
+  size_t len = formatLiveState(state, lastLiveStateValid ? &lastLiveState : NULL, json, sizeof(json));
+  lastLiveState = state;
+  lastLiveStateValid = true;
+  
+  if (len > 0) {
+    liveEvents.send(json, NULL, millis());
+  }
 }
 
-// ===== Web Server Handlers =====
+// ===== Idle Scheduling =====
 
-// Main page with Tailwind CSS for styling
-void handleRoot() {
-  String html = "<!DOCTYPE html><html lang='en'><head>";
-  html += "<meta charset='UTF-8'>";
-  html += "<meta name='viewport' content='width=device-width, initial-scale=1.0'>";
-  html += "<title>Clock Settings</title>";
-  html += "<script src='https://cdn.tailwindcss.com'></script>";
-  html += "<script src='https://cdn.jsdelivr.net/npm/@jaames/iro@5'></script>"; // Add color picker library
-  html += "</head><body class='bg-gray-100 flex items-center justify-center min-h-screen'>";
-  html += "<div class='bg-white shadow-lg rounded-lg p-8 max-w-md w-full'>";
-
-  html += "<form action='/set' method='GET' class='space-y-4'>";
-
-  html += "<div class='mt-8 border-t border-b py-3'>";
-    // Timer status
-  html += "<div class='mt-4 text-center' id='timer-status'>";
-  html += timerActive ? (timerCompleted ? "Timer completed!" : "Timer running...") : "Timer ready";
-  html += "</div>";
-    // Display current timer value
-  html += "<div class='text-2xl font-mono font-bold text-center mt-2' id='timer-display'>";
-  if (timerActive) {
-    long remaining = getTimerRemaining();
-    uint8_t minutes = remaining / 60;
-    uint8_t seconds = remaining % 60;
-    char buf[6];
-    sprintf(buf, "%02d:%02d", minutes, seconds);
-    html += buf;
-  } else {
-    html += "00:00";
-  }
-  html += "</div>";
-  // Timer inputs
-  html += "<div class='flex space-x-2 mb-4'>";
-  html += "<div class='flex-grow'>";
-  html += "<label class='block text-gray-700 text-sm'>Minutes:</label>";
-  html += "<input type='number' id='timer-minutes' min='0' max='99' value='0' class='mt-1 block w-full px-3 py-2 border rounded-md text-sm'>";
-  html += "</div>";
-  html += "<div class='flex-grow'>";
-  html += "<label class='block text-gray-700 text-sm'>Seconds:</label>";
-  html += "<input type='number' id='timer-seconds' min='0' max='59' value='0' class='mt-1 block w-full px-3 py-2 border rounded-md text-sm'>";
-  html += "</div>";
-  html += "</div>";
-  
-  // Quick preset buttons
-  html += "<div class='mb-4'>";
-  html += "<label class='block text-gray-700 text-sm mb-1'>Quick presets:</label>";
-  html += "<div class='grid grid-cols-3 gap-2'>";
-  html += "<button type='button' class='timer-preset bg-gray-200 hover:bg-gray-300 text-gray-800 py-1 px-2 rounded text-sm' data-minutes='5'>5 min</button>";
-  html += "<button type='button' class='timer-preset bg-gray-200 hover:bg-gray-300 text-gray-800 py-1 px-2 rounded text-sm' data-minutes='10'>10 min</button>";
-  html += "<button type='button' class='timer-preset bg-gray-200 hover:bg-gray-300 text-gray-800 py-1 px-2 rounded text-sm' data-minutes='15'>15 min</button>";
-  html += "<button type='button' class='timer-preset bg-gray-200 hover:bg-gray-300 text-gray-800 py-1 px-2 rounded text-sm' data-minutes='30'>30 min</button>";
-  html += "<button type='button' class='timer-preset bg-gray-200 hover:bg-gray-300 text-gray-800 py-1 px-2 rounded text-sm' data-minutes='60'>1 hour</button>";
-  html += "<button type='button' class='timer-preset bg-gray-200 hover:bg-gray-300 text-gray-800 py-1 px-2 rounded text-sm' data-minutes='90'>1.5 hours</button>";
-  html += "</div>";
-  html += "</div>";
-  
-  // Timer controls
-  html += "<div class='flex justify-center space-x-2'>";
-  html += "<button type='button' id='timer-start' class='bg-green-500 text-white py-1 px-2 rounded hover:bg-green-600'>Start</button>";
-  html += "<button type='button' id='timer-stop' class='bg-yellow-500 text-white py-1 px-2 rounded hover:bg-yellow-600'>Stop</button>";
-  html += "<button type='button' id='timer-reset' class='bg-red-500 text-white py-1 px-2 rounded hover:bg-red-600'>Reset</button>";
-  html += "</div>";
-  
-
-  
-
-  html += "</div>";
-
-  html += "<h1 class='text-2xl font-bold mb-6 text-center'>Clock Settings</h1>";
-  // Brightness field (in %)
-  html += "<div>";
-  html += "<label class='block text-gray-700'>Max Brightness (0-100%):</label>";
-  html += "<input type='number' name='brightness' min='0' max='100' value='" + String(userBrightness * 100 / 255) + "' class='mt-1 block w-full px-3 py-2 border rounded-md' required>";
-  html += "</div>";
-  
-  // Auto brightness toggle
-  html += "<div>";
-  html += "<label class='inline-flex items-center'>";
-  html += "<input type='checkbox' name='autoBrightness' value='1'" + String(autoBrightnessEnabled ? " checked" : "") + " class='form-checkbox h-4 w-4 text-blue-600'>";
-  html += "<span class='ml-2'>Auto adjust brightness by time of day</span>";
-  html += "</label>";
-  html += "</div>";
-  
-  // Auto brightness settings - only visible when auto brightness is enabled using javascript
-  html += "<div id='autoBrightnessSettings' " + String(autoBrightnessEnabled ? "" : "class='hidden'") + ">";
-  html += "<div class='mt-2 p-3 bg-gray-50 rounded-md'>";
-  
-  // Day brightness (9:00-18:00)
-  html += "<div class='mb-2'>";
-  html += "<label class='block text-gray-700 text-sm'>Day Brightness (9:00-18:00):</label>";
-  html += "<input type='number' name='dayBrightness' min='0' max='100' value='" + String(dayBrightness) + "' class='mt-1 block w-full px-3 py-2 border rounded-md text-sm'>";
-  html += "</div>";
-  
-  // Night brightness (22:00-6:00)
-  html += "<div class='mb-2'>";
-  html += "<label class='block text-gray-700 text-sm'>Night Brightness (22:00-6:00):</label>";
-  html += "<input type='number' name='nightBrightness' min='0' max='100' value='" + String(nightBrightness) + "' class='mt-1 block w-full px-3 py-2 border rounded-md text-sm'>";
-  html += "</div>";
-  
-  // Transition brightness (6:00-9:00 & 18:00-22:00)
-  html += "<div>";
-  html += "<label class='block text-gray-700 text-sm'>Transition Brightness (6:00-9:00 & 18:00-22:00):</label>";
-  html += "<input type='number' name='transitionBrightness' min='0' max='100' value='" + String(transitionBrightness) + "' class='mt-1 block w-full px-3 py-2 border rounded-md text-sm'>";
-  html += "</div>";
-  
-  html += "</div>"; // End of auto brightness settings panel
-  html += "</div>";
-  
-  // Mode field
-  html += "<div>";
-  html += "<span class='block text-gray-700'>Mode:</span>";
-  html += "<label class='inline-flex items-center mt-1'><input type='radio' name='mode' value='0'" + String(mode==0?" checked":"") + " class='form-radio h-4 w-4 text-blue-600' id='rainbow-mode'><span class='ml-2'>Rainbow (Color Transition)</span></label><br>";
-  html += "<label class='inline-flex items-center mt-1'><input type='radio' name='mode' value='1'" + String(mode==1?" checked":"") + " class='form-radio h-4 w-4 text-blue-600' id='static-mode'><span class='ml-2'>Static (Fixed Color)</span></label>";
-  html += "</div>";
-  
-  // Rainbow speed control - only visible when rainbow mode is selected
-  html += "<div id='rainbowSettings' " + String(mode==0 ? "" : "class='hidden'") + ">";
-  html += "<div class='mt-2 p-3 bg-gray-50 rounded-md'>";
-  html += "<label class='block text-gray-700 text-sm'>Rainbow Speed (1-10):</label>";
-  html += "<div class='flex items-center space-x-2'>";
-  html += "<span class='text-xs'>Slow</span>";
-  html += "<input type='range' name='rainbowSpeed' min='1' max='10' value='" + String(rainbowSpeed) + "' class='flex-grow'>";
-  html += "<span class='text-xs'>Fast</span>";
-  html += "<span class='ml-2 text-sm font-bold' id='speedValue'>" + String(rainbowSpeed) + "</span>";
-  html += "</div>";
-  html += "</div>";
-  html += "</div>";
-  
-  // Advanced color picker (only shown when static mode is selected)
-  html += "<div id='colorSettings' " + String(mode==1 ? "" : "class='hidden'") + ">";
-  html += "<div class='mt-2'>";
-  html += "<label class='block text-gray-700'>Color:</label>";
-  html += "<div id='color-picker-container' class='mt-2 flex justify-center'></div>";
-  
-  // Hidden input field to store the color value
-  char buf[8];
-  sprintf(buf, "#%06X", staticColor.red << 16 | staticColor.green << 8 | staticColor.blue);
-  html += "<input type='hidden' name='color' id='color-value' value='" + String(buf) + "'>";
-  
-  // Color preview
-  html += "<div class='mt-2 flex justify-between items-center'>";
-  html += "<span class='text-gray-700'>Preview:</span>";
-  html += "<div id='color-preview' class='w-16 h-8 border' style='background-color: " + String(buf) + ";'></div>";
-  html += "<span id='color-hex' class='text-sm font-mono'>" + String(buf) + "</span>";
-  html += "</div>";
-  html += "</div>";
-  html += "</div>";
-  
-  
-  html += "<div class='text-center mt-6'>";
-  html += "<input type='submit' value='Update Settings' class='bg-blue-500 text-white px-4 py-2 rounded hover:bg-blue-600'>";
-  html += "</div>";
-  html += "</form>";
-  
-  // JavaScript for interactive elements
-  html += "<script>";
-  
-  // Auto brightness toggle
-  html += "document.querySelector('input[name=\"autoBrightness\"]').addEventListener('change', function() {";
-  html += "  document.getElementById('autoBrightnessSettings').classList.toggle('hidden', !this.checked);";
-  html += "});";
-  
-  // Mode selection toggle for rainbow/static specific settings
-  html += "document.getElementById('rainbow-mode').addEventListener('change', function() {";
-  html += "  if(this.checked) {";
-  html += "    document.getElementById('rainbowSettings').classList.remove('hidden');";
-  html += "    document.getElementById('colorSettings').classList.add('hidden');";
-  html += "  }";
-  html += "});";
-  
-  html += "document.getElementById('static-mode').addEventListener('change', function() {";
-  html += "  if(this.checked) {";
-  html += "    document.getElementById('colorSettings').classList.remove('hidden');";
-  html += "    document.getElementById('rainbowSettings').classList.add('hidden');";
-  html += "  }";
-  html += "});";
-  
-  // Rainbow speed slider
-  html += "document.querySelector('input[name=\"rainbowSpeed\"]').addEventListener('input', function() {";
-  html += "  document.getElementById('speedValue').textContent = this.value;";
-  html += "});";
-  
-  // Initialize color picker
-  html += "var colorPicker = new iro.ColorPicker('#color-picker-container', {";
-  html += "  width: 180,";
-  html += "  color: '" + String(buf) + "',";
-  html += "  borderWidth: 1,";
-  html += "  borderColor: '#ccc',";
-  html += "  layout: [";
-  html += "    {";
-  html += "      component: iro.ui.Wheel,";
-  html += "      options: {}";
-  html += "    },";
-  html += "    {";
-  html += "      component: iro.ui.Slider,";
-  html += "      options: {";
-  html += "        sliderType: 'value'";
-  html += "      }";
-  html += "    }";
-  html += "  ]";
-  html += "});";
-  
-  // Update hidden input and preview when color changes
-  html += "colorPicker.on('color:change', function(color) {";
-  html += "  var hexColor = color.hexString;";
-  html += "  document.getElementById('color-value').value = hexColor;";
-  html += "  document.getElementById('color-preview').style.backgroundColor = hexColor;";
-  html += "  document.getElementById('color-hex').textContent = hexColor;";
-  html += "});";
-  
-  // Timer controls
-  html += "document.getElementById('timer-start').addEventListener('click', function() {";
-  html += "  var minutes = document.getElementById('timer-minutes').value;";
-  html += "  var seconds = document.getElementById('timer-seconds').value;";
-  html += "  fetch('/timer?action=start&minutes=' + minutes + '&seconds=' + seconds)";
-  html += "    .then(response => response.json())";
-  html += "    .then(data => updateTimerUI(data));";
-  html += "});";
-  
-  html += "document.getElementById('timer-stop').addEventListener('click', function() {";
-  html += "  fetch('/timer?action=stop')";
-  html += "    .then(response => response.json())";
-  html += "    .then(data => updateTimerUI(data));";
-  html += "});";
-  
-  html += "document.getElementById('timer-reset').addEventListener('click', function() {";
-  html += "  fetch('/timer?action=reset')";
-  html += "    .then(response => response.json())";
-  html += "    .then(data => updateTimerUI(data));";
-  html += "});";
-  
-  // Add handler for preset buttons
-  html += "document.querySelectorAll('.timer-preset').forEach(function(button) {";
-  html += "  button.addEventListener('click', function() {";
-  html += "    var minutes = parseInt(this.getAttribute('data-minutes'));";
-  html += "    document.getElementById('timer-minutes').value = minutes;";
-  html += "    document.getElementById('timer-seconds').value = 0;";
-  html += "  });";
-  html += "});";
-  
-  // Timer UI update function
-  html += "function updateTimerUI(data) {";
-  html += "  var statusEl = document.getElementById('timer-status');";
-  html += "  var displayEl = document.getElementById('timer-display');";
-  html += "  if (data.active) {";
-  html += "    statusEl.textContent = data.completed ? 'Timer completed!' : 'Timer running...';";
-  html += "  } else {";
-  html += "    statusEl.textContent = 'Timer ready';";
-  html += "  }";
-  html += "  displayEl.textContent = ('0' + data.minutes).slice(-2) + ':' + ('0' + data.seconds).slice(-2);";
-  html += "}";
-  
-  // Poll timer status every second when active
-  html += "if (" + String(timerActive ? "true" : "false") + ") {";
-  html += "  setInterval(function() {";
-  html += "    fetch('/timer?action=status')";
-  html += "      .then(response => response.json())";
-  html += "      .then(data => updateTimerUI(data));";
-  html += "  }, 1000);";
-  html += "}";
-  
-  html += "</script>";
-  
-  html += "</div></body></html>";
-  server.send(200, "text/html", html);
+// Neither task polls. After a pass loop() works out when its next duty is due, after a
+// frame the render task when the display can next look different, and both block until
+// then; a web request wakes loop() early (wakeLoop()), a changed snapshot the render task.
+// PubSubClient cannot wake a task when data arrives, so while MQTT is connected loop()
+// looks at the socket every MQTT_POLL_MS. While both block, the FreeRTOS idle task runs
+// and the CPU waits for an interrupt (or light-sleeps, with automatic light sleep enabled).
+#define IDLE_MAX_MS  1000 // Longest block of either task; bounds anything a deadline misses
+#define MQTT_POLL_MS 100  // Longest wait for an MQTT command
+#define WIFI_POLL_MS 100  // How often a Wi‑Fi join is checked on
+
+// Move deadline to at if that comes first (both millis(), less than 24 days apart)
+void keepEarlier(unsigned long& deadline, unsigned long at) {
+  if ((long)(at - deadline) < 0) deadline = at;
 }
 
-// Handler for settings update
-void handleSet() {
-  if (server.hasArg("brightness")) {
-    int percent = server.arg("brightness").toInt();
-    percent = constrain(percent, 0, 100);
-    userBrightness = (percent * 255) / 100;
+// Block the calling task for ms or until it is notified; returns the notifications taken.
+// One tick is added since the current one is partly over, so a deadline is never early,
+// and the task always blocks for at least a tick so lower-priority tasks can run.
+uint32_t idleWait(long ms) {
+  return ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(ms > 0 ? ms : 0) + 1);
+}
+
+// millis() when the frame drawn at start from snap can next look different
+unsigned long nextFrameAt(const DisplaySnapshot& snap, unsigned long start) {
+  const unsigned long framePeriod = 1000 / RENDER_FPS;
+  unsigned long next = start + IDLE_MAX_MS;
+  
+  // Animated effects declare their step time; faster speeds step more often, up to the frame rate
+  const Effect& effect = activeEffect(snap.mode);
+  if (effect.stepMs) {
+    keepEarlier(next, start + max(framePeriod, (unsigned long)effect.stepMs / max(snap.rainbowSpeed, (uint8_t)1)));
   }
   
-  // Handle auto brightness setting
-  autoBrightnessEnabled = server.hasArg("autoBrightness");
+  // The next scroll step, timer second or flash, or colon blink of what renderTick() shows
+  if (marquee.active) {
+    keepEarlier(next, marquee.nextStep);
+  } else if (snap.timerShown) {
+    if (snap.timerRinging) {
+      keepEarlier(next, start + TIMER_FLASH_MS - (start - snap.timerMark) % TIMER_FLASH_MS);
+    } else if (snap.timerCountsUp) {
+      keepEarlier(next, start + 1000 - (start - snap.timerMark) % 1000);
+    } else if ((int32_t)(snap.timerMark - start) > 0) {
+      keepEarlier(next, start + (snap.timerMark - start - 1) % 1000 + 1);
+    }
+  } else if ((snap.timeSet || (snap.timeNeedsSync && !snap.wifiConnected)) && !effect.steadyColon) {
+    keepEarlier(next, start + 500 - animationMs(snap, start) % 500);
+  }
   
-  // Process brightness settings for different times of day
-  if (server.hasArg("dayBrightness")) {
-    dayBrightness = constrain(server.arg("dayBrightness").toInt(), 0, 100);
+  // An auto brightness fade, one brightness step at a time
+  if (snap.autoBrightness && millis() - snap.scheduleRampStart < snap.scheduleRampMs) {
+    int steps = abs(levelPercent(snap, snap.scheduleTo) - levelPercent(snap, snap.scheduleFrom)) * snap.brightness / 100;
+    keepEarlier(next, start + max(framePeriod, (unsigned long)(snap.scheduleRampMs / max(steps, 1))));
   }
   
-  if (server.hasArg("nightBrightness")) {
-    nightBrightness = constrain(server.arg("nightBrightness").toInt(), 0, 100);
+#if COLOR_DITHER
+  // The dither phase moves every frame
+  if (tableBrightness < DITHER_BRIGHTNESS) keepEarlier(next, start + framePeriod);
+#endif
+  return next;
+}
+
+// millis() when loop() next has something to do
+unsigned long nextLoopAt() {
+  unsigned long now = millis();
+  unsigned long next = now + (mqttClient.connected() ? MQTT_POLL_MS : IDLE_MAX_MS);
+  
+  // Connection attempts and joins in progress
+  if (wifiLink.state == LINK_CONNECTING) {
+    keepEarlier(next, now + WIFI_POLL_MS);
+  } else if (wifiLink.state != LINK_UP) {
+    keepEarlier(next, wifiLink.nextAttempt);
+  } else {
+    if (ntpLink.state != LINK_UP) keepEarlier(next, ntpLink.nextAttempt);
+    if (mqttLink.state != LINK_UP) keepEarlier(next, mqttLink.nextAttempt);
   }
   
-  if (server.hasArg("transitionBrightness")) {
-    transitionBrightness = constrain(server.arg("transitionBrightness").toInt(), 0, 100);
+  // The clock digits change on the minute
+  if (clockSource != CLOCK_NONE) keepEarlier(next, nextClockMinute(now));
+  
+  // Timers going off, alarms re-arming and the schedule's next rule
+  if (timerHeapSize > 0) keepEarlier(next, timers[timerHeap[0]].mark);
+  for (const Timer& timer : timers) {
+    if (timer.id && timer.kind == TIMER_ALARM && timer.state == TIMER_RINGING) {
+      keepEarlier(next, timer.mark + TIMER_RING_MS);
+    }
   }
+  keepEarlier(next, nextScheduleCheck);
   
-  if (server.hasArg("mode")) {
-    mode = server.arg("mode").toInt();
+  // Deferred flash writes and statistics
+  if (settingsDirty) keepEarlier(next, settingsChangedAt + SETTINGS_QUIET_MS);
+  if (timersDirty) keepEarlier(next, timersChangedAt + SETTINGS_QUIET_MS);
+  keepEarlier(next, lastHeapSample + HEAP_SAMPLE_MS);
+  keepEarlier(next, powerWindowStart + POWER_WINDOW_MS);
+  return next;
+}
+
+// ===== Render Task =====
+
+uint8_t marqueeSerialSeen = 0; // Last marquee request picked up by the render task
+
+// Draw one frame from a snapshot of the settings
+void renderTick(const DisplaySnapshot& snap) {
+  // Start newly requested text
+  if (snap.marqueeSerial != marqueeSerialSeen) {
+    marqueeSerialSeen = snap.marqueeSerial;
+    startMarquee(snap.marqueeText, snap.marqueeStep, snap.marqueeRepeats);
   }
   
-  if (server.hasArg("color")) {
-    String colorStr = server.arg("color");
-    if (colorStr.charAt(0) == '#') {
-      colorStr = colorStr.substring(1);
+  // Update brightness based on time of day
+  updateChannelTables(getTimeBrightness(snap), snap.whiteBalance);
+  
+  // Segments are drawn lit and coloured by the effect once the frame is complete
+  CRGB currentColor = LIT;
+  
+  // Scrolling text takes over the display until it finishes
+  updateMarquee();
+  
+  // Show scrolling text, then the timer if active, otherwise the clock
+  if (marquee.active) {
+    displayMarquee(currentColor);
+  } else if (snap.timerShown) {
+    displayTimer(snap, currentColor);
+  } else {
+    // Normal clock display
+    if (snap.timeSet) {
+      displayTime(snap, currentColor);
+    } else if (snap.wifiConnected) {
+      displayStatus(2, currentColor); // Waiting for NTP
+    } else if (snap.timeNeedsSync) {
+      // If Wi‑Fi is lost after time was obtained, continue displaying last time
+      displayTime(snap, currentColor);
+    } else {
+      displayStatus(0, currentColor); // Waiting for Wi‑Fi
     }
-    long colorVal = strtol(colorStr.c_str(), NULL, 16);
-    staticColor = CRGB((colorVal >> 16) & 0xFF, (colorVal >> 8) & 0xFF, colorVal & 0xFF);
   }
   
-  // Handle rainbow speed
-  if (server.hasArg("rainbowSpeed")) {
-    rainbowSpeed = constrain(server.arg("rainbowSpeed").toInt(), 1, 10);
-  }
+  applyEffect(snap);
+  renderFrame();
+}
+
+// Track how far a frame started from the time it was planned for
+void recordFrameJitter(int32_t lateMicros) {
+  uint32_t jitter = lateMicros < 0 ? -lateMicros : lateMicros;
   
-  // Save settings to flash after update
-  saveSettings();
+  if (jitter > frameJitterMaxUs) frameJitterMaxUs = jitter;
+  frameJitterAvgUs = frameJitterAvgUs + ((int32_t)(jitter - frameJitterAvgUs) >> 4);
+}
+
+// Renders on its own core, independent of network handling in loop(), whenever the
+// display can change: at the frame rate while an effect animates, otherwise as rarely as
+// twice a second for the colon
+void renderTask(void*) {
+  DisplaySnapshot snap;
+  const unsigned long framePeriod = 1000 / RENDER_FPS;
   
-  String response = "<!DOCTYPE html><html lang='en'><head><meta charset='UTF-8'>";
-  response += "<meta http-equiv='refresh' content='2; url=/'><title>Settings Updated</title>";
-  response += "<script src='https://cdn.tailwindcss.com'></script></head><body class='bg-gray-100 flex items-center justify-center min-h-screen'>";
-  response += "<div class='bg-white shadow-lg rounded-lg p-8 max-w-md w-full text-center'>";
-  response += "<h1 class='text-2xl font-bold mb-4'>Settings Updated!</h1>";
-  response += "<p class='mb-4'>Your settings have been updated and saved.</p>";
-  response += "<a href='/' class='text-blue-500 hover:underline'>Return to Settings</a>";
-  response += "</div></body></html>";
-  server.send(200, "text/html", response);
+  for (;;) {
+    unsigned long frameStart = millis();
+    unsigned long busyStart = micros();
+    accountLedLevel();
+    
+    PROFILE_START(frameMark);
+    {
+      ALLOC_SCOPE(ALLOC_RENDER);
+      readSnapshot(snap);
+      renderTick(snap);
+    }
+    PROFILE_LAP(STAGE_FRAME, frameMark);
+    
+    long wait = nextFrameAt(snap, frameStart) - millis();
+    renderBusyUs += micros() - busyStart;
+    unsigned long plannedMicros = micros() + (wait > 0 ? wait * 1000 : 0);
+    if (idleWait(wait) == 0) {
+      recordFrameJitter(micros() - plannedMicros);
+    } else {
+      // A new snapshot: draw it, but no faster than the frame rate
+      long early = frameStart + framePeriod - millis();
+      if (early > 0) vTaskDelay(pdMS_TO_TICKS(early));
+    }
+  }
 }
 
 // ===== Setup =====
 void setup() {
   Serial.begin(115200);
   
-  // Load saved settings
+  stateMutex = xSemaphoreCreateRecursiveMutex();
+  loopTaskHandle = xTaskGetCurrentTaskHandle();
+#if PROFILING
+  setupProfiler();
+#endif
+  
+  // Load saved settings; pending changes are written before a software restart
   loadSettings();
+  esp_register_shutdown_handler(flushSettings);
+  loadTimers();
+  esp_register_shutdown_handler(flushTimers);
+  restoreWallClock();
+  esp_register_shutdown_handler(writeClockRecordAtShutdown);
+  loadWifiCache();
   
   // Initialize LED displays and colon
-  FastLED.addLeds<LED_TYPE, DIGIT1_PIN, COLOR_ORDER>(leds1, NUM_LEDS);
-  FastLED.addLeds<LED_TYPE, DIGIT2_PIN, COLOR_ORDER>(leds2, NUM_LEDS);
-  FastLED.addLeds<LED_TYPE, DIGIT3_PIN, COLOR_ORDER>(leds3, NUM_LEDS);
-  FastLED.addLeds<LED_TYPE, DIGIT4_PIN, COLOR_ORDER>(leds4, NUM_LEDS);
-  FastLED.addLeds<LED_TYPE, COLON_PIN, COLOR_ORDER>(colon, COLON_COUNT);
-  
-  // Set initial brightness
-  FastLED.setBrightness(userBrightness);
-  FastLED.clear();
-  FastLED.show();
+  // FastLED sends the corrected output levels, not the arrays the display functions draw in
+  FastLED.addLeds<LED_TYPE, stripMap[0].pin, COLOR_ORDER>(lastFrame + stripMap[0].offset, stripMap[0].count);
+  FastLED.addLeds<LED_TYPE, stripMap[1].pin, COLOR_ORDER>(lastFrame + stripMap[1].offset, stripMap[1].count);
+  FastLED.addLeds<LED_TYPE, stripMap[2].pin, COLOR_ORDER>(lastFrame + stripMap[2].offset, stripMap[2].count);
+  FastLED.addLeds<LED_TYPE, stripMap[3].pin, COLOR_ORDER>(lastFrame + stripMap[3].offset, stripMap[3].count);
+  FastLED.addLeds<LED_TYPE, stripMap[COLON_STRIP].pin, COLOR_ORDER>(lastFrame + stripMap[COLON_STRIP].offset, stripMap[COLON_STRIP].count);
   
-  Serial.println("Connecting to Wi‑Fi...");
-  WiFi.begin(ssid, password);
+  // Frames are only pushed when they change, so FastLED's temporal dithering would freeze
+  // on one phase; the colour stage dithers itself (COLOR_DITHER)
+  FastLED.setDither(DISABLE_DITHER);
   
-  // Wait for Wi‑Fi connection; display status "0" meanwhile
-  while (WiFi.status() != WL_CONNECTED) {
-    CRGB tempColor = CHSV(globalHue, 255, 255);
-    displayStatus(0, tempColor);
-    delay(1000);
-    globalHue++;
-  }
-  Serial.println("Wi‑Fi Connected!");
+  // Colour tables for the initial brightness
+  setupColor();
+  updateChannelTables(userBrightness, whiteBalance);
+  FastLED.clear();
+  renderFrame();
   
-  // Initialize MQTT
+  // Wi‑Fi, MQTT and NTP are brought up by updateConnections() from loop()
+  WiFi.persistent(false);       // Before mode(); the connection cache keeps what the driver would save on every join
+  WiFi.mode(WIFI_STA);
+  WiFi.setAutoReconnect(false); // Reconnects are scheduled by the connection manager
+  setupTopics();
   mqttClient.setServer(mqtt_server, mqtt_port);
   mqttClient.setCallback(mqttCallback);
-  connectMQTT();
+  setupCommandFilter();
+  mqttClient.setSocketTimeout(2);
+  mqttClient.setBufferSize(max(STATUS_BUFFER_SIZE, RESPONSE_BUFFER_SIZE) + 128); // Room for the topic and packet header
   
-  // Initialize and set the time using ezTime
-  waitForSync(2);  // 30 seconds timeout
+  // NTP is queried by the connection manager with its own backoff
+  setInterval(0);
   
-  // Set timezone to Poland (Europe/Warsaw)
-  Poland.setLocation("Europe/Warsaw");
-  Serial.print("Poland time: ");
-  Serial.println(Poland.dateTime());
+  // Poland (Europe/Warsaw) rules are set locally so no timezone lookup blocks start-up
+  Poland.setPosix("CET-1CEST,M3.5.0,M10.5.0/3");
   
-  // Start web server
-  server.on("/", handleRoot);
-  server.on("/set", handleSet);
-  server.on("/timer", handleTimer);
+  // Start web server; handlers run in the AsyncTCP task, not in loop()
+  server.on("/", HTTP_GET, handleRoot);
+  server.on("/set", HTTP_GET, handleSet);
+  server.on("/timer", HTTP_GET, handleTimer);
+  server.on("/schedule", HTTP_GET, handleSchedule);
+  server.on("/state", HTTP_GET, handleState);
+  server.on("/stats", HTTP_GET, handleStats);
+  server.on("/heap", HTTP_GET, handleHeap);
+#if PROFILING
+  server.on("/metrics", HTTP_GET, handleMetrics);
+#endif
+  liveEvents.onConnect(onEventsConnect);
+  server.addHandler(&liveEvents);
+  server.onNotFound(handleAsset);
   server.begin();
   Serial.println("Web server started!");
   
-  // Show IP address on startup
-  CRGB displayColor = (mode == 0) ? CHSV(globalHue, 255, 255) : staticColor;
-  showIPAddress(displayColor);
+  // Hand the display over to the render task
+  publishSnapshot();
+  xTaskCreatePinnedToCore(renderTask, "render", 4096, NULL, 2, &renderTaskHandle, RENDER_CORE);
 }
 
 // ===== Main Loop =====
 void loop() {
-  // Update brightness based on time of day
-  FastLED.setBrightness(getTimeBrightness());
+  PROFILE_START(passMark);
+  PROFILE_START(stageMark);
+  unsigned long busyStart = micros();
   
-  // Handle MQTT connection and messages
-  if (!mqttClient.connected()) {
-    connectMQTT();
-  }
+  // Keep Wi‑Fi, NTP and MQTT connected without blocking
+  updateConnections();
+  PROFILE_LAP(STAGE_CONNECTIONS, stageMark);
+  
+  unsigned long passStart = micros();
+  // Web requests are served by the AsyncTCP task and take the state lock too. It is
+  // held only while state changes or is copied; MQTT, NTP and flash I/O run outside
+  
+  // Handle MQTT messages; the callback takes the lock for each message's commands
   mqttClient.loop();
+  PROFILE_LAP(STAGE_MQTT, stageMark);
   
-  // Handle web server requests
-  server.handleClient();
+  // Update time with ezTime (non-blocking); the wall clock follows its NTP syncs
+  {
+    ALLOC_SCOPE(ALLOC_TIME_EVENTS);
+    events();
+  }
+  {
+    StateLock lock;
+    updateWallClock();
+  }
+  updateClockDrift();
+  PROFILE_LAP(STAGE_TIME_EVENTS, stageMark);
   
-  // Update time with ezTime (non-blocking)
-  events();
+  // Push state changes to open web pages
+  updateLiveEvents();
+  PROFILE_LAP(STAGE_LIVE_EVENTS, stageMark);
   
-  // Determine current color based on mode
-  CRGB currentColor = (mode == 0) ? CHSV(globalHue, 255, 255) : staticColor;
+  // Follow the brightness schedule; write settings to flash once they stop changing
+  {
+    StateLock lock;
+    updateSchedule();
+    updateHeapHistory();
+    updatePower();
+  }
+  updateSettings();
+  PROFILE_LAP(STAGE_SETTINGS, stageMark);
   
-  // Check if timer is active and display it, otherwise show the clock
-  if (timerActive) {
-    displayTimer(currentColor);
-  } else {
-    // Normal clock display
-    if (timeStatus() == timeSet) {
-      displayTime(currentColor);
-    } else {
-      if (WiFi.status() == WL_CONNECTED) {
-        displayStatus(2, currentColor);
-      } else {
-        // If Wi‑Fi is lost after time was obtained, continue displaying last time
-        displayTime(currentColor);
-      }
-    }
+  // Set off timers that ran out and save timer changes
+  updateTimers();
+  PROFILE_LAP(STAGE_TIMER, stageMark);
+  
+  // Publish status changes to MQTT subscribers
+  updateStatus();
+#if PROFILING
+  updateMetrics();
+#endif
+  PROFILE_LAP(STAGE_STATUS, stageMark);
+  
+  // Pass settings changed by MQTT or the web server on to the render task
+  {
+    StateLock lock;
+    publishSnapshot();
   }
+  PROFILE_LAP(STAGE_SNAPSHOT, stageMark);
   
-  // Shorter delay to allow more frequent updates
-  delay(50);
+  unsigned long passUs = micros() - passStart;
+  loopMaxUs = max(loopMaxUs, passUs);
+  loopAvgUs = loopAvgUs ? (loopAvgUs * 15 + passUs) / 16 : passUs;
+  PROFILE_LAP(STAGE_LOOP, passMark);
   
-  // Update rainbow color with configurable speed
-  if (mode == 0) {
-    globalHue += rainbowSpeed; // Increment by speed value
+  // Block until the next duty is due, a web request changes something or MQTT is polled
+  long wait;
+  {
+    StateLock lock;
+    wait = nextLoopAt() - millis();
   }
+  loopBusyUs += micros() - busyStart;
+  idleWait(wait);
+  PROFILE_LAP(STAGE_IDLE, passMark);
 }
@@ -0,0 +1,267 @@
+// Tests of the MQTT command path on the host simulation (env:native).
+//
+//   pio test -e native
+//
+// The firmware boots once, as in sim/bench.cpp, and every test talks to it the way
+// a client would: commands go in through the fake broker, and the response it
+// publishes and what /state reports are checked. Firmware state is global, so
+// tests run in order and each one leaves the watch usable for the next.
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <unity.h>
+#include <unistd.h>
+
+void setup();
+void loop();
+extern const char* device_id;
+
+namespace {
+
+#define WARMUP_MS 5000  // Virtual time for Wi‑Fi, MQTT and NTP to come up
+#define HANDLE_MS 200   // Virtual time allowed for one command to be answered
+#define HOUR_MS 3600000UL
+#define SCHEDULE_MAX 12 // MAX_SCHEDULE_RULES
+#define BATCH_MAX 16    // MAX_BATCH_OPS
+
+std::string commandTopic;
+std::string responseTopic;
+
+void runFor(unsigned long ms) {
+  unsigned long end = millis() + ms;
+  while ((long)(millis() - end) < 0) {
+    loop();
+  }
+}
+
+// Send a command and parse the response to it; null if none was published
+JsonDocument send(const char* message) {
+  unsigned long sentAt = millis();
+  sim::mqttInject(commandTopic.c_str(), message);
+  runFor(HANDLE_MS);
+
+  JsonDocument response;
+  std::string payload = sim::mqttLastPayload(responseTopic.c_str());
+  if (deserializeJson(response, payload) || response["timestamp"].as<unsigned long>() < sentAt) {
+    response.clear();
+  }
+  return response;
+}
+
+// Strip pushes (CLEDController::showLeds() calls) over one virtual hour
+uint32_t pushesPerHour() {
+  uint32_t start = sim::framesShown();
+  runFor(HOUR_MS);
+  uint32_t pushes = sim::framesShown() - start;
+  char line[48];
+  snprintf(line, sizeof(line), "%u strip pushes in one hour", pushes);
+  TEST_MESSAGE(line);
+  return pushes;
+}
+
+JsonDocument state() {
+  std::string body;
+  JsonDocument doc;
+  TEST_ASSERT_EQUAL(200, sim::httpGet("/state", &body));
+  TEST_ASSERT_FALSE(deserializeJson(doc, body));
+  return doc;
+}
+
+}  // namespace
+
+void setUp() {}
+void tearDown() {}
+
+void test_command_is_applied_and_answered() {
+  JsonDocument response = send("{\"command\":\"setMode\",\"value\":1}");
+  TEST_ASSERT_FALSE(response.isNull());
+  TEST_ASSERT_EQUAL_STRING(device_id, response["device"] | "");
+  TEST_ASSERT_EQUAL_STRING("1", response["mode"] | "");
+  TEST_ASSERT_EQUAL(1, state()["mode"].as<int>());
+
+  response = send("{\"command\":\"setMode\",\"value\":0}");
+  TEST_ASSERT_EQUAL_STRING("0", response["mode"] | "");
+  TEST_ASSERT_EQUAL(0, state()["mode"].as<int>());
+}
+
+void test_unknown_command_is_rejected() {
+  JsonDocument response = send("{\"command\":\"selfDestruct\"}");
+  TEST_ASSERT_EQUAL_STRING("selfDestruct", response["command"] | "");
+  TEST_ASSERT_EQUAL_STRING("unknown command", response["error"] | "");
+}
+
+void test_bad_argument_changes_nothing() {
+  int before = state()["brightness"].as<int>();
+  JsonDocument response = send("{\"command\":\"setBrightness\",\"value\":\"bright\"}");
+  TEST_ASSERT_EQUAL_STRING("value must be a number", response["error"] | "");
+  TEST_ASSERT_EQUAL(before, state()["brightness"].as<int>());
+}
+
+void test_batch_is_applied_together() {
+  JsonDocument response = send("{\"command\":\"batch\",\"ops\":["
+                               "{\"command\":\"setMode\",\"value\":1},"
+                               "{\"command\":\"setColor\",\"red\":255,\"green\":0,\"blue\":16}]}");
+  TEST_ASSERT_TRUE(response["applied"] | false);
+  TEST_ASSERT_EQUAL(2, response["results"].size());
+  JsonDocument now = state();
+  TEST_ASSERT_EQUAL(1, now["mode"].as<int>());
+  TEST_ASSERT_EQUAL_STRING("#FF0010", now["color"] | "");
+}
+
+size_t scheduleRules() {
+  return send("{\"command\":\"getSchedule\"}")["rules"].size();
+}
+
+// An operation that can only fail once the earlier ones are applied (here: the
+// schedule fills up) rejects the whole batch, and nothing is applied
+void test_batch_is_checked_as_a_whole() {
+  char message[640];
+  size_t length = snprintf(message, sizeof(message), "{\"command\":\"setSchedule\",\"rules\":[");
+  for (int i = 0; i < SCHEDULE_MAX - 1; i++) {
+    length += snprintf(message + length, sizeof(message) - length, "%s{\"at\":\"%02d:00\"}", i ? "," : "", i);
+  }
+  snprintf(message + length, sizeof(message) - length, "]}");
+  JsonDocument response = send(message);
+  TEST_ASSERT_TRUE(response["error"].isNull());
+  TEST_ASSERT_EQUAL(SCHEDULE_MAX - 1, scheduleRules());
+
+  int mode = state()["mode"].as<int>();
+  snprintf(message, sizeof(message), "{\"command\":\"batch\",\"ops\":["
+           "{\"command\":\"setMode\",\"value\":%d},"
+           "{\"command\":\"addScheduleRule\",\"at\":\"20:00\"},"
+           "{\"command\":\"addScheduleRule\",\"at\":\"21:00\"}]}", mode ? 0 : 1);
+  response = send(message);
+  TEST_ASSERT_FALSE(response["applied"] | true);
+  TEST_ASSERT_TRUE(response["results"][1]["error"].isNull());
+  TEST_ASSERT_EQUAL_STRING("schedule is full", response["results"][2]["error"] | "");
+  TEST_ASSERT_EQUAL(mode, state()["mode"].as<int>());
+  TEST_ASSERT_EQUAL(SCHEDULE_MAX - 1, scheduleRules());
+
+  send("{\"command\":\"resetSchedule\"}");
+}
+
+// Each operation is checked against the timers as the earlier ones leave them
+void test_batch_checks_timers_in_order() {
+  JsonDocument response = send("{\"command\":\"batch\",\"ops\":["
+                               "{\"command\":\"startStopwatch\",\"id\":7},"
+                               "{\"command\":\"pauseTimer\",\"id\":7},"
+                               "{\"command\":\"deleteTimer\",\"id\":7}]}");
+  TEST_ASSERT_TRUE(response["applied"] | false);
+
+  response = send("{\"command\":\"batch\",\"ops\":["
+                  "{\"command\":\"startStopwatch\",\"id\":7},"
+                  "{\"command\":\"deleteTimer\",\"id\":7},"
+                  "{\"command\":\"pauseTimer\",\"id\":7}]}");
+  TEST_ASSERT_FALSE(response["applied"] | true);
+  TEST_ASSERT_EQUAL_STRING("no such timer", response["results"][2]["error"] | "");
+  TEST_ASSERT_EQUAL(0, send("{\"command\":\"listTimers\"}")["timers"].size());
+}
+
+// The largest batch, with the most arguments per operation and no two results alike,
+// fits the command arenas and every result is answered
+void test_full_batch_is_answered() {
+  char message[1024];
+  size_t length = snprintf(message, sizeof(message), "{\"command\":\"batch\",\"ops\":[");
+  for (int i = 0; i < BATCH_MAX; i++) {
+    length += snprintf(message + length, sizeof(message) - length,
+                       "%s{\"command\":\"%s\",\"red\":%d,\"green\":%d,\"blue\":255}", i ? "," : "",
+                       i % 2 ? "setWhiteBalance" : "setColor", 200 + i, 100 + i);
+  }
+  snprintf(message + length, sizeof(message) - length, "]}");
+  JsonDocument response = send(message);
+  TEST_ASSERT_TRUE(response["error"].isNull());
+  TEST_ASSERT_TRUE(response["applied"] | false);
+  TEST_ASSERT_EQUAL(BATCH_MAX, response["results"].size());
+  for (int i = 0; i < BATCH_MAX; i++) {
+    JsonVariantConst result = response["results"][i];
+    char expected[16];
+    snprintf(expected, sizeof(expected), "%d,%d,255", 200 + i, 100 + i);
+    TEST_ASSERT_EQUAL_STRING(i % 2 ? "setWhiteBalance" : "setColor", result["command"] | "");
+    TEST_ASSERT_EQUAL_STRING(expected, result[i % 2 ? "whiteBalance" : "color"] | "");
+  }
+  send("{\"command\":\"setWhiteBalance\",\"red\":255,\"green\":255,\"blue\":255}");
+}
+
+// A response that does not fit is an error, not a shortened success
+void test_oversized_response_is_an_error() {
+  char message[640];
+  size_t length = snprintf(message, sizeof(message), "{\"command\":\"setSchedule\",\"rules\":[");
+  for (int i = 0; i < SCHEDULE_MAX; i++) {
+    length += snprintf(message + length, sizeof(message) - length, "%s{\"at\":\"%02d:00\"}", i ? "," : "", i);
+  }
+  snprintf(message + length, sizeof(message) - length, "]}");
+  send(message);
+
+  length = snprintf(message, sizeof(message), "{\"command\":\"batch\",\"ops\":[");
+  for (int i = 0; i < BATCH_MAX; i++) {
+    length += snprintf(message + length, sizeof(message) - length, "%s{\"command\":\"getSchedule\"}", i ? "," : "");
+  }
+  snprintf(message + length, sizeof(message) - length, "]}");
+  JsonDocument response = send(message);
+  TEST_ASSERT_EQUAL_STRING("response too large", response["error"] | "");
+  TEST_ASSERT_TRUE(response["applied"] | false);  // The reads did run
+  TEST_ASSERT_TRUE(response["results"].isNull());
+
+  send("{\"command\":\"resetSchedule\"}");
+}
+
+void test_schedule_rule_needs_a_time() {
+  JsonDocument response = send("{\"command\":\"addScheduleRule\",\"brightness\":40}");
+  TEST_ASSERT_EQUAL_STRING("at must be a string", response["error"] | "");
+  response = send("{\"command\":\"batch\",\"ops\":[{\"command\":\"setMode\",\"value\":1},"
+                  "{\"command\":\"addScheduleRule\",\"at\":\"25:00\"}]}");
+  TEST_ASSERT_FALSE(response["applied"] | true);
+  TEST_ASSERT_EQUAL_STRING("at must be HH:MM", response["results"][1]["error"] | "");
+}
+
+// A static clock changes twice a second (the colon) and once a minute (the digits).
+// Redrawing every 50 ms, as before the dirty-frame renderer, was 20 pushes per
+// second on each of the five strips: 360000 an hour
+void test_static_clock_pushes_only_changes() {
+  JsonDocument response = send("{\"command\":\"batch\",\"ops\":["
+                               "{\"command\":\"setMode\",\"value\":1},"
+                               "{\"command\":\"setAutoBrightness\",\"enabled\":false}]}");
+  TEST_ASSERT_TRUE(response["applied"] | false);
+  runFor(1000);
+
+  uint32_t pushes = pushesPerHour();
+  TEST_ASSERT_GREATER_OR_EQUAL(7200, pushes);  // Every colon blink was shown
+  TEST_ASSERT_LESS_OR_EQUAL(7200 + 60 * 4, pushes);
+}
+
+// A running countdown changes its last digit once a second, its tens every ten seconds
+// and so on: a little over one push a second
+void test_timer_pushes_only_changes() {
+  JsonDocument response = send("{\"command\":\"startTimer\",\"minutes\":90,\"seconds\":0}");
+  TEST_ASSERT_FALSE(response.isNull());
+  TEST_ASSERT_TRUE(response["error"].isNull());
+  runFor(1000);
+
+  uint32_t pushes = pushesPerHour();
+  TEST_ASSERT_GREATER_OR_EQUAL(3600, pushes);
+  TEST_ASSERT_LESS_OR_EQUAL(3600 + 360 + 60 * 4, pushes);
+  TEST_ASSERT_TRUE(state()["timer"]["active"] | false);
+}
+
+int main() {
+  commandTopic = std::string("esp32watch/") + device_id + "/command";
+  responseTopic = std::string("esp32watch/") + device_id + "/response";
+  setup();
+  runFor(WARMUP_MS);
+
+  UNITY_BEGIN();
+  RUN_TEST(test_command_is_applied_and_answered);
+  RUN_TEST(test_unknown_command_is_rejected);
+  RUN_TEST(test_bad_argument_changes_nothing);
+  RUN_TEST(test_batch_is_applied_together);
+  RUN_TEST(test_batch_is_checked_as_a_whole);
+  RUN_TEST(test_batch_checks_timers_in_order);
+  RUN_TEST(test_full_batch_is_answered);
+  RUN_TEST(test_oversized_response_is_an_error);
+  RUN_TEST(test_schedule_rule_needs_a_time);
+  RUN_TEST(test_static_clock_pushes_only_changes);
+  RUN_TEST(test_timer_pushes_only_changes);
+  int failures = UNITY_END();
+
+  fflush(stdout);
+  _exit(failures);  // The render task is parked on the virtual clock; do not run destructors
+}
@@ -0,0 +1,222 @@
+"""Build the web pages into the firmware as gzip-compressed byte arrays.
+
+Runs as a PlatformIO pre-build script (see extra_scripts in platformio.ini) and
+writes include/web_assets.h, which main.cpp serves with Content-Encoding: gzip.
+Can also be run by hand: python tools/embed_assets.py
+
+For every page it:
+  - replaces the Tailwind CDN script with the rules of web/utilities.css that
+    the page actually uses,
+  - replaces CDN scripts listed in SCRIPTS with the script from web/ that
+    stands in for them, served by the watch under a content-hashed path
+    (cached by browsers for a year),
+  - strips comments and indentation, gzips the result and computes an ETag.
+
+Everything comes from the repository; nothing is downloaded at build time. The
+pages keep their CDN links, so they also work when opened from disk.
+"""
+
+import gzip
+import hashlib
+import os
+import re
+
+# (request path, source file relative to the project)
+PAGES = [
+    ("/", "web/index.html"),
+    ("/updated", "web/updated.html"),
+    ("/control", "esp32_watch_control.html"),
+    ("/remote", "index.html"),
+]
+
+# CDN script URL -> script in web/ served in its place
+SCRIPTS = {
+    "https://unpkg.com/mqtt/dist/mqtt.min.js": "web/mqtt.js",
+}
+
+TAILWIND_CDN = '<script src="https://cdn.tailwindcss.com"></script>'
+
+CACHE_PAGE = "no-cache"                               # Revalidated with the ETag
+CACHE_IMMUTABLE = "public, max-age=31536000, immutable"  # Content-hashed paths
+
+
+# ----- CSS -----
+
+def minify_css(css):
+    css = re.sub(r"/\*.*?\*/", "", css, flags=re.S)
+    css = re.sub(r"\s+", " ", css)
+    css = re.sub(r"\s*([{};:,>~])\s*", r"\1", css)
+    return css.replace(";}", "}").strip()
+
+
+def parse_css(css):
+    """Split minified CSS into (media query or None, selector, body) rules."""
+    rules = []
+    pos = 0
+    while pos < len(css):
+        brace = css.index("{", pos)
+        head = css[pos:brace]
+        if head.startswith("@media"):
+            end = css.index("}}", brace) + 1
+            for _, selector, body in parse_css(css[brace + 1:end]):
+                rules.append((head, selector, body))
+            pos = end + 1
+        else:
+            end = css.index("}", brace)
+            rules.append((None, head, css[brace + 1:end]))
+            pos = end + 1
+    return rules
+
+
+def selector_classes(selector):
+    # ".hover\:bg-blue-600:hover" -> "hover:bg-blue-600"
+    return [m.replace("\\", "") for m in re.findall(r"\.((?:\\.|[\w-])+)", selector)]
+
+
+def shake_css(rules, page):
+    """Keep the base rules plus every rule whose classes all appear in the page."""
+    tokens = set(re.findall(r"[\w:-]+", page))
+    kept = []
+    for media, selector, body in rules:
+        if all(name in tokens for name in selector_classes(selector)):
+            kept.append((media, selector, body))
+
+    out = []
+    open_media = None
+    for media, selector, body in kept:
+        if media != open_media:
+            if open_media:
+                out.append("}")
+            if media:
+                out.append(media + "{")
+            open_media = media
+        out.append("%s{%s}" % (selector, body))
+    if open_media:
+        out.append("}")
+    return "".join(out)
+
+
+# ----- HTML / JS -----
+
+def minify_script(js):
+    lines = []
+    for line in js.split("\n"):
+        line = line.strip()
+        if line and not line.startswith("//"):
+            lines.append(line)
+    return "\n".join(lines)
+
+
+def minify_html(html):
+    html = re.sub(r"<!--.*?-->", "", html, flags=re.S)
+    parts = re.split(r"(<script>.*?</script>|<style>.*?</style>)", html, flags=re.S)
+    out = []
+    for part in parts:
+        if part.startswith("<script>"):
+            out.append("<script>" + minify_script(part[8:-9]) + "</script>")
+        elif part.startswith("<style>"):
+            out.append(part)
+        else:
+            part = re.sub(r">\s*\n\s*<", "><", part)
+            out.append(re.sub(r"\s+", " ", part))
+    return "".join(out).strip()
+
+
+# ----- Header generation -----
+
+def c_identifier(name):
+    return "asset_" + "".join(c if c.isalnum() else "_" for c in name)
+
+
+def add_asset(assets, path, content_type, raw, cache_control):
+    packed = gzip.compress(raw, compresslevel=9, mtime=0)  # mtime=0 keeps builds reproducible
+    etag = '"%s"' % hashlib.sha1(packed).hexdigest()[:16]
+    assets.append((path, content_type, raw, packed, etag, cache_control))
+
+
+def build(project_dir):
+    header_path = os.path.join(project_dir, "include", "web_assets.h")
+    with open(os.path.join(project_dir, "web", "utilities.css")) as f:
+        css_rules = parse_css(minify_css(f.read()))
+
+    assets = []
+    served = {}  # CDN URL -> content-hashed path on the watch
+
+    for path, source in PAGES:
+        with open(os.path.join(project_dir, source), encoding="utf-8") as f:
+            html = f.read()
+        source_size = len(html.encode("utf-8"))
+
+        for cdn_url, script in SCRIPTS.items():
+            tag = '<script src="%s"></script>' % cdn_url
+            if tag not in html:
+                continue
+            if cdn_url not in served:
+                with open(os.path.join(project_dir, script), encoding="utf-8") as f:
+                    data = minify_script(f.read()).encode("utf-8")
+                digest = hashlib.sha1(data).hexdigest()[:8]
+                base, ext = os.path.splitext(os.path.basename(script))
+                served[cdn_url] = "/js/%s-%s%s" % (base, digest, ext)
+                add_asset(assets, served[cdn_url], "application/javascript", data, CACHE_IMMUTABLE)
+            html = html.replace(tag, '<script src="%s"></script>' % served[cdn_url])
+
+        if TAILWIND_CDN in html:
+            html = html.replace(TAILWIND_CDN, "<style>%s</style>" % shake_css(css_rules, html))
+
+        add_asset(assets, path, "text/html", minify_html(html).encode("utf-8"), CACHE_PAGE)
+        print("web assets: %-26s %6d bytes source" % (source, source_size))
+
+    lines = [
+        "// Generated by tools/embed_assets.py from web/ - do not edit",
+        "#pragma once",
+        "#include <Arduino.h>",
+        "",
+        "struct WebAsset {",
+        "  const char* path;",
+        "  const char* contentType;",
+        "  const uint8_t* data;   // gzip-compressed body",
+        "  size_t length;",
+        "  const char* etag;",
+        "  const char* cacheControl;",
+        "};",
+        "",
+    ]
+    table = []
+    total = 0
+
+    print("web assets: %-26s %8s %8s" % ("path", "raw", "gzip"))
+    for path, content_type, raw, packed, etag, cache_control in assets:
+        name = c_identifier(path.strip("/") or "index")
+        lines.append("// %s: %d bytes, %d gzipped" % (path, len(raw), len(packed)))
+        lines.append("const uint8_t %s[] PROGMEM = {" % name)
+        for i in range(0, len(packed), 16):
+            lines.append("  " + ", ".join("0x%02x" % b for b in packed[i:i + 16]) + ",")
+        lines.append("};")
+        lines.append("")
+        table.append('  {"%s", "%s", %s, sizeof(%s), "%s", "%s"},'
+                     % (path, content_type, name, name, etag.replace('"', '\\"'), cache_control))
+        total += len(packed)
+        print("web assets: %-26s %8d %8d" % (path, len(raw), len(packed)))
+    print("web assets: %-26s %8s %8d bytes of flash" % ("total", "", total))
+
+    lines.append("const WebAsset webAssets[] = {")
+    lines.extend(table)
+    lines.append("};")
+    lines.append("")
+
+    content = "\n".join(lines)
+    # Only touch the header when it changes so unchanged assets do not trigger a rebuild
+    if os.path.exists(header_path):
+        with open(header_path) as f:
+            if f.read() == content:
+                return
+    with open(header_path, "w") as f:
+        f.write(content)
+
+
+try:
+    Import("env")  # noqa: F821 - provided by PlatformIO/SCons
+    build(env["PROJECT_DIR"])  # noqa: F821
+except NameError:
+    if __name__ == "__main__":
+        build(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
@@ -0,0 +1,211 @@
+"""Run a fleet of simulated watches against a real MQTT broker.
+
+Starts N copies of the native build (pio run -e native), each with its own device
+ID and a random start-up delay, all connected to the given broker (a local
+Mosquitto, say). Once they are up it puts the even ones in group "even" and the
+odd ones in group "odd", sends a command to each group and one to all watches,
+and checks that exactly the right watches answered each of them. When the run
+ends it reads the frames every watch drew and prints when each one lights its
+colon within the second: with the animation running on the NTP time, the
+watches blink together although they booted at different times.
+
+    mosquitto -p 1883 &
+    python tools/fleet_sim.py --devices 4 --broker localhost:1883
+
+Only the Python standard library is needed. Use a broker of your own; the
+public one would also see other people's test fleets.
+"""
+
+import argparse
+import json
+import os
+import random
+import socket
+import statistics
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+WARMUP_S = 8         # Wi‑Fi, MQTT and NTP up on every watch (5 s in sim/bench.cpp plus start delays)
+COLON_STRIP = 4      # Position of the colon in the frame dump (addLeds() order)
+PHASE_LIMIT_MS = 40  # Largest spread of colon phases still counted as in step
+
+
+class MqttClient:
+    """Just enough MQTT 3.1.1 to publish and to collect responses."""
+
+    def __init__(self, host, port, client_id):
+        self.sock = socket.create_connection((host, port), timeout=5)
+        self.messages = []
+        self.lock = threading.Lock()
+        self._send(0x10, self._string("MQTT") + bytes([4, 0x02, 0, 60]) + self._string(client_id))
+        ack = self._read_exact(4)
+        if ack[0] != 0x20 or ack[3] != 0:
+            raise RuntimeError("broker refused the connection")
+        self.sock.settimeout(None)
+        threading.Thread(target=self._reader, daemon=True).start()
+
+    @staticmethod
+    def _string(text):
+        data = text.encode()
+        return struct.pack(">H", len(data)) + data
+
+    def _send(self, header, body):
+        length = len(body)
+        encoded = bytearray()
+        while True:
+            byte = length & 0x7F
+            length >>= 7
+            encoded.append(byte | (0x80 if length else 0))
+            if not length:
+                break
+        self.sock.sendall(bytes([header]) + bytes(encoded) + body)
+
+    def _read_exact(self, count):
+        data = b""
+        while len(data) < count:
+            chunk = self.sock.recv(count - len(data))
+            if not chunk:
+                raise ConnectionError("broker closed the connection")
+            data += chunk
+        return data
+
+    def _reader(self):
+        try:
+            while True:
+                header = self._read_exact(1)[0]
+                length, shift = 0, 0
+                while True:
+                    byte = self._read_exact(1)[0]
+                    length |= (byte & 0x7F) << shift
+                    shift += 7
+                    if not byte & 0x80:
+                        break
+                body = self._read_exact(length)
+                if header & 0xF0 == 0x30:
+                    topic_length = struct.unpack(">H", body[:2])[0]
+                    payload_at = 2 + topic_length + (2 if header & 0x06 else 0)
+                    with self.lock:
+                        self.messages.append((body[2:2 + topic_length].decode(), body[payload_at:]))
+        except (ConnectionError, OSError):
+            pass
+
+    def subscribe(self, topic):
+        self._send(0x82, b"\x00\x01" + self._string(topic) + b"\x00")
+
+    def publish(self, topic, payload):
+        self._send(0x30, self._string(topic) + json.dumps(payload).encode())
+
+    def take(self):
+        with self.lock:
+            messages, self.messages = self.messages, []
+        return messages
+
+
+def responders(client, wait_s):
+    """Device IDs and "via" of the command responses that arrive within wait_s."""
+    time.sleep(wait_s)
+    answers = []
+    for topic, payload in client.take():
+        try:
+            response = json.loads(payload)
+        except ValueError:
+            continue
+        answers.append((response.get("device"), response.get("via", "")))
+    return answers
+
+
+def check(label, answers, expected, via):
+    got = sorted(device for device, _ in answers)
+    ok = got == sorted(expected) and all(v == via for _, v in answers)
+    print("%-22s %s  answered: %s" % (label, "ok  " if ok else "FAIL", ", ".join(got) or "nobody"))
+    return ok
+
+
+def colon_phases(path):
+    """When the colon lights, in ms from the nearest full second of true time."""
+    epoch = None
+    lit = False
+    phases = []
+    with open(path) as frames:
+        for line in frames:
+            if line.startswith("# epoch "):
+                epoch = int(line.split()[2])
+                continue
+            fields = line.split()
+            if epoch is None or len(fields) < 4 or int(fields[1]) != COLON_STRIP:
+                continue
+            now_lit = any(led != "000000" for led in fields[3:])
+            at = int(fields[0])
+            if now_lit and not lit and at >= WARMUP_S * 1000:
+                phases.append((epoch + at + 500) % 1000 - 500)
+            lit = now_lit
+    return phases
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--program", default=".pio/build/native/program", help="native build to run")
+    parser.add_argument("--broker", default="localhost:1883", help="host:port of the MQTT broker")
+    parser.add_argument("--devices", type=int, default=4)
+    parser.add_argument("--seconds", type=int, default=30, help="how long each watch runs after warm-up")
+    parser.add_argument("--frames", help="directory for the frame files (a temporary one by default)")
+    args = parser.parse_args()
+
+    host, _, port = args.broker.rpartition(":")
+    frames_dir = args.frames or tempfile.mkdtemp(prefix="fleet_sim_")
+    run_id = "%04x" % random.randrange(0x10000)  # Keeps runs against a shared broker apart
+    devices = ["fleet_%s_%d" % (run_id, i) for i in range(args.devices)]
+
+    client = MqttClient(host, int(port), "fleet_sim_" + run_id)
+    client.subscribe("esp32watch/+/response")
+
+    processes = []
+    for device in devices:
+        time.sleep(random.uniform(0, 1.5))  # Boots at different times, so millis() differs
+        processes.append(subprocess.Popen(
+            [args.program, "serve", "--device-id", device, "--broker", args.broker,
+             "--seconds", str(args.seconds), "--frames", os.path.join(frames_dir, device + ".txt")],
+            stdout=subprocess.DEVNULL))
+    time.sleep(WARMUP_S)
+
+    even, odd = devices[0::2], devices[1::2]
+    for device in devices:
+        group = "even" if device in even else "odd"
+        client.publish("esp32watch/%s/command" % device, {"command": "setGroups", "groups": [group]})
+    ok = check("setGroups", responders(client, 2), devices, "")
+
+    client.publish("esp32watch/group/even/command", {"command": "setMode", "value": 0})
+    ok &= check("group even: setMode", responders(client, 2), even, "group/even")
+    client.publish("esp32watch/group/odd/command", {"command": "setRainbowSpeed", "value": 3})
+    ok &= check("group odd: speed", responders(client, 2), odd, "group/odd")
+    client.publish("esp32watch/all/command", {"command": "getGroups"})
+    ok &= check("all: getGroups", responders(client, 2), devices, "all")
+
+    for process in processes:
+        process.wait()
+
+    print("\ncolon lights at (ms from the full second, median over %d s):" % args.seconds)
+    medians = []
+    for device in devices:
+        phases = colon_phases(os.path.join(frames_dir, device + ".txt"))
+        if not phases:
+            print("  %s: no frames" % device)
+            ok = False
+            continue
+        medians.append(statistics.median(phases))
+        print("  %s: %+5d ms  (%d blinks)" % (device, medians[-1], len(phases)))
+    if medians:
+        spread = max(medians) - min(medians)
+        in_step = spread <= PHASE_LIMIT_MS
+        print("spread %d ms: %s" % (spread, "in step" if in_step else "OUT OF STEP"))
+        ok &= in_step
+    print("frames in %s" % frames_dir)
+    return 0 if ok else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,125 @@
+"""Load-test the watch's web server from a PC on the same network.
+
+Runs N parallel clients that request the page, the settings and timer routes
+and /state in a loop, then prints p50/p99 latency per route. The watch's
+/stats counters are reset before the run and read afterwards, so the report
+also shows the longest main-loop pass (how long MQTT and settings handling
+could stall) and the worst render-frame jitter seen while under load.
+
+    python tools/http_load.py 192.168.1.50 --clients 8 --seconds 20
+
+/set and /timer requests only re-apply the current settings and query the
+timer, so a run does not change what the watch shows (it does count as a
+settings change and is written to flash once the run ends).
+"""
+
+import argparse
+import json
+import threading
+import time
+import urllib.request
+
+ROUTES = [
+    ("/", None),
+    ("/state", None),
+    ("/timer", "/timer?action=status"),
+    ("/set", None),  # Query string built from /state
+]
+
+
+def fetch(host, path, timeout):
+    start = time.perf_counter()
+    with urllib.request.urlopen("http://%s%s" % (host, path), timeout=timeout) as response:
+        body = response.read()
+    return time.perf_counter() - start, body
+
+
+def settings_query(state):
+    args = [
+        "brightness=%d" % state["brightness"],
+        "dayBrightness=%d" % state["dayBrightness"],
+        "nightBrightness=%d" % state["nightBrightness"],
+        "transitionBrightness=%d" % state["transitionBrightness"],
+        "mode=%d" % state["mode"],
+        "color=%%23%s" % state["color"].lstrip("#"),
+        "rainbowSpeed=%d" % state["rainbowSpeed"],
+    ]
+    if state["autoBrightness"]:
+        args.append("autoBrightness=on")
+    return "/set?" + "&".join(args)
+
+
+def percentile(samples, p):
+    if not samples:
+        return 0.0
+    ordered = sorted(samples)
+    return ordered[min(len(ordered) - 1, int(len(ordered) * p / 100))]
+
+
+def worker(host, paths, deadline, timeout, results, errors, lock):
+    i = 0
+    while time.perf_counter() < deadline:
+        route, path = paths[i % len(paths)]
+        i += 1
+        try:
+            elapsed, _ = fetch(host, path, timeout)
+            with lock:
+                results[route].append(elapsed)
+        except Exception:
+            with lock:
+                errors[route] = errors.get(route, 0) + 1
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("host", help="IP address or host name of the watch")
+    parser.add_argument("--clients", type=int, default=8, help="parallel connections (default 8)")
+    parser.add_argument("--seconds", type=float, default=10, help="test duration (default 10)")
+    parser.add_argument("--timeout", type=float, default=5, help="per-request timeout (default 5)")
+    args = parser.parse_args()
+
+    _, body = fetch(args.host, "/state", args.timeout)
+    paths = [(route, path or route) for route, path in ROUTES]
+    paths = [(route, settings_query(json.loads(body)) if route == "/set" else path)
+             for route, path in paths]
+
+    fetch(args.host, "/stats?reset=1", args.timeout)
+
+    results = {route: [] for route, _ in ROUTES}
+    errors = {}
+    lock = threading.Lock()
+    deadline = time.perf_counter() + args.seconds
+    threads = []
+    for n in range(args.clients):
+        # Stagger the route order so clients do not hit the same handler in lockstep
+        order = paths[n % len(paths):] + paths[:n % len(paths)]
+        thread = threading.Thread(target=worker,
+                                  args=(args.host, order, deadline, args.timeout, results, errors, lock))
+        thread.start()
+        threads.append(thread)
+    for thread in threads:
+        thread.join()
+
+    _, body = fetch(args.host, "/stats", args.timeout)
+    stats = json.loads(body)
+
+    everything = []
+    print("%-8s %8s %8s %10s %10s" % ("route", "ok", "errors", "p50 ms", "p99 ms"))
+    for route, _ in ROUTES:
+        samples = results[route]
+        everything.extend(samples)
+        print("%-8s %8d %8d %10.1f %10.1f" % (route, len(samples), errors.get(route, 0),
+                                              percentile(samples, 50) * 1000,
+                                              percentile(samples, 99) * 1000))
+    print("%-8s %8d %8d %10.1f %10.1f" % ("all", len(everything), sum(errors.values()),
+                                          percentile(everything, 50) * 1000,
+                                          percentile(everything, 99) * 1000))
+    print("%.1f requests/s with %d clients" % (len(everything) / args.seconds, args.clients))
+    print("loop pass: max %.1f ms, avg %.2f ms" % (stats["loopMaxUs"] / 1000.0, stats["loopAvgUs"] / 1000.0))
+    print("frame jitter: max %.1f ms, avg %.2f ms" % (stats["frameJitterMaxUs"] / 1000.0,
+                                                      stats["frameJitterAvgUs"] / 1000.0))
+    print("free heap: %d bytes" % stats["freeHeap"])
+
+
+if __name__ == "__main__":
+    main()
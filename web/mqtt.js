@@ -0,0 +1,131 @@
+// Just enough MQTT 3.1.1 over WebSocket for the remote control pages, in place of
+// mqtt.js: mqtt.connect(url) returns a client with on(), subscribe(), publish(), end()
+// and connected. QoS 0 only; like mqtt.js it reconnects a second after the connection
+// drops and hands messages over as bytes whose toString() is the UTF-8 text.
+(function () {
+    const KEEPALIVE_S = 60;
+    const RECONNECT_MS = 1000;
+
+    const CONNECT = 0x10, CONNACK = 0x20, PUBLISH = 0x30, SUBSCRIBE = 0x82,
+          PINGREQ = 0xc0, DISCONNECT = 0xe0;
+
+    const encoder = new TextEncoder();
+    const decoder = new TextDecoder();
+
+    function string(text) {
+        const bytes = encoder.encode(text);
+        return [bytes.length >> 8, bytes.length & 0xff, ...bytes];
+    }
+
+    function packet(header, body) {
+        const length = [];
+        let left = body.length;
+        do {
+            let byte = left & 0x7f;
+            left >>= 7;
+            length.push(left ? byte | 0x80 : byte);
+        } while (left);
+        return new Uint8Array([header, ...length, ...body]);
+    }
+
+    function Client(url) {
+        this.url = url;
+        this.clientId = 'mqttjs_' + Math.random().toString(16).slice(2, 10);
+        this.connected = false;
+        this.handlers = {};
+        this.ended = false;
+        this.nextId = 1;
+        this.open();
+    }
+
+    Client.prototype.on = function (event, handler) {
+        (this.handlers[event] = this.handlers[event] || []).push(handler);
+        return this;
+    };
+
+    Client.prototype.emit = function (event, ...args) {
+        (this.handlers[event] || []).forEach(handler => handler(...args));
+    };
+
+    Client.prototype.open = function () {
+        this.buffer = new Uint8Array(0);
+        this.socket = new WebSocket(this.url, 'mqtt');
+        this.socket.binaryType = 'arraybuffer';
+        this.socket.onopen = () => {
+            this.send(CONNECT, [...string('MQTT'), 4, 0x02, 0, KEEPALIVE_S, ...string(this.clientId)]);
+        };
+        this.socket.onmessage = event => this.receive(new Uint8Array(event.data));
+        this.socket.onerror = () => this.emit('error', new Error(`WebSocket error on ${this.url}`));
+        this.socket.onclose = () => {
+            clearInterval(this.pinger);
+            this.connected = false;
+            this.emit('close');
+            if (!this.ended) this.retry = setTimeout(() => this.open(), RECONNECT_MS);
+        };
+    };
+
+    Client.prototype.send = function (header, body) {
+        if (this.socket.readyState === WebSocket.OPEN) this.socket.send(packet(header, body));
+    };
+
+    // Packets can be split over WebSocket messages or share one
+    Client.prototype.receive = function (data) {
+        const joined = new Uint8Array(this.buffer.length + data.length);
+        joined.set(this.buffer);
+        joined.set(data, this.buffer.length);
+        let pos = 0;
+        while (pos + 2 <= joined.length) {
+            let length = 0, shift = 0, at = pos + 1, byte;
+            do {
+                if (at >= joined.length) break;
+                byte = joined[at++];
+                length |= (byte & 0x7f) << shift;
+                shift += 7;
+            } while (byte & 0x80);
+            if (byte & 0x80 || at + length > joined.length) break;
+            this.handle(joined[pos], joined.subarray(at, at + length));
+            pos = at + length;
+        }
+        this.buffer = joined.slice(pos);
+    };
+
+    Client.prototype.handle = function (header, body) {
+        if ((header & 0xf0) === CONNACK) {
+            if (body[1] !== 0) {
+                this.emit('error', new Error(`Connection refused: ${body[1]}`));
+                return;
+            }
+            this.connected = true;
+            this.pinger = setInterval(() => this.send(PINGREQ, []), KEEPALIVE_S * 500);
+            this.emit('connect');
+        } else if ((header & 0xf0) === PUBLISH) {
+            const topicLength = (body[0] << 8) | body[1];
+            const topic = decoder.decode(body.subarray(2, 2 + topicLength));
+            const message = body.slice(2 + topicLength + (header & 0x06 ? 2 : 0));
+            message.toString = () => decoder.decode(message);
+            this.emit('message', topic, message);
+        }
+    };
+
+    Client.prototype.subscribe = function (topic) {
+        const id = this.nextId;
+        this.nextId = this.nextId % 0xffff + 1;
+        this.send(SUBSCRIBE, [id >> 8, id & 0xff, ...string(topic), 0]);
+        return this;
+    };
+
+    Client.prototype.publish = function (topic, message) {
+        this.send(PUBLISH, [...string(topic), ...encoder.encode(message)]);
+        return this;
+    };
+
+    Client.prototype.end = function () {
+        this.ended = true;
+        clearTimeout(this.retry);
+        this.send(DISCONNECT, []);
+        this.socket.close();
+        return this;
+    };
+
+    window.mqtt = { connect: url => new Client(url) };
+})();